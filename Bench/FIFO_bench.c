@@ -0,0 +1,337 @@
+/************************************
+ FIFO_bench.c
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+
+ This file implements a set of benchmarks for FlashFIFO, run against the
+ simulated flash in Test/flash_port_mock.c. Built and run by `make bench`.
+
+ Each benchmark drives one operation (file_write, file_read, file_consume,
+ file_open and so on) over one workload: records of a given size written
+ until the file is full, read and consumed, written and consumed round and
+ round the file, or the file mounted at a given fill level, cleanly or after
+ a power failure, and after a given number of laps. For each, the number of
+ flash reads, writes and erases made, the bytes they moved, and the wall time
+ taken are reported, as JSON on stdout. The flash counts are exact and
+ repeatable, and are what to compare between two versions of FIFO.c; the
+ wall times depend on the host.
+
+ The simulated flash is given the timing of a typical serial NOR part (see
+ flash_port_mock.h), so each result also gives the time that part would have
+ spent on the operations, the energy it would have drawn, and for those that
+ carry data, the throughput this makes for. These predict how a change to FIFO.c
+ fares on a real device, flash time being most of the time spent there.
+
+ ************************************/
+
+#define _POSIX_C_SOURCE 199309L //for clock_gettime
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "flash_port.h"
+#include "Test/flash_port_mock.h"
+
+//what the simulated flash counts, and how to cut its power
+extern uint32_t flash_read_calls, flash_write_calls, flash_erase_calls;
+extern uint32_t flash_read_bytes, flash_write_bytes, flash_erase_bytes;
+void flash_force_power_off(void);
+void flash_force_succeed(void);
+
+#define BENCH_FILE FILE_DRIVE_LOG
+#define MAX_RECORD 300
+#define MOUNTS 10 //times each mount is repeated
+#define LAPS 10 //times round the file for the wrap-around workloads
+
+//the bytes a file can hold, page headers aside
+#define CAPACITY (FILE_DRIVE_LOG_PAGES * (FLASH_PAGE_SIZE - PAGE_COUNTER_SIZE))
+
+//the one handle the benchmarks have open at a time. It is opened into storage
+//of our own, so that they run with or without the handle pool.
+static file_handle_t bench_handle;
+
+static file_handle_t *open_file(void)
+{
+    return file_open_in(BENCH_FILE, FILE_READER | FILE_WRITER, &bench_handle);
+}
+
+typedef struct
+{
+    uint64_t ns;
+    uint64_t flash_ns, energy_pj; //simulated
+    uint32_t reads, writes, erases;
+    uint32_t read_bytes, write_bytes, erase_bytes;
+} bench_counts_t;
+
+//one operation over one workload, measured over as many stretches as it
+//takes
+
+typedef struct
+{
+    const char *op;
+    char workload[40];
+    size_t size; //bytes each op carries, if any
+    uint32_t ops;
+    bench_counts_t total;
+    bench_counts_t mark; //as the current stretch began
+} bench_t;
+
+static uint8_t first_result = 1;
+static uint8_t record[MAX_RECORD];
+
+static void counts_now(bench_counts_t *c)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    c->ns = (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+    c->flash_ns = flash_elapsed_ns;
+    c->energy_pj = flash_energy_pj;
+    c->reads = flash_read_calls;
+    c->writes = flash_write_calls;
+    c->erases = flash_erase_calls;
+    c->read_bytes = flash_read_bytes;
+    c->write_bytes = flash_write_bytes;
+    c->erase_bytes = flash_erase_bytes;
+}
+
+static void bench_init(bench_t *b, const char *op, const char *workload, size_t size)
+{
+    memset(b, 0, sizeof (bench_t));
+    b->op = op;
+    b->size = size;
+    snprintf(b->workload, sizeof (b->workload), "%s", workload);
+}
+
+static void bench_start(bench_t *b)
+{
+    counts_now(&b->mark);
+}
+
+//end the stretch begun by bench_start, which made ops operations
+
+static void bench_stop(bench_t *b, uint32_t ops)
+{
+    bench_counts_t now;
+    counts_now(&now);
+    b->total.ns += now.ns - b->mark.ns;
+    b->total.flash_ns += now.flash_ns - b->mark.flash_ns;
+    b->total.energy_pj += now.energy_pj - b->mark.energy_pj;
+    b->total.reads += now.reads - b->mark.reads;
+    b->total.writes += now.writes - b->mark.writes;
+    b->total.erases += now.erases - b->mark.erases;
+    b->total.read_bytes += now.read_bytes - b->mark.read_bytes;
+    b->total.write_bytes += now.write_bytes - b->mark.write_bytes;
+    b->total.erase_bytes += now.erase_bytes - b->mark.erase_bytes;
+    b->ops += ops;
+}
+
+static double per_op(bench_t *b, uint64_t total)
+{
+    return b->ops ? (double) total / b->ops : 0;
+}
+
+static void bench_report(bench_t *b)
+{
+    printf("%s\n    {\"op\": \"%s\", \"workload\": \"%s\", \"ops\": %u, \"ns\": %llu, \"ns_per_op\": %.1f,\n",
+           first_result ? "" : ",", b->op, b->workload, (unsigned) b->ops, (unsigned long long) b->total.ns, per_op(b, b->total.ns));
+    printf("     \"flash_reads\": %u, \"flash_writes\": %u, \"flash_erases\": %u,\n",
+           (unsigned) b->total.reads, (unsigned) b->total.writes, (unsigned) b->total.erases);
+    printf("     \"bytes_read\": %u, \"bytes_written\": %u, \"bytes_erased\": %u,\n",
+           (unsigned) b->total.read_bytes, (unsigned) b->total.write_bytes, (unsigned) b->total.erase_bytes);
+    printf("     \"flash_reads_per_op\": %.2f, \"flash_writes_per_op\": %.2f, \"flash_erases_per_op\": %.2f",
+           per_op(b, b->total.reads), per_op(b, b->total.writes), per_op(b, b->total.erases));
+    printf(",\n     \"flash_ns\": %llu, \"flash_ns_per_op\": %.1f, \"energy_nj\": %.1f, \"energy_nj_per_op\": %.2f",
+           (unsigned long long) b->total.flash_ns, per_op(b, b->total.flash_ns),
+           b->total.energy_pj / 1000.0, per_op(b, b->total.energy_pj) / 1000);
+    if (b->size && b->total.flash_ns) //bytes per simulated second, in kB/s
+        printf(", \"flash_kb_per_s\": %.1f", (double) b->size * b->ops * 1000000 / b->total.flash_ns);
+    printf("}");
+    first_result = 0;
+}
+
+static file_handle_t *fresh_file(void)
+{
+    flash_init();
+    flash_force_timing(&flash_timing_serial_nor);
+    return open_file();
+}
+
+//write records of the given size until the file holds at least percent of
+//its capacity, or is full. Returns the number written.
+
+static uint32_t fill_to(file_handle_t *f, size_t size, uint8_t percent)
+{
+    uint32_t n = 0;
+    while ((file_size(f) < (size_t) CAPACITY * percent / 100) && file_write(f, record, size))
+        ++n;
+    return n;
+}
+
+//take one record off the front
+
+static void take_one(file_handle_t *f, size_t size)
+{
+    file_read(f, record, size);
+    file_consume(f, size);
+#if FILE_DEFERRED_ERASE
+    file_service(f, 1);
+#endif
+}
+
+//records of one size written until the file is full, then read, then
+//consumed, and then written and consumed round and round the file at half
+//full
+
+static void bench_records(size_t size)
+{
+    char workload[40];
+    bench_t write, read, consume;
+
+    snprintf(workload, sizeof (workload), "fill/record_%u", (unsigned) size);
+    bench_init(&write, "write", workload, size);
+    bench_init(&read, "read", workload, size);
+    bench_init(&consume, "consume", workload, size);
+    file_handle_t *f = fresh_file();
+    uint32_t n = 0;
+    bench_start(&write);
+    while (file_write(f, record, size))
+        ++n;
+    bench_stop(&write, n);
+    bench_start(&read);
+    for (uint32_t i = 0; i < n; ++i)
+        file_read(f, record, size);
+    bench_stop(&read, n);
+    bench_start(&consume);
+    for (uint32_t i = 0; i < n; ++i)
+        file_consume(f, size);
+#if FILE_DEFERRED_ERASE
+    file_service(f, FILE_DRIVE_LOG_PAGES); //the erases consuming left behind
+#endif
+    bench_stop(&consume, n);
+    bench_report(&write);
+    bench_report(&read);
+    bench_report(&consume);
+
+    snprintf(workload, sizeof (workload), "wrap/record_%u", (unsigned) size);
+    bench_init(&write, "write", workload, size);
+    bench_init(&read, "read", workload, size);
+    bench_init(&consume, "consume", workload, size);
+    fill_to(f, size, 50);
+    uint32_t laps = LAPS * (CAPACITY / (size + 2));
+    for (uint32_t i = 0; i < laps; ++i)
+    {
+        bench_start(&write);
+        uint32_t written = (file_write(f, record, size) != 0);
+        bench_stop(&write, written);
+        bench_start(&read);
+        file_read(f, record, size);
+        bench_stop(&read, 1);
+        bench_start(&consume);
+        file_consume(f, size);
+#if FILE_DEFERRED_ERASE
+        file_service(f, 1);
+#endif
+        bench_stop(&consume, 1);
+    }
+    bench_report(&write);
+    bench_report(&read);
+    bench_report(&consume);
+    file_close(f);
+}
+
+//open the file, closed as it is now, MOUNTS times. After a power failure,
+//each open has to do without a checkpoint, as one record written and one
+//consumed have made it stale.
+
+static void bench_mount(bench_t *b, uint8_t power_lost)
+{
+    for (uint8_t i = 0; i < MOUNTS; ++i)
+    {
+        bench_start(b);
+        file_handle_t *f = open_file();
+        bench_stop(b, 1);
+        if (power_lost)
+        {
+            file_write(f, record, 16);
+            take_one(f, 16);
+            flash_force_power_off();
+        }
+        file_close(f);
+        flash_force_succeed();
+    }
+    bench_report(b);
+}
+
+//mounting with the file filled to each level, cleanly and after a power
+//failure, then after a number of laps round the file
+
+static void bench_mounts(void)
+{
+    static const uint8_t levels[] = {0, 50, 100};
+    static const uint16_t laps[] = {1, 10, 100};
+    char workload[40];
+    bench_t b;
+
+    for (uint8_t i = 0; i < sizeof (levels); ++i)
+    {
+        for (uint8_t power_lost = 0; power_lost < 2; ++power_lost)
+        {
+            file_handle_t *f = fresh_file();
+            fill_to(f, 16, levels[i]);
+            file_close(f);
+            snprintf(workload, sizeof (workload), "%s/fill_%u", power_lost ? "power_lost" : "clean", levels[i]);
+            bench_init(&b, "open", workload, 0);
+            bench_mount(&b, power_lost);
+        }
+    }
+
+    for (uint8_t i = 0; i < sizeof (laps) / sizeof (laps[0]); ++i)
+    {
+        file_handle_t *f = fresh_file();
+        fill_to(f, 16, 50);
+        for (uint32_t n = 0; n < laps[i] * (CAPACITY / 18); ++n)
+        {
+            file_write(f, record, 16);
+            take_one(f, 16);
+        }
+        file_close(f);
+        snprintf(workload, sizeof (workload), "power_lost/laps_%u", laps[i]);
+        bench_init(&b, "open", workload, 0);
+        bench_mount(&b, 1);
+    }
+}
+
+int main(void)
+{
+    static const size_t sizes[] = {4, 16, 64, 121, MAX_RECORD};
+
+    for (size_t i = 0; i < MAX_RECORD; ++i)
+        record[i] = (uint8_t) i;
+
+    printf("{\n  \"part\": \"serial_nor\",\n  \"flash_page_size\": %u,\n  \"file_pages\": %u,\n  \"results\": [",
+           (unsigned) FLASH_PAGE_SIZE, (unsigned) FILE_DRIVE_LOG_PAGES);
+    for (uint8_t i = 0; i < sizeof (sizes) / sizeof (sizes[0]); ++i)
+        bench_records(sizes[i]);
+    bench_mounts();
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -34,11 +34,12 @@
 
  ************************************/
 
-#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include "configure.h"
-#include "fifo.h"
+#include "FIFO.h"
 #include "flash_port.h"
+#include "FIFO_trace.h"
 
 /*************************
 
@@ -50,356 +51,2114 @@
  Then, a second write of, e.g. {5, 6, 7} would yield, starting at address 0x0D
  0x00000003, 0xFE, 0x05, 0x06 0x07
 
+ Records too large for a single chunk are written as a chain of chunks, which
+ may run across several pages. Two more bits in the flags tie the chain
+ together: CHUNK_MORE is cleared on every chunk but the last, and CHUNK_CONT on
+ every chunk but the first. So a three chunk record is flagged 0xEE, 0xCE, 0xDE.
+ Readers see the chain as one long record, and it is consumed all at once.
 
  *************************/
 
+//chunk flag bits. Each starts out set in erased flash, and is cleared by a
+//single byte write as the chunk moves through its life.
+
+#define CHUNK_VALID     0x01 //cleared once the chunk's data has been written
+#define CHUNK_CONSUMED  0x02 //cleared once the chunk has been consumed
+#define CHUNK_MORE      0x10 //cleared if the record carries on in the next chunk
+#define CHUNK_CONT      0x20 //cleared if the chunk carries on from the previous chunk
+
+//in a file with more than one cursor, each has a bit of its own, cleared once it
+//has consumed the chunk. CHUNK_CONSUMED is cleared along with the last of them.
+static const uint8_t cursor_bits[4] = {0x04, 0x08, 0x40, 0x80};
+
+#if FILE_CURSOR_MAX > 4
+#error "There are only enough chunk flag bits for four cursors"
+#endif
+
+//the largest chunk that will fit on a page. Sizes of 0xFF mark free space.
+#define MAX_CHUNK_SIZE (((FLASH_PAGE_SIZE - PAGE_COUNTER_SIZE - 2) < 0xFE) ? (FLASH_PAGE_SIZE - PAGE_COUNTER_SIZE - 2) : 0xFE)
+
+//is this a chunk that has been written, but not yet consumed?
+
+static uint8_t chunk_live(uint8_t flags)
+{
+    return !(flags & CHUNK_VALID) && (flags & CHUNK_CONSUMED);
+}
+
 // Initialize any static variables
 
-static uint8_t open_handles[FILE_MAX] = {0}; //keeps track of which handles are currently open
+//which ends of each file are currently open, and a handle on one of them. With
+//FLASH_THREADS, both are guarded by FLASH_LOCK_FILES.
+static uint8_t open_roles[FILE_MAX] = {0};
+static file_handle_t *open_ends[FILE_MAX] = {NULL};
+
+#if FILE_HANDLE_POOL
+//the handles file_open and the like hand out: a whole file or its writer in
+//the first, its reader in the second. Which are in use follows from
+//open_roles, under the same lock.
+static file_handle_t handle_pool[FILE_MAX][2];
+#endif
+
+static void files_lock(void)
+{
+#if FLASH_THREADS
+    flash_lock(FLASH_LOCK_FILES);
+#endif
+}
+
+static void files_unlock(void)
+{
+#if FLASH_THREADS
+    flash_unlock(FLASH_LOCK_FILES);
+#endif
+}
+
+#if (FILE_OFFSET + FILE_TOTAL_PAGES * FLASH_PAGE_SIZE) > FLASH_CHIP_SIZE
+#error "The partition table in FIFO.h does not fit on the chip"
+#endif
+
+#if FILE_CHECKPOINTS && ((CHECKPOINT_OFFSET + FILE_COUNT * FLASH_PAGE_SIZE) > FLASH_CHIP_SIZE)
+#error "The partition table in FIFO.h, with a checkpoint page for each file, does not fit on the chip"
+#endif
+
+//the partition table, in pages per file
+static const uint32_t file_pages[FILE_MAX] = {
+#define FILE_PAGES_ITEM(id, pages) (pages),
+    FILE_TABLE(FILE_PAGES_ITEM)
+#undef FILE_PAGES_ITEM
+};
+
+//where a file starts: the files before it come first
+
+static uint32_t file_start(enum FILE_ID id)
+{
+    uint32_t start = FILE_OFFSET;
+    for (uint8_t i = 0; i < id; ++i)
+        start += file_pages[i] * FLASH_PAGE_SIZE;
+    return start;
+}
+
+//the number of cursors each file has, see FILE_CURSOR_TABLE
+static const uint8_t file_cursors[FILE_MAX] = {
+#define FILE_CURSORS_ITEM(id, cursors) [id] = (cursors),
+    FILE_CURSOR_TABLE(FILE_CURSORS_ITEM)
+#undef FILE_CURSORS_ITEM
+};
+
+//the flag bits of all of a file's cursors
+
+static uint8_t cursor_mask(file_handle_t *handle)
+{
+    uint8_t mask = 0;
+    if (handle->cursors > 1)
+        for (uint8_t c = 0; c < handle->cursors; ++c)
+            mask |= cursor_bits[c];
+    return mask;
+}
+
+//is this a chunk the cursor in use has yet to consume? With none in use, is it
+//one that some cursor has yet to consume?
+
+static uint8_t chunk_unread(file_handle_t *handle, uint8_t flags)
+{
+    if (handle->cursor == FILE_CURSOR_MAX)
+        return chunk_live(flags);
+    return chunk_live(flags) && (flags & cursor_bits[handle->cursor]);
+}
+
+//a helper function to determine the amount of free space.
+
+static uint32_t free_space(file_handle_t *handle)
+{
+    return handle->free_space;
+}
+
+//and the inverse
+
+static uint32_t used_space(file_handle_t *handle)
+{
+    return handle->size - handle->free_space;
+}
+
+//Fields shared with another thread, or with a completion called from an
+//interrupt, are stored and loaded through these. Where the compiler offers
+//atomics, they make sure each side sees the other's writes in order. On a
+//single core, volatile is all it takes, so long as queued writes complete from
+//within flash_write_busy rather than preempting us.
+
+#if defined(__GNUC__)
+#define publish(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#define observe(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#define exchange(field, value) __atomic_exchange_n(&(field), (value), __ATOMIC_ACQ_REL)
+#else
+#define publish(field, value) (*(volatile uint32_t *) &(field) = (value))
+#define observe(field) (*(volatile uint32_t *) &(field))
+
+static uint32_t exchange_volatile(volatile uint32_t *field, uint32_t value)
+{
+    uint32_t was = *field;
+    *field = value;
+    return was;
+}
+#define exchange(field, value) exchange_volatile((volatile uint32_t *) &(field), (value))
+#endif
+
+//Each handle counts what it does, for file_stats. The counts are bumped on the
+//hot paths, so they are nothing more than additions to the handle's fields,
+//and compile to nothing without FILE_STATS.
+
+#if FILE_STATS
+#define tally(handle, field, n) ((handle)->stats.field += (n))
+#else
+#define tally(handle, field, n) ((void) 0)
+#endif
+
+//With FILE_TRACE, each call into the API and each flash transaction is timed
+//and recorded, between these two. Both are nothing without it.
+
+#if FILE_TRACE
+#define trace_start() uint32_t trace_started = flash_ticks()
+#define trace_stop(op, file, size) file_trace_record((op), (file), trace_started, (size))
+#else
+#define trace_start() ((void) 0)
+#define trace_stop(op, file, size) ((void) 0)
+#endif
+
+//Where FlashFIFO is called from more than one thread, the flash is shared by
+//all of them, and is locked for each transaction. The lock is only ever held
+//for the one transaction, never across calls into the API, so that threads
+//working on different files take turns on the bus.
+
+static void bus_lock(void)
+{
+#if FLASH_THREADS
+    flash_lock(FLASH_LOCK_BUS);
+#endif
+}
+
+static void bus_unlock(void)
+{
+#if FLASH_THREADS
+    flash_unlock(FLASH_LOCK_BUS);
+#endif
+}
+
+//Where the part allows, erases are started and left to run in the background.
+//A read made while one is under way suspends it for as long as the read takes.
+//Anything else waits for it to finish, as does a read of the pages being erased,
+//whichever file's handle started it. Likewise, writes may be queued, to be made
+//in the background. Anything but queueing another waits for the queue to empty.
+
+#if FLASH_ERASE_SUSPEND
+//the erase last started, set with the bus locked. Each erase waits for the one
+//before, so if flash_erase_busy says one is under way, this is it.
+static uint32_t erase_addr;
+static uint32_t erase_len;
+#endif
+
+//must a read wait before it goes ahead? With the bus locked.
+
+static uint8_t read_waits(uint32_t addr, size_t n)
+{
+#if FLASH_ASYNC
+    if (flash_write_busy())
+        return 1;
+#endif
+#if FLASH_ERASE_SUSPEND
+    if ((addr < erase_addr + erase_len) && (addr + n > erase_addr) && flash_erase_busy()) //we need to see how it turns out
+        return 1;
+#endif
+    (void) addr;
+    (void) n;
+    return 0;
+}
+
+static int read_flash(uint32_t addr, void *data, size_t n)
+{
+    bus_lock();
+    while (read_waits(addr, n))
+    {
+        bus_unlock();
+        bus_lock();
+    }
+#if FLASH_ERASE_SUSPEND
+    if (flash_erase_busy())
+    {
+        flash_erase_suspend();
+        trace_start();
+        int read = flash_read(addr, data, n);
+        trace_stop(FILE_TRACE_FLASH_READ, FILE_MAX, n);
+        flash_erase_resume();
+        bus_unlock();
+        return read;
+    }
+#endif
+    trace_start();
+    int read = flash_read(addr, data, n);
+    trace_stop(FILE_TRACE_FLASH_READ, FILE_MAX, n);
+    bus_unlock();
+    return read;
+}
+
+//lock the bus with no erase under way. The erase may have been started on
+//behalf of another file, so the bus is given up between polls, letting that
+//file's thread read in the meantime.
+
+static void bus_lock_unerased(void)
+{
+    bus_lock();
+#if FLASH_ERASE_SUSPEND
+    while (flash_erase_busy())
+    {
+        bus_unlock();
+        bus_lock();
+    }
+#endif
+}
+
+//the same, with no writes queued either
+
+static void bus_lock_idle(void)
+{
+    bus_lock_unerased();
+#if FLASH_ASYNC
+    while (flash_write_busy())
+    {
+        bus_unlock();
+        bus_lock_unerased();
+    }
+#endif
+}
+
+#if FLASH_ERASE_SUSPEND || FLASH_ASYNC
+
+//wait for any erase under way to finish, and any queued writes to be made
+
+static void settle(void)
+{
+    bus_lock_idle();
+    bus_unlock();
+}
+#endif
+
+//The page cache. Every flash access made on behalf of a handle goes through
+//the helpers below. Reads that fall within a single page are served out
+//of a RAM copy of that page, which is pulled in from flash in one burst the
+//first time it is needed. Writes go straight through to flash and are mirrored
+//into the copy; erases simply throw the copy away. With FLASH_ASYNC, writes to
+//the file's own pages are made out of the copy instead, see cache_queue.
+
+#if FLASH_ASYNC
+#define PROGRAM_DONE    0xFFFFFFFF //a write slot that is free
+#define PROGRAM_QUEUED  0xFFFFFFFE //one whose write has yet to complete
+
+static void program_init(file_handle_t *handle)
+{
+    for (uint8_t i = 0; i < FILE_PROGRAMS; ++i)
+        handle->program[i].mark = PROGRAM_DONE;
+    handle->program_next = 0;
+    handle->program_failed = 0;
+}
+
+//a queued write has completed. If the handle's pointer was published while it
+//was queued, it was the last write the pointer covers, so publish it now.
+
+static void program_done(void *context, int written)
+{
+    file_program_t *program = (file_program_t *) context;
+    program->written = written;
+    if (written != (int) program->length)
+        publish(program->handle->program_failed, 1);
+    uint32_t mark = exchange(program->mark, PROGRAM_DONE);
+    if (mark < PROGRAM_QUEUED)
+        publish(program->handle->published_offset, mark);
+}
+
+//we don't know what made it to flash from a write that failed, so forget the page
+
+static void program_check(file_handle_t *handle)
+{
+    if (exchange(handle->program_failed, 0))
+        handle->cache_valid = 0;
+}
+#endif
+
+static int cache_read(file_handle_t *handle, uint32_t addr, void *data, size_t n)
+{
+#if FLASH_ASYNC
+    program_check(handle);
+#endif
+    uint32_t page = FLASH_PAGE_SIZE * (addr / FLASH_PAGE_SIZE);
+    if ((addr + n) > (page + FLASH_PAGE_SIZE)) //spans a page boundary, don't bother caching
+    {
+        tally(handle, flash_reads, 1);
+        return read_flash(addr, data, n);
+    }
+
+    if (!handle->cache_valid || (handle->cache_addr != page))
+    {
+        handle->cache_valid = 0;
+        tally(handle, flash_reads, 1);
+        if (read_flash(page, handle->cache, FLASH_PAGE_SIZE) != FLASH_PAGE_SIZE)
+        {
+            tally(handle, flash_reads, 1);
+            return read_flash(addr, data, n);
+        }
+        handle->cache_addr = page;
+        handle->cache_valid = 1;
+    }
+    memcpy(data, handle->cache + (addr - page), n);
+    return n;
+}
+
+#if FLASH_ASYNC
+
+//queue a write to the cached page. The copy is brought up to date first, and
+//the write made straight out of it, so the caller's buffer is free as soon as
+//we return. The copy stays put until the write completes, as pulling in another
+//page means reading flash, which waits on the queue. Returns what flash_write
+//would have, if the write has completed already, or else n.
+
+static int cache_queue(file_handle_t *handle, uint32_t addr, void *data, size_t n)
+{
+    for (uint32_t i = addr; i < addr + n; ++i)
+        handle->cache[i - handle->cache_addr] &= ((uint8_t*) data)[i - addr]; //programming can only clear bits
+
+    tally(handle, flash_writes, 1);
+    file_program_t *program = &handle->program[handle->program_next];
+    handle->program_next = (handle->program_next + 1) % FILE_PROGRAMS;
+    for (;;)
+    {
+        bus_lock_unerased();
+        if (observe(program->mark) == PROGRAM_DONE) //the slot is free, its last write FILE_PROGRAMS back complete
+        {
+            program->handle = handle;
+            program->length = n;
+            publish(program->mark, PROGRAM_QUEUED);
+            trace_start();
+            uint8_t queued = flash_write_submit(addr, handle->cache + (addr - handle->cache_addr), n, program_done, program);
+            trace_stop(FILE_TRACE_FLASH_WRITE_SUBMIT, FILE_MAX, n);
+            if (queued)
+                break;
+            program->mark = PROGRAM_DONE;
+        }
+        flash_write_busy(); //wait for the queue to move along
+        bus_unlock();
+    }
+    bus_unlock();
+
+    if (observe(program->mark) != PROGRAM_DONE)
+        return n;
+    program_check(handle);
+    return program->written;
+}
+#endif
+
+//write straight through to flash, and wait for it, whatever the page
+
+static int cache_write_through(file_handle_t *handle, uint32_t addr, void *data, size_t n)
+{
+    tally(handle, flash_writes, 1);
+    bus_lock_idle();
+    trace_start();
+    int written = flash_write(addr, data, n);
+    trace_stop(FILE_TRACE_FLASH_WRITE, FILE_MAX, n);
+    bus_unlock();
+    if (handle->cache_valid && (addr < handle->cache_addr + FLASH_PAGE_SIZE) && (addr + n > handle->cache_addr))
+    {
+        if (written != (int) n) //we don't know what made it to flash, so forget the page
+        {
+            handle->cache_valid = 0;
+            return written;
+        }
+        for (uint32_t i = addr; i < addr + n; ++i)
+        {
+            if ((i >= handle->cache_addr) && (i < handle->cache_addr + FLASH_PAGE_SIZE))
+                handle->cache[i - handle->cache_addr] &= ((uint8_t*) data)[i - addr]; //programming can only clear bits
+        }
+    }
+    return written;
+}
+
+static int cache_write(file_handle_t *handle, uint32_t addr, void *data, size_t n)
+{
+#if FLASH_ASYNC
+    uint8_t check;
+    if ((addr >= handle->start) && (addr + n <= handle->start + handle->size) && ((addr % FLASH_PAGE_SIZE) + n <= FLASH_PAGE_SIZE) //a single page of the file
+            && (cache_read(handle, addr, &check, 1) == 1) && handle->cache_valid) //which is now cached
+        return cache_queue(handle, addr, data, n);
+#endif
+    return cache_write_through(handle, addr, data, n);
+}
+
+static void cache_erase(file_handle_t *handle, uint32_t addr, size_t len)
+{
+    tally(handle, flash_erases, 1);
+    tally(handle, pages_erased, len / FLASH_PAGE_SIZE);
+    bus_lock_idle();
+    trace_start();
+    flash_erase(addr, len);
+    trace_stop(FILE_TRACE_FLASH_ERASE, FILE_MAX, len);
+    bus_unlock();
+    if (handle->cache_valid && (handle->cache_addr >= FLASH_PAGE_SIZE * (addr / FLASH_PAGE_SIZE)) && (handle->cache_addr < addr + len))
+        handle->cache_valid = 0;
+}
+
+#if FLASH_ERASE_SUSPEND
+
+//start an erase, without waiting for it to finish
+
+static void cache_erase_start(file_handle_t *handle, uint32_t addr, size_t len)
+{
+    tally(handle, flash_erases, 1);
+    tally(handle, pages_erased, len / FLASH_PAGE_SIZE);
+    bus_lock_idle();
+    trace_start();
+    flash_erase_start(addr, len);
+    trace_stop(FILE_TRACE_FLASH_ERASE_START, FILE_MAX, len);
+    erase_addr = addr;
+    erase_len = len;
+    bus_unlock();
+    if (handle->cache_valid && (handle->cache_addr >= FLASH_PAGE_SIZE * (addr / FLASH_PAGE_SIZE)) && (handle->cache_addr < addr + len))
+        handle->cache_valid = 0;
+}
+#endif
+
+//a compact summary of a single page, built by summarize_page below. All of the
+//recovery decisions made by file_open are made from these summaries, so that
+//each page need only be pulled out of flash once.
+
+typedef struct
+{
+    uint8_t scanned; //set once the page has been summarized
+    uint8_t flag; //the first byte of the page header: 0xFF if free, 0xFE if claimed
+    uint32_t sequence; //the sequence number from the page header
+    uint8_t corrupt; //set if the page cannot possibly have been written by us
+    uint16_t end; //offset of the first free byte in the page, FLASH_PAGE_SIZE if full
+    uint16_t first_live; //offset of the first valid, unconsumed chunk, FLASH_PAGE_SIZE if none
+    uint8_t orphan; //set if that chunk carries on a record whose start has been consumed
+    uint8_t tail; //whether the last record on the page is finished, see below
+    uint16_t open_chain; //offset of the first chunk of an unfinished record at the end of the page
+    uint8_t open_head; //set if the unfinished record starts on this page
+} page_summary_t;
+
+//files can be large, so the summaries made while recovering a handle are kept
+//off the stack, in one buffer big enough for the largest file. Only one handle
+//is recovered at a time, under FLASH_LOCK_FILES.
+typedef union
+{
+#define FILE_PAGES_MEMBER(id, pages) uint8_t id[pages];
+    FILE_TABLE(FILE_PAGES_MEMBER)
+#undef FILE_PAGES_MEMBER
+} largest_file_t;
+
+static page_summary_t summaries[sizeof (largest_file_t)];
+
+#define TAIL_EMPTY  0 //no chunks were written on the page
+#define TAIL_CLOSED 1 //the last record written on the page is complete
+#define TAIL_OPEN   2 //the last record written on the page carries on past it
+
+//helpers for moving between page numbers and offsets within the file
+
+static uint32_t page_count(file_handle_t *handle)
+{
+    return handle->size / FLASH_PAGE_SIZE;
+}
+
+static uint32_t page_of(uint32_t offset)
+{
+    return offset / FLASH_PAGE_SIZE;
+}
+
+static uint32_t next_page(file_handle_t *handle, uint32_t page)
+{
+    return (page + 1) % page_count(handle);
+}
+
+//the page most recently claimed by the writer. Usually this is the page the
+//write pointer is on, unless it is lingering at the start of the next one.
+
+static uint32_t newest_page(file_handle_t *handle)
+{
+    if (!(handle->write_offset % FLASH_PAGE_SIZE))
+        return (page_of(handle->write_offset) + page_count(handle) - 1) % page_count(handle);
+    return page_of(handle->write_offset);
+}
+
+//the number of data bytes (that is, not counting page counters) that precede
+//offset in the file. The distance between two pointers is the difference of
+//their indices.
+
+static uint32_t data_index(uint32_t offset)
+{
+    uint32_t in_page = offset % FLASH_PAGE_SIZE;
+    return page_of(offset) * (FLASH_PAGE_SIZE - PAGE_COUNTER_SIZE) + ((in_page > PAGE_COUNTER_SIZE) ? (in_page - PAGE_COUNTER_SIZE) : 0);
+}
+
+//the free space in the file, worked out from the pointers. Everything between
+//them is spoken for.
+
+static uint32_t free_between(file_handle_t *handle)
+{
+    uint32_t capacity = handle->size - (PAGE_COUNTER_SIZE * page_count(handle));
+    uint32_t used = (data_index(handle->write_offset) + capacity - data_index(handle->destructive_read_offset)) % capacity;
+    if (!used && !(handle->write_offset % FLASH_PAGE_SIZE) && (handle->destructive_read_offset != handle->write_offset)) //lingering, and the read pointer is on the page it waits for: full
+        used = capacity;
+    return capacity - used;
+}
+
+//Split files. The two ends of a split file keep their own copies of both
+//pointers, and publish the one each owns for the other. A pointer is only ever
+//published once the flash writes it covers are complete. With FLASH_ASYNC,
+//that may not be until the last of them completes, which then publishes it.
+
+//catch up on what the other end has published, before doing anything
+
+static void sync_peer(file_handle_t *handle)
+{
+    if (!handle->peer)
+        return;
+    uint32_t offset = observe(handle->peer->published_offset);
+    if (handle->role & FILE_WRITER)
+        handle->destructive_read_offset = offset;
+    else if (offset != handle->write_offset)
+    {
+        handle->write_offset = offset;
+        handle->cache_valid = 0; //the writer has been at work behind our copy
+    }
+    handle->free_space = free_between(handle);
+}
+
+//publish the pointer this end owns, once done
+
+static void publish_pointer(file_handle_t *handle)
+{
+    uint32_t offset = (handle->role & FILE_WRITER) ? handle->write_offset : handle->destructive_read_offset;
+#if FLASH_ASYNC
+    //if the last write queued has yet to complete, leave it to publish
+    file_program_t *last = &handle->program[(handle->program_next + FILE_PROGRAMS - 1) % FILE_PROGRAMS];
+    if (exchange(last->mark, offset) != PROGRAM_DONE)
+        return;
+    publish(last->mark, PROGRAM_DONE);
+#endif
+    publish(handle->published_offset, offset);
+}
+
+static void put_le32(uint8_t *bytes, uint32_t value)
+{
+    for (uint8_t i = 0; i < 4; ++i)
+        bytes[i] = (uint8_t) (value >> (8 * i));
+}
+
+static uint32_t get_le32(uint8_t *bytes)
+{
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+}
+
+//could a page header have been written by us? The flag can only be 0xFF or
+//0xFE, and a page is only ever claimed by writing a sequence number other than
+//0xFFFFFFFF and then the flag. So a claimed page without a sequence number, or
+//a free page with one, must be corrupted.
+
+static uint8_t header_corrupt(uint8_t flag, uint32_t sequence)
+{
+    if (flag == 0xFF)
+        return (sequence != 0xFFFFFFFF);
+    if (flag == 0xFE)
+        return (sequence == 0xFFFFFFFF);
+    return 1; //definitely corrupt!
+}
+
+#if FILE_WEAR
+
+//Wear. Every erase is counted in the header of each page it erases, as one
+//more than the most that any of them had been erased before, so that pages
+//erased together as a block are stamped alike. The count goes down just after
+//the erase. An erase left to run in the background is stamped once it is done
+//with, before the handle next erases, claims a page, or syncs. A page with no
+//count, never having been erased by us, or having lost its count to a power
+//failure before it went down, works its count out from its neighbours. The
+//count is followed by a flag byte, written once the count is down, as with
+//checkpoints, so that a count torn by a power failure is never mistaken for a
+//good one. The checkpoint page keeps its count and flag in its last five
+//bytes, past the checkpoints.
+
+#define WEAR_OFFSET 5 //where the count goes in a page header
+#define WEAR_SIZE 5 //the count, and its flag
+#define CHECKPOINT_WEAR (FLASH_PAGE_SIZE - WEAR_SIZE) //and in a checkpoint page
+#define WEAR_UNKNOWN 0xFFFFFFFF
+
+//the count in a stamp, or WEAR_UNKNOWN if it was never committed. A count of 0
+//is never stamped, and one of 0xFFFFFFFF can't be told from a missing one.
+
+static uint32_t wear_committed(uint8_t *stamp)
+{
+    uint32_t count = get_le32(stamp);
+    if ((stamp[4] != 0xFE) || !count)
+        return WEAR_UNKNOWN;
+    return count;
+}
+
+//the count in a page header, or WEAR_UNKNOWN if it has none we can trust
+
+static uint32_t wear_of(uint8_t *header)
+{
+    if (header_corrupt(header[0], get_le32(&header[1])))
+        return WEAR_UNKNOWN;
+    return wear_committed(&header[WEAR_OFFSET]);
+}
+
+static uint8_t wear_in_file(file_handle_t *handle, uint32_t page)
+{
+    return (page >= handle->start) && (page < handle->start + handle->size);
+}
+
+//the count of the page at page, read without pulling the page into the cache
+
+static uint32_t wear_read(file_handle_t *handle, uint32_t page)
+{
+    uint8_t header[PAGE_COUNTER_SIZE];
+    uint32_t at = wear_in_file(handle, page) ? 0 : CHECKPOINT_WEAR;
+    size_t n = wear_in_file(handle, page) ? PAGE_COUNTER_SIZE : WEAR_SIZE;
+    if (handle->cache_valid && (handle->cache_addr == page))
+        memcpy(header, handle->cache + at, n);
+    else
+    {
+        tally(handle, flash_reads, 1);
+        read_flash(page + at, header, n);
+    }
+    return wear_in_file(handle, page) ? wear_of(header) : wear_committed(header);
+}
+
+//the count to stamp on the pages from addr to addr + len, read before they are
+//erased
+
+static uint32_t wear_next(file_handle_t *handle, uint32_t addr, uint32_t len)
+{
+    uint32_t most = WEAR_UNKNOWN;
+    for (uint32_t page = addr; page < addr + len; page += FLASH_PAGE_SIZE)
+    {
+        uint32_t count = wear_read(handle, page);
+        if ((count != WEAR_UNKNOWN) && ((most == WEAR_UNKNOWN) || (count > most)))
+            most = count;
+    }
+    if (most != WEAR_UNKNOWN)
+        return most + 1;
+    if (!wear_in_file(handle, addr) || (len >= handle->size))
+        return 1;
+
+    //pages are erased in turn, from the start of the file to the end and round
+    //again. So the page before has already been erased as often as these are
+    //about to be, and the page after has yet to be, unless we are at the start.
+    if (addr > handle->start)
+        most = wear_read(handle, addr - FLASH_PAGE_SIZE);
+    else if ((most = wear_read(handle, addr + len)) != WEAR_UNKNOWN)
+        ++most;
+    return (most == WEAR_UNKNOWN) ? 1 : most;
+}
+
+//stamp the pages last erased with their count, waiting for the erase if need
+//be. The flag goes down after the count.
+
+static void wear_stamp(file_handle_t *handle)
+{
+    if (!handle->wear_len)
+        return;
+    uint8_t stamp[WEAR_SIZE];
+    put_le32(stamp, handle->wear_count);
+    stamp[4] = 0xFE;
+    uint32_t end = handle->wear_addr + handle->wear_len;
+    handle->wear_len = 0;
+    for (uint32_t page = handle->wear_addr; page < end; page += FLASH_PAGE_SIZE)
+    {
+        uint32_t at = page + (wear_in_file(handle, page) ? WEAR_OFFSET : CHECKPOINT_WEAR);
+        if (cache_write_through(handle, at, stamp, 4) == 4)
+            cache_write_through(handle, at + 4, &stamp[4], 1);
+    }
+}
+
+static void wear_erase(file_handle_t *handle, uint32_t addr, uint32_t len)
+{
+    wear_stamp(handle);
+    handle->wear_count = wear_next(handle, addr, len);
+    cache_erase(handle, addr, len);
+    handle->wear_addr = addr;
+    handle->wear_len = len;
+    wear_stamp(handle);
+}
+
+#if FLASH_ERASE_SUSPEND
+
+static void wear_erase_start(file_handle_t *handle, uint32_t addr, uint32_t len)
+{
+    wear_stamp(handle);
+    handle->wear_count = wear_next(handle, addr, len);
+    cache_erase_start(handle, addr, len);
+    handle->wear_addr = addr;
+    handle->wear_len = len;
+}
+#endif
+
+#else
+#define wear_erase(handle, addr, len) cache_erase((handle), (addr), (len))
+#define wear_erase_start(handle, addr, len) cache_erase_start((handle), (addr), (len))
+#define wear_stamp(handle) ((void) 0)
+#endif
+
+#if FILE_STATS
+
+//a write has been turned away because the write pointer is lingering at the
+//start of a page that has yet to be erased. It lingers, as far as we are
+//concerned, from then until it moves in.
+
+static void linger_begin(file_handle_t *handle)
+{
+    if (handle->lingering)
+        return;
+    handle->lingering = 1;
+    ++handle->stats.lingers;
+#if FLASH_TICKS
+    handle->linger_since = flash_ticks();
+#endif
+}
+
+//how long it has been lingering so far
+
+static uint32_t linger_ticks(file_handle_t *handle)
+{
+#if FLASH_TICKS
+    if (handle->lingering)
+        return flash_ticks() - handle->linger_since;
+#else
+    (void) handle;
+#endif
+    return 0;
+}
+
+//a write has been turned away, for want of space or of an erased page. The
+//write pointer stops at the start of a page whenever it can't move in, but
+//only if the page has been consumed, and so counts as free space, is it
+//waiting on an erase.
+
+static void tally_refused(file_handle_t *handle)
+{
+    if ((handle->write_offset % FLASH_PAGE_SIZE) || (free_space(handle) < FLASH_PAGE_SIZE - PAGE_COUNTER_SIZE))
+        ++handle->stats.writes_full;
+    else
+    {
+        ++handle->stats.writes_lingering;
+        linger_begin(handle);
+    }
+}
+#endif
+
+//write a fresh page header at the write pointer, which must be sitting at the
+//start of an erased page, and move in. The sequence number goes down first and
+//the flag last, so that a claim torn by a power failure leaves a page that was
+//never started with something written on it, which recovery knows to erase.
+//The erase count, if any, is already there. Returns the sequence number
+//written.
+
+static uint32_t claim_page(file_handle_t *handle)
+{
+    uint8_t header[5];
+    header[0] = 0xFE;
+    put_le32(&header[1], handle->sequence);
+    wear_stamp(handle); //the page may be the one just erased
+    cache_write(handle, handle->start + handle->write_offset + 1, &header[1], 4);
+    cache_write(handle, handle->start + handle->write_offset, header, 1);
+    handle->write_offset += PAGE_COUNTER_SIZE;
+#if FILE_STATS
+    handle->stats.linger_ticks += linger_ticks(handle);
+    handle->lingering = 0;
+#endif
+    return handle->sequence++;
+}
+
+//a chunk that ends one byte short of the end of its page leaves a byte too
+//small to hold another, which the writer skips once it moves on. Returns 1 if
+//offset is such a byte.
+
+static uint8_t leftover_byte(file_handle_t *handle, uint32_t offset)
+{
+    return ((offset % FLASH_PAGE_SIZE) == FLASH_PAGE_SIZE - 1) && (offset != handle->write_offset);
+}
+
+//where a pointer moving forward onto offset actually lands: wrapping around at
+//the end of the file, and stepping over a leftover byte at the end of a page
+//and the header of the next. A reader that catches up with a writer, still at
+//the leftover byte or lingering at the start of a page, stops right there, at
+//the write pointer, until the writer has moved in.
+
+static uint32_t landing(file_handle_t *handle, uint32_t offset)
+{
+    if (leftover_byte(handle, offset))
+        ++offset;
+    if (offset >= handle->size)
+        offset = 0;
+    if (!(offset % FLASH_PAGE_SIZE) && (offset != handle->write_offset))
+        offset += PAGE_COUNTER_SIZE;
+    return offset;
+}
+
+//the offset of the chunk following the one at offset, stepping over page
+//counters and any space left over at the end of a page
+
+static uint32_t next_chunk(file_handle_t *handle, uint32_t offset)
+{
+    uint8_t size = 0;
+    cache_read(handle, handle->start + offset, &size, 1);
+    offset += size + 2;
+    if ((offset % FLASH_PAGE_SIZE) && (offset < handle->size) && (offset != handle->write_offset))
+    {
+        cache_read(handle, handle->start + offset, &size, 1);
+        if (size == 0xFF) //leftovers at end of page
+            offset += FLASH_PAGE_SIZE - (offset % FLASH_PAGE_SIZE);
+    }
+    return landing(handle, offset);
+}
+
+//flag the chunk at offset as consumed, if it isn't already
+
+static void mark_consumed(file_handle_t *handle, uint32_t offset)
+{
+    uint8_t flags = 0xFF;
+    cache_read(handle, handle->start + offset + 1, &flags, 1);
+    if (chunk_unread(handle, flags))
+    {
+        if (handle->cursor == FILE_CURSOR_MAX) //for every cursor at once
+            flags &= ~CHUNK_CONSUMED;
+        else
+        {
+            flags &= ~cursor_bits[handle->cursor];
+            if (!(flags & cursor_mask(handle))) //the last of them
+                flags &= ~CHUNK_CONSUMED;
+        }
+        cache_write(handle, handle->start + offset + 1, &flags, 1);
+    }
+}
+
+//The record index. Records are numbered, and their bytes counted, from the
+//anchor, which is kept at or before the oldest record not yet consumed, and
+//moved past each page as it is reclaimed. Every stride'th record between the
+//anchor and the tail is entered, so a record is never more than a stride's
+//walk from one that the index knows. With FILE_RECORD_INDEX set to 0, nothing
+//is kept: the anchor is the oldest record not yet consumed, and every seek
+//walks from there.
+
+#define INDEX_BY_RECORD 0
+#define INDEX_BY_BYTE   1
+#define INDEX_BY_OFFSET 2
+
+static file_index_entry_t index_anchor(file_handle_t *handle)
+{
+#if FILE_RECORD_INDEX
+    return handle->index.anchor;
+#else
+    file_index_entry_t anchor = {0, 0, handle->destructive_read_offset};
+    return anchor;
+#endif
+}
+
+//how far forward of the anchor offset lies. Everything the index covers lies
+//between the anchor and the write pointer.
+
+static uint32_t index_distance(file_handle_t *handle, uint32_t offset)
+{
+    return (offset + handle->size - index_anchor(handle).offset) % handle->size;
+}
+
+static uint32_t index_key(file_handle_t *handle, file_index_entry_t *at, uint8_t by)
+{
+    if (by == INDEX_BY_RECORD)
+        return at->record;
+    if (by == INDEX_BY_BYTE)
+        return at->bytes;
+    return index_distance(handle, at->offset);
+}
+
+#if FILE_RECORD_INDEX
+
+static file_index_entry_t *index_entry(file_handle_t *handle, uint8_t i)
+{
+    return &handle->index.entry[(handle->index.first + i) % FILE_INDEX_ENTRIES];
+}
+
+//start the index afresh from the oldest record not yet consumed
+
+static void index_reset(file_handle_t *handle)
+{
+    file_index_t *index = &handle->index;
+    index->anchor.record = 0;
+    index->anchor.bytes = 0;
+    index->anchor.offset = handle->destructive_read_offset;
+    index->tail = index->anchor;
+    index->first = 0;
+    index->count = 0;
+    index->stride = 1;
+    index->caught_up = (handle->destructive_read_offset == handle->write_offset);
+}
+
+//the tail has moved on to the start of record at->record. Enter it if it is
+//due; if the index is full, drop every other entry and space them twice as
+//far apart from here on.
+
+static void index_add(file_handle_t *handle, file_index_entry_t *at)
+{
+    file_index_t *index = &handle->index;
+    index->tail = *at;
+    if (at->record % index->stride)
+        return;
+    if (index->count == FILE_INDEX_ENTRIES)
+    {
+        uint8_t kept = 0;
+        for (uint8_t i = 0; i < index->count; ++i)
+        {
+            if (!(index_entry(handle, i)->record % (2 * index->stride)))
+                *index_entry(handle, kept++) = *index_entry(handle, i);
+        }
+        index->count = kept;
+        index->stride *= 2;
+        if (at->record % index->stride)
+            return;
+    }
+    *index_entry(handle, index->count++) = *at;
+}
+#endif
+
+//step over anything at offset that doesn't start a record: page headers,
+//leftovers at the end of a page, invalid chunks, and the rest of a chain
+//whose start has gone, as far as the next record or the write pointer
+
+static uint32_t index_settle(file_handle_t *handle, uint32_t offset)
+{
+    for (;;)
+    {
+        offset = landing(handle, offset);
+        if (offset == handle->write_offset)
+            return offset;
+        uint8_t size = 0xFF, flags = 0xFF;
+        cache_read(handle, handle->start + offset, &size, 1);
+        if (size == 0xFF) //leftovers at end of page
+        {
+            offset += FLASH_PAGE_SIZE - (offset % FLASH_PAGE_SIZE);
+            continue;
+        }
+        cache_read(handle, handle->start + offset + 1, &flags, 1);
+        if (!(flags & CHUNK_VALID) && (flags & CHUNK_CONT))
+            return offset;
+        offset = next_chunk(handle, offset);
+    }
+}
+
+//moves *offset onto the next record, and returns 1 with its size and where
+//whatever follows it starts, or 0 if we are at the write pointer. Consumed
+//records count as much as any other.
+
+static uint8_t index_record(file_handle_t *handle, uint32_t *offset, uint32_t *size, uint32_t *next)
+{
+    *offset = index_settle(handle, *offset);
+    uint32_t chunk = *offset;
+    *size = 0;
+    for (;;)
+    {
+        if (chunk == handle->write_offset) //the record isn't all there yet
+            return 0;
+        uint8_t chunk_size = 0, flags = 0xFF;
+        cache_read(handle, handle->start + chunk, &chunk_size, 1);
+        cache_read(handle, handle->start + chunk + 1, &flags, 1);
+        *size += chunk_size;
+        chunk = next_chunk(handle, chunk);
+        if (flags & CHUNK_MORE)
+            break;
+    }
+    *next = chunk;
+    return 1;
+}
+
+#if FILE_RECORD_INDEX
+
+//the furthest position the index knows of that doesn't lie past target
+
+static file_index_entry_t index_find(file_handle_t *handle, uint8_t by, uint32_t target)
+{
+    file_index_t *index = &handle->index;
+    if (index_key(handle, &index->tail, by) <= target)
+        return index->tail;
+    file_index_entry_t found = index->anchor;
+    uint8_t low = 0, high = index->count;
+    while (low < high)
+    {
+        uint8_t mid = (low + high) / 2;
+        if (index_key(handle, index_entry(handle, mid), by) <= target)
+        {
+            found = *index_entry(handle, mid);
+            low = mid + 1;
+        }
+        else
+            high = mid;
+    }
+    return found;
+}
+#else
+#define index_find(handle, by, target) index_anchor(handle)
+#endif
+
+//walk at forward, a record at a time, to the last record that starts at or
+//before target, or to the write pointer. Whatever lies past the tail is
+//entered on the way.
+
+static void index_walk(file_handle_t *handle, file_index_entry_t *at, uint8_t by, uint32_t target)
+{
+    uint32_t size, next;
+    while (index_record(handle, &at->offset, &size, &next))
+    {
+        file_index_entry_t ahead = {at->record + 1, at->bytes + size, next};
+        if (index_key(handle, &ahead, by) > target)
+            return;
+        *at = ahead;
+#if FILE_RECORD_INDEX
+        if (at->record > handle->index.tail.record)
+            index_add(handle, at);
+#endif
+    }
+#if FILE_RECORD_INDEX
+    if (at->record >= handle->index.tail.record) //at the write pointer
+    {
+        handle->index.tail = *at;
+        handle->index.caught_up = 1;
+    }
+#endif
+}
+
+//find the record that starts at or before target, entering any new ground
+
+static file_index_entry_t index_seek(file_handle_t *handle, uint8_t by, uint32_t target)
+{
+    file_index_entry_t at = index_find(handle, by, target);
+    index_walk(handle, &at, by, target);
+    return at;
+}
+
+#if FILE_RECORD_INDEX
+
+//a record of size bytes has just been written at the write pointer. If the
+//index had caught up, it carries on from the new write pointer.
+
+static void index_written(file_handle_t *handle, size_t size)
+{
+    file_index_t *index = &handle->index;
+    if (!(handle->role & FILE_READER) || !index->caught_up)
+        return;
+    file_index_entry_t at = {index->tail.record + 1, index->tail.bytes + size, handle->write_offset};
+    index_add(handle, &at);
+}
+
+//the page at page_start has been consumed, and is about to be erased. Move the
+//anchor past its records, which can still be read, and forget them.
+
+static void index_reclaim(file_handle_t *handle, uint32_t page_start)
+{
+    file_index_t *index = &handle->index;
+    uint32_t size, next;
+    if (!(handle->role & FILE_READER)) //still being recovered, or a writer, which keeps no index
+        return;
+    for (;;)
+    {
+        index->anchor.offset = index_settle(handle, index->anchor.offset);
+        if (page_of(index->anchor.offset) != page_of(page_start))
+            break;
+        if (!index_record(handle, &index->anchor.offset, &size, &next))
+            break;
+        index->anchor.record++;
+        index->anchor.bytes += size;
+        index->anchor.offset = next;
+    }
+    while (index->count && (index_entry(handle, 0)->record <= index->anchor.record))
+    {
+        index->first = (index->first + 1) % FILE_INDEX_ENTRIES;
+        --index->count;
+    }
+    if (index->tail.record <= index->anchor.record)
+        index->tail = index->anchor;
+}
+#endif
+
+//this is a helper method called by open below. It summarizes page p, unless
+//that has already been done.
+
+static page_summary_t *summarize_page(file_handle_t *handle, page_summary_t *summary, uint32_t p)
+{
+    page_summary_t *s = &summary[p];
+    if (s->scanned)
+        return s;
+
+    uint32_t page = handle->start + (p * FLASH_PAGE_SIZE);
+
+    //the page cache means that this first read pulls in the whole page, and
+    //everything that follows is served out of RAM
+    uint8_t header[PAGE_COUNTER_SIZE];
+    cache_read(handle, page, header, PAGE_COUNTER_SIZE);
+    s->flag = header[0];
+    s->sequence = get_le32(&header[1]);
+    s->scanned = 1;
+    s->end = FLASH_PAGE_SIZE;
+    s->first_live = FLASH_PAGE_SIZE;
+    s->orphan = 0;
+    s->tail = TAIL_EMPTY;
+    s->open_chain = FLASH_PAGE_SIZE;
+    s->open_head = 0;
+
+    // What does a corrupted page look like? One sign is in the header.
+    // But it is possible, of course, for a corrupted page to have a sensible
+    // header. Thus, we can attempt to parse the page; a failure to parse will
+    // also indicate a corrupted page.
+    s->corrupt = header_corrupt(s->flag, s->sequence);
+
+    uint32_t addr = PAGE_COUNTER_SIZE;
+    while (!s->corrupt && (addr < FLASH_PAGE_SIZE - 1))
+    {
+        uint8_t size, valid;
+        cache_read(handle, page + addr, &size, 1);
+        cache_read(handle, page + addr + 1, &valid, 1);
+        //look for a combination that cannot happen
+        if (size == 0xFF)
+        {
+            if (valid != 0xFF)
+                s->corrupt = 1;
+            if (s->end == FLASH_PAGE_SIZE)
+                s->end = addr;
+            addr += 2;
+            continue;
+        }
+        if ((s->end != FLASH_PAGE_SIZE) || (s->flag == 0xFF)) //data following free space, or on a page that was never started
+            s->corrupt = 1;
+        else if ((valid != 0xFF) && ((valid | CHUNK_CONSUMED | CHUNK_MORE | CHUNK_CONT | cursor_mask(handle)) != 0xFE)) //valid, and no other bits
+            s->corrupt = 1;
+        else if (addr + size + 2 > FLASH_PAGE_SIZE) //chunks never span pages
+            s->corrupt = 1;
+        else if (valid != 0xFF) //torn chunks are neither here nor there
+        {
+            if (chunk_live(valid) && (s->first_live == FLASH_PAGE_SIZE))
+            {
+                s->first_live = addr;
+                s->orphan = !(valid & CHUNK_CONT);
+            }
+            //keep track of whether the last record on the page is finished
+            if (valid & CHUNK_MORE)
+            {
+                s->tail = TAIL_CLOSED;
+                s->open_chain = FLASH_PAGE_SIZE;
+            }
+            else if ((valid & CHUNK_CONT) || (s->tail != TAIL_OPEN)) //the start of a record, or the first we see of one
+            {
+                s->tail = TAIL_OPEN;
+                s->open_chain = addr;
+                s->open_head = ((valid & CHUNK_CONT) != 0);
+            }
+        }
+        addr += size + 2;
+    }
+    //there may be a single byte left at the very end of the page, too small to hold a chunk
+    if (!s->corrupt && (addr == FLASH_PAGE_SIZE - 1) && (s->end == FLASH_PAGE_SIZE))
+    {
+        uint8_t size;
+        cache_read(handle, page + addr, &size, 1);
+        if (size == 0xFF)
+            s->end = addr;
+    }
+    return s;
+}
+
+//summarize every page in the file, in a single forward pass
 
-//a helper function to determine the amount of free space.
+static void scan_pages(file_handle_t *handle, page_summary_t *summary)
+{
+    for (uint32_t p = 0; p < page_count(handle); ++p)
+        summarize_page(handle, summary, p);
+}
 
-static uint32_t free_space(file_handle_t *handle)
+static void find_and_repair_corrupted_pages(file_handle_t *handle, page_summary_t *summary)
 {
-    return handle->free_space;
+    // The good news is that there can be at most one corrupted page, because we
+    // erase pages one at a time. Once erased, it summarizes as a fresh page.
+    for (uint32_t p = 0; p < page_count(handle); ++p)
+    {
+        if (summary[p].corrupt)
+        {
+            wear_erase(handle, handle->start + (p * FLASH_PAGE_SIZE), FLASH_PAGE_SIZE);
+            summary[p].flag = 0xFF;
+            summary[p].sequence = 0xFFFFFFFF;
+            summary[p].corrupt = 0;
+            summary[p].end = PAGE_COUNTER_SIZE;
+            summary[p].first_live = FLASH_PAGE_SIZE;
+        }
+    }
 }
 
-//and the inverse
+//a power failure part way through writing a chain leaves the start of a
+//record at the end of the file, with the rest of it missing. The record was
+//never finished, so throw away whatever made it into flash by marking it
+//consumed. Walk back from the newest page until we find where it started.
 
-static uint32_t used_space(file_handle_t *handle)
+static void discard_torn_record(file_handle_t *handle, page_summary_t *summary)
 {
-    return FILE_SIZE - handle->free_space;
+    uint32_t p = newest_page(handle);
+    for (uint32_t i = 0; i < page_count(handle); ++i)
+    {
+        page_summary_t *s = summarize_page(handle, summary, p);
+        if (s->corrupt || (s->flag == 0xFF) || (s->tail == TAIL_CLOSED))
+            return;
+        if (s->tail == TAIL_OPEN)
+        {
+            for (uint32_t addr = s->open_chain; addr + 2 <= s->end;)
+            {
+                uint8_t size = 0;
+                cache_read(handle, handle->start + (p * FLASH_PAGE_SIZE) + addr, &size, 1);
+                mark_consumed(handle, (p * FLASH_PAGE_SIZE) + addr);
+                addr += size + 2;
+            }
+            s->scanned = 0; //the summary no longer matches the page
+            if (s->open_head)
+                return;
+        }
+
+        //the record was begun on the page written before this one
+        uint32_t sequence = s->sequence;
+        p = (p + page_count(handle) - 1) % page_count(handle);
+        page_summary_t *t = summarize_page(handle, summary, p);
+        if ((t->flag == 0xFF) || (t->sequence + 1 != sequence))
+            return;
+    }
 }
 
-//thanks to Tom Stephens at HID Global for this cool little snippet.
+//given the newest page written, place the write pointer just past the last
+//chunk written to it. When resuming from a checkpoint, pages may have been
+//claimed since it was taken; these are followed forward by their sequence
+//numbers.
+//If the page is full, the write pointer either moves into the next page, if
+//it is free, or lingers at its start until it is. Any record left unfinished
+//at the end of the file is then discarded. Returns 0 if a corrupted page got
+//in the way.
+
+static uint8_t settle_write_pointer(file_handle_t *handle, page_summary_t *summary, uint32_t p)
+{
+    for (uint32_t i = 0; i < page_count(handle); ++i)
+    {
+        page_summary_t *s = summarize_page(handle, summary, p);
+        uint32_t q = next_page(handle, p);
+        page_summary_t *t = summarize_page(handle, summary, q);
+        if (s->corrupt || t->corrupt)
+            return 0;
+        handle->sequence = s->sequence + 1;
+        if ((t->flag != 0xFF) && (t->sequence == s->sequence + 1) && (q != p))
+        {
+            p = q; //claimed after this one, carry on from there
+            continue;
+        }
+        if (s->end < FLASH_PAGE_SIZE)
+        {
+            handle->write_offset = (p * FLASH_PAGE_SIZE) + s->end;
+            break;
+        }
+
+        //this page is /completely/ full, so we need to be at the start of the
+        //next one. Either a) it is free, and we can move in, or b) it is holding
+        //a not-yet-consumed chunk, and we need to linger and wait.
+        handle->write_offset = q * FLASH_PAGE_SIZE;
+        if (t->flag == 0xFF) //FREE SPACE! move in.
+        {
+            t->flag = 0xFE;
+            t->sequence = claim_page(handle);
+        }
+        break;
+    }
+    discard_torn_record(handle, summary);
+    return 1;
+}
 
-uint8_t count_ones(uint8_t b)
+static void site_write_pointer(file_handle_t* handle, page_summary_t *summary)
 {
-    uint8_t ct = 0;
-    for (; b > 0; b &= (uint8_t) (b - 1), ct++);
+    //Now, let's identify where the write pointer goes.
+    //Each page has a sequence number in its header, counting up with every
+    //  page claimed. The last page written is the one with the largest value!
+    //  A flag of 0xFF indicates an unused page. Sequence numbers are 32 bits
+    //  wide, so they never wrap in the life of the part, however many pages
+    //  the file has.
+
+    uint32_t last_write_page = 0;
+    uint8_t found = 0;
+    for (uint32_t p = 0; p < page_count(handle); ++p)
+    {
+        if ((summary[p].flag != 0xFF) && (!found || (summary[p].sequence > summary[last_write_page].sequence)))
+        {
+            last_write_page = p;
+            found = 1;
+        }
+    }
+
+    if (!found) //nothing written anywhere; start at the top. The sequence
+        //carries on from the last checkpoint, if there is one, so that the
+        //pages claimed from now on can never match the ones it names
+    {
+        handle->write_offset = 0;
+        summary[0].flag = 0xFE;
+        summary[0].sequence = claim_page(handle);
+        return;
+    }
 
-    return ct;
+    settle_write_pointer(handle, summary, last_write_page);
 }
 
-//this is a helper method called by open below
+//Reclamation. Fully consumed pages are not always erased straight away. If
+//the part has a block erase, pages are held back until the rest of their block
+//has been consumed too, and then the whole block is erased at once. With
+//FILE_DEFERRED_ERASE, pages are held back until file_service gets around to
+//them, so that the consumer never waits on an erase. Pages that are held back
+//always form a single run, since they are consumed in order.
+
+//how much of the run can be erased in one go from its start: a whole block if
+//the run starts on one, and covers it, within the file; otherwise a page.
+//Returns 0 if the first page is part of a block that is still being consumed.
+//The reader of a split file that has consumed everything there is can't wait
+//for the rest of the block, as the writer may be waiting on it.
 
-static void find_and_repair_corrupted_pages(file_handle_t *handle)
+static uint32_t reclaim_length(file_handle_t *handle)
 {
-    // The good news is that there can be at most one corrupted page, because we
-    // erase pages one at a time.
-    // What does a corrupted page look like? One sign is in the first byte.
-    // The first byte—the page counter—can only contain numbers in the sequence
-    // 0b11111111
-    // 0b11111110
-    // 0b11111100
-    // 0b11111000
-    // etc. So if we see a page with a page counter not in this sequence, we know
-    // it must be corrupted.
-    // But it is possible, of course, for a corrupted page to have a first
-    // byte in that sequence. Thus, we can attempt to parse the page; a failure
-    // to parse will also indicate a corrupted page.
-    for (uint32_t i = 0; i < FILE_SIZE; i += FLASH_PAGE_SIZE)
-    {
-        uint8_t page_counter;
-        uint8_t size, valid, corrupt;
-        uint32_t addr;
-        flash_read(handle->start + i, &page_counter, PAGE_COUNTER_SIZE);
-        switch (page_counter)
-        {
-        case 0xFF:
-        case 0xFE:
-        case 0xFC:
-        case 0xF8:
-        case 0xF0:
-        case 0xE0:
-        case 0xC0:
-        case 0x80:
-        case 0x00:
-            //do it the hard way
-            size = 0;
-            valid = 0;
-            corrupt = 0;
-            addr = i + 1;
-            while (!corrupt && (addr < i + FLASH_PAGE_SIZE - 1))
-            {
-                flash_read(handle->start + addr, &size, 1);
-                flash_read(handle->start + addr + 1, &valid, 1);
-                //look for a combination that cannot happen
-                if (((size == 0xFF) && (valid != 0xFF)) || ((valid != 0xFF) && (valid != 0xFE) && (valid != 0xFC)))
-                {
-                    corrupt = 1;
-                }
-                if ((size == 0xFF) && (valid = 0xFF))
-                {
-                    addr += 2;
-                }
-                else
-                {
-                    addr += size + 2;
-                }
-            }
-            if (corrupt)
-            {
-                flash_erase(handle->start + i, FLASH_PAGE_SIZE);
-                i = FILE_SIZE; //break out of for loop, no need to look any further.
-            }
+    uint32_t block = flash_block_size();
+    if ((block == FLASH_PAGE_SIZE) || ((handle->start + handle->reclaim_start) % block) || (handle->reclaim_start + block > handle->size))
+        return FLASH_PAGE_SIZE;
+    if (handle->reclaim_pages * FLASH_PAGE_SIZE >= block)
+        return block;
+    if (handle->peer && (handle->destructive_read_offset == handle->write_offset))
+        return FLASH_PAGE_SIZE;
+    return 0;
+}
 
-            break;
-        default:
-            //definitely corrupt!
-            flash_erase(handle->start + i, FLASH_PAGE_SIZE);
-            i = FILE_SIZE; //break out of for loop, no need to look any further.
-            break;
-        }
+//erase len bytes from the start of the run
+
+static void reclaim_erase(file_handle_t *handle, uint32_t len)
+{
+#if FLASH_ERASE_SUSPEND
+    wear_erase_start(handle, handle->start + handle->reclaim_start, len);
+#else
+    wear_erase(handle, handle->start + handle->reclaim_start, len);
+#endif
+    handle->reclaim_start += len;
+    if (handle->reclaim_start >= handle->size)
+        handle->reclaim_start = 0;
+    handle->reclaim_pages -= len / FLASH_PAGE_SIZE;
+}
+
+//erase every page being held back, a block at a time wherever we can
+
+static void reclaim_run(file_handle_t *handle)
+{
+    while (handle->reclaim_pages)
+    {
+        uint32_t len = reclaim_length(handle);
+        reclaim_erase(handle, len ? len : FLASH_PAGE_SIZE);
+    }
+}
+
+//hold back the consumed page at page_start, erasing it, and whatever went
+//before it, once there is no more of its block to come
+
+static void reclaim_page(file_handle_t *handle, uint32_t page_start)
+{
+#if FILE_RECORD_INDEX
+    index_reclaim(handle, page_start);
+#endif
+    if (handle->reclaim_pages && (page_start != (handle->reclaim_start + handle->reclaim_pages * FLASH_PAGE_SIZE) % handle->size)) //doesn't carry on the run
+        reclaim_run(handle);
+    if (!handle->reclaim_pages)
+        handle->reclaim_start = page_start;
+    ++handle->reclaim_pages;
+
+#if !FILE_DEFERRED_ERASE
+    uint32_t next = page_start + FLASH_PAGE_SIZE;
+    if ((next >= handle->size) || !((handle->start + next) % flash_block_size()))
+        reclaim_run(handle);
+#endif
+}
+
+//is the page at offset erased, and ready for the writer to move in? If it is
+//being held back for a block erase, the writer can't wait, so erase it now.
+//The writer of a split file can't erase for itself, and must wait on the reader.
+
+static uint8_t page_ready(file_handle_t *handle, uint32_t offset)
+{
+    uint8_t flag = 0;
+    if (handle->peer && (handle->cache_addr == handle->start + offset)) //the reader erases pages behind our copy
+        handle->cache_valid = 0;
+    cache_read(handle, handle->start + offset, &flag, 1);
+    if ((flag != 0xFF) && handle->reclaim_pages
+            && (((page_of(offset) + page_count(handle) - page_of(handle->reclaim_start)) % page_count(handle)) < handle->reclaim_pages))
+    {
+        reclaim_run(handle);
+        cache_read(handle, handle->start + offset, &flag, 1);
+    }
+    return (flag == 0xFF);
+}
+
+//a power failure part way through consuming a chain can leave the end of it
+//behind at the front of the file. Its start is gone, so finish the job.
+
+static void finish_consuming_record(file_handle_t *handle, page_summary_t *summary, uint32_t offset)
+{
+    while (offset != handle->write_offset)
+    {
+        uint8_t flags = 0xFF;
+        cache_read(handle, handle->start + offset + 1, &flags, 1);
+        mark_consumed(handle, offset);
+        summary[page_of(offset)].scanned = 0; //the summary no longer matches the page
+        if (flags & CHUNK_MORE) //that was the last of it
+            return;
+        offset = next_chunk(handle, offset);
     }
 }
 
-static void site_write_pointer(file_handle_t* handle)
+//walk forward from page p to locate the destructive read pointer. It belongs
+//at the first chunk that has been neither consumed nor abandoned by a failed
+//write. Any page we pass on the way that holds nothing of interest was fully
+//consumed but lost power before it could be erased, so we finish the job.
+//Returns 0 if a corrupted page got in the way.
+
+static uint8_t settle_read_pointer(file_handle_t *handle, page_summary_t *summary, uint32_t p)
 {
-        //Now, let's identify where the write pointer goes.
-    //Each page has a byte at the beginning indicating the write sequence;
-    //  the number of '1's indicates the write order. Writes start from 0xFE
-    //  and continue down to 0x00; The last page written is the one with the
-    //  largest value! A value of 0xFF indicates an unused page
-    //  Notice that this scheme is bound to fail when files can be larger than
-    //  seven blocks. In this case, a two-byte scheme or more is called for.
-    //  The modificiations to make that happen shouldn't be hard to make.
+    uint8_t lingering = !(handle->write_offset % FLASH_PAGE_SIZE);
+    uint32_t write_page = page_of(handle->write_offset);
+    uint32_t newest = newest_page(handle);
+    uint8_t found = 0;
 
-    uint8_t first_write_page = 0;
-    uint8_t pages_written = 0;
-    uint8_t smallest = 0xFF;
-    uint8_t i;
-    uint8_t counter = 0;
-    for (i = 0; i < (FILE_SIZE / FLASH_PAGE_SIZE); ++i) //iterate over pages
+    for (uint32_t i = 0; !found && (i < page_count(handle)); ++i)
     {
-        //read first byte
-        flash_read(handle->start + (FLASH_PAGE_SIZE * i), &counter, 1);
-        if (counter != 0xFF)
+        page_summary_t *s = summarize_page(handle, summary, p);
+        if (s->corrupt)
+            return 0;
+        if ((p == write_page) && !lingering) //we have caught up with the write pointer
+        {
+            handle->destructive_read_offset = handle->write_offset;
+            if (s->first_live < handle->write_offset % FLASH_PAGE_SIZE)
+                handle->destructive_read_offset = (p * FLASH_PAGE_SIZE) + s->first_live;
+            found = 1;
+        }
+        else if ((s->flag != 0xFF) && (s->first_live < s->end))
+        {
+            handle->destructive_read_offset = (p * FLASH_PAGE_SIZE) + s->first_live;
+            found = 1;
+        }
+        else
         {
-            ++pages_written;
-            if (counter < smallest)
+            if (s->flag != 0xFF) //consumed, but never erased.
             {
-                smallest = counter;
-                first_write_page = i;
+                reclaim_page(handle, p * FLASH_PAGE_SIZE);
+                s->flag = 0xFF;
+                s->sequence = 0xFFFFFFFF;
+                s->end = PAGE_COUNTER_SIZE;
             }
+            if (p == newest) //everything has been consumed
+                break;
+            p = next_page(handle, p);
+        }
+        if (found && (handle->destructive_read_offset != handle->write_offset) && s->orphan)
+        {
+            finish_consuming_record(handle, summary, handle->destructive_read_offset);
+            return settle_read_pointer(handle, summary, p);
         }
     }
-    handle->write_offset = first_write_page * FLASH_PAGE_SIZE;
-    if (smallest < 0xFF)
+
+    //the write pointer may have been lingering, waiting on a page we just erased.
+    //If erases are deferred, it carries on lingering until the page is needed.
+#if !FILE_DEFERRED_ERASE
+    reclaim_run(handle);
+#endif
+    uint8_t flag = 0;
+    cache_read(handle, handle->start + (write_page * FLASH_PAGE_SIZE), &flag, 1);
+    if (lingering && (flag == 0xFF))
     {
-        handle->write_count = 8 - count_ones(smallest) + 1;
-        if (handle->write_count == 9) handle->write_count = 1;
+        summary[write_page].flag = 0xFE;
+        summary[write_page].sequence = claim_page(handle);
     }
-    if (pages_written)
-        handle->free_space = FILE_SIZE - ((pages_written - 1)*(FLASH_PAGE_SIZE - PAGE_COUNTER_SIZE)) - (FILE_SIZE / FLASH_PAGE_SIZE * PAGE_COUNTER_SIZE); //number of bytes written - number of counter bytes
+    if (!found)
+        handle->destructive_read_offset = handle->write_offset;
 
-    //now that we have the /page/ let's identify the /chunk/!
-    //possibility that this page is entirely free, which we need to consider. Will recognize it because first byte is 0xFF
-    //the strategy is to skip chunks until we find one whose size is 0xFF.
-    //we do have to worry about flipping pages here, because we need to manage the page counter bytes, of course!
-    uint8_t size = 0;
-    flash_read(handle->start + handle->write_offset + 1, &size, 1);
-    //a free chunk is one in which the size is 0xFF
-    if (size == 0xFF) //starting on a fresh page
-    {
-        //read in the page counter to see if it is free or not.
-        uint8_t check = 0;
-        flash_read(handle->start + handle->write_offset, &check, PAGE_COUNTER_SIZE);
-        if (check == 0xFF) //FREE SPACE! move in.
-        {
-            uint8_t counter = (0xFF << handle->write_count);
-            ++handle->write_count;
-            if (handle->write_count == 9) handle->write_count = 1;
-            flash_write(handle->start + handle->write_offset, &counter, PAGE_COUNTER_SIZE);
-        }
-        handle->write_offset += PAGE_COUNTER_SIZE;
-    }
-    else //need to find our place in this page.
-    {
-        //skip past page counter
-        handle->write_offset += PAGE_COUNTER_SIZE;
-        flash_read(handle->start + handle->write_offset, &size, 1);
-        while (size != 0xFF)
-        {
-            //advance a chunk
-            handle->write_offset += size + 2;
-            handle->free_space -= size + 2;
-            //now, we may have crossed a page boundary. If we did, it is because the last page written was /completely/ full.
-            // We need to stop advancing at this point, because either a) we have found free space or b) we have bumped up against a not-yet-consumed chunk
-            // check which case that is, and if the space is free, then we need to set the page counter
-            if (!(handle->write_offset % FLASH_PAGE_SIZE)) //yep, hit the start of a new page!
+    //Finally, set the read offset to be the destructive read offset
+    handle->raw_read_chunk_start = handle->destructive_read_offset;
+    handle->raw_read_chunk_offset = 0;
+
+    handle->free_space = free_between(handle);
+    return 1;
+}
+
+static void site_read_pointer(file_handle_t *handle, page_summary_t *summary)
+{
+    //Pages are consumed in the order they were written, so the read pointer
+    //belongs on the oldest page still holding anything, which is the first
+    //such page following the newest one.
+    uint32_t newest = newest_page(handle);
+    uint32_t p = next_page(handle, newest);
+    while ((p != newest) && (summary[p].flag == 0xFF))
+        p = next_page(handle, p);
+
+    settle_read_pointer(handle, summary, p);
+}
+
+//Searching for the pointers. The claimed pages always form a single run around
+//the file, oldest to newest, with sequence numbers counting up one page at a
+//time: pages are only ever claimed just past the newest, and erased from the
+//oldest. So once any claimed page has been found, both ends of the run can be
+//found by binary search, reading nothing but page headers. Only the pages the
+//pointers end up on, and their neighbours, are read in full.
+
+#define SEARCH_MIN_PAGES 8 //smaller files are just as cheap to scan outright
+
+//read the header of page p, without pulling the whole page into the cache.
+//Returns 0 if the header is corrupt.
+
+static uint8_t read_header(file_handle_t *handle, uint32_t p, uint8_t *flag, uint32_t *sequence)
+{
+    uint8_t header[PAGE_COUNTER_SIZE];
+    uint32_t page = handle->start + (p * FLASH_PAGE_SIZE);
+    if (handle->cache_valid && (handle->cache_addr == page))
+        memcpy(header, handle->cache, PAGE_COUNTER_SIZE);
+    else
+    {
+        tally(handle, flash_reads, 1);
+        read_flash(page, header, PAGE_COUNTER_SIZE);
+    }
+    *flag = header[0];
+    *sequence = get_le32(&header[1]);
+    return !header_corrupt(*flag, *sequence);
+}
+
+//how far does the run carry on from the claimed page anchor, with the given
+//sequence number, in the given direction? Returns 0 if a corrupt header got
+//in the way.
+
+static uint8_t search_run(file_handle_t *handle, uint32_t anchor, uint32_t sequence, uint8_t forward, uint32_t *extent)
+{
+    uint32_t n = page_count(handle);
+    uint32_t in = 0, out = n; //anchor +/- in is in the run, anchor +/- out is not
+    while (out - in > 1)
+    {
+        uint32_t k = in + (out - in) / 2;
+        uint8_t flag;
+        uint32_t found;
+        if (!read_header(handle, forward ? (anchor + k) % n : (anchor + n - k) % n, &flag, &found))
+            return 0;
+        if ((flag != 0xFF) && (found == (forward ? sequence + k : sequence - k)))
+            in = k;
+        else
+            out = k;
+    }
+    *extent = in;
+    return 1;
+}
+
+//locate both pointers by searching. Returns 0 if anything looks amiss, in
+//which case the whole file must be scanned.
+
+static uint8_t search_pointers(file_handle_t *handle, page_summary_t *summary)
+{
+    uint32_t n = page_count(handle);
+    if (n < SEARCH_MIN_PAGES)
+        return 0;
+
+    //look for any claimed page, probing ever more finely: the first page,
+    //then half way along, then the quarters, and so on. A run covering a good
+    //part of the file is found within a handful of probes.
+    uint32_t stride = 1;
+    while (stride < n)
+        stride <<= 1;
+    uint32_t anchor = n;
+    uint32_t sequence = 0;
+    for (uint32_t step = stride; step && (anchor == n); step >>= 1)
+    {
+        for (uint32_t p = (step == stride) ? 0 : step; p < n; p += 2 * step)
+        {
+            uint8_t flag;
+            if (!read_header(handle, p, &flag, &sequence))
+                return 0;
+            if (flag != 0xFF)
             {
-                //read in the page counter to see if it is free or not.
-                uint8_t check = 0;
-                flash_read(handle->start + handle->write_offset, &check, PAGE_COUNTER_SIZE);
-                if (check == 0xFF) //FREE SPACE! move in.
-                {
-                    uint8_t counter = (0xFF << handle->write_count);
-                    ++handle->write_count;
-                    if (handle->write_count == 9) handle->write_count = 1;
-                    flash_write(handle->start + handle->write_offset, &counter, PAGE_COUNTER_SIZE);
-                    handle->write_offset += PAGE_COUNTER_SIZE;
-                }
-                //else, do nothing, do not move into the page; it is not ready for writing. Need to linger where we are and wait.
-                break; //exit the loop
+                anchor = p;
+                break;
             }
-            flash_read(handle->start + handle->write_offset, &size, 1);
         }
     }
+    if (anchor == n) //nothing claimed anywhere
+        return 0;
+
+    uint32_t ahead, behind;
+    if (!search_run(handle, anchor, sequence, 1, &ahead) || !search_run(handle, anchor, sequence, 0, &behind) || (ahead + behind >= n))
+        return 0;
+    uint32_t newest = (anchor + ahead) % n;
+    uint32_t oldest = (anchor + n - behind) % n;
+
+    //an erase interrupted by a power failure can only have been of the pages
+    //just before the oldest, so make sure they really are free
+    uint32_t suspect = flash_block_size() / FLASH_PAGE_SIZE;
+    if (suspect > n - (ahead + behind + 1))
+        suspect = n - (ahead + behind + 1);
+    for (uint32_t i = 1; i <= suspect; ++i)
+    {
+        page_summary_t *s = summarize_page(handle, summary, (oldest + n - i) % n);
+        if (s->corrupt || (s->flag != 0xFF))
+            return 0;
+    }
+
+    if (!settle_write_pointer(handle, summary, newest))
+        return 0;
+    return settle_read_pointer(handle, summary, oldest);
 }
 
-static void site_read_pointer(file_handle_t *handle)
+#if FILE_CHECKPOINTS
+
+// A checkpoint is a snapshot of the pointers in a handle, written to the
+// file's checkpoint page by file_sync. Each one is laid out as
+//   flag, write_offset (4), destructive_read_offset (4), free_space (4),
+//   sequence (4), newest page's sequence number (4), read page's (4), check
+// The flag byte is written last, so that a torn checkpoint is never mistaken
+// for a good one: 0xFF = never committed, 0xFE = valid, 0xFC = stale, meaning
+// the file has been modified since. A checkpoint is marked stale /before/ the
+// first modification following it. Checkpoints are appended until the page
+// fills, at which point it is erased and we start again from the top. Losing
+// the page to an interrupted erase costs nothing more than a full scan.
+
+#define CHECKPOINT_RECORD_SIZE 26
+#if FILE_WEAR
+#define CHECKPOINT_SLOTS (CHECKPOINT_WEAR / CHECKPOINT_RECORD_SIZE) //the page's erase count comes last
+#else
+#define CHECKPOINT_SLOTS (FLASH_PAGE_SIZE / CHECKPOINT_RECORD_SIZE)
+#endif
+
+static uint32_t checkpoint_addr(file_handle_t *handle, uint8_t slot)
 {
-    //now, somewhat more difficult, we need to locate the destructive read pointer.
-    //The general procedure will involve moving /backwards/ from the write pointer.
-    // Needless to say, there is no method for moving the pointer backwards chunk-by-chunk.
-    // Instead, we need to move backwards a page at a time, then move forwards through that page, keeping
-    // track of potential candidate landing chunks. Fun!
-    //we begin by starting at the page the write pointer is on.
-    handle->destructive_read_offset = FLASH_PAGE_SIZE * (handle->write_offset / FLASH_PAGE_SIZE) + PAGE_COUNTER_SIZE;
+    return CHECKPOINT_OFFSET + (handle->file_id * FLASH_PAGE_SIZE) + (slot * CHECKPOINT_RECORD_SIZE);
+}
 
+static uint8_t checkpoint_check(uint8_t *record)
+{
+    uint8_t check = 0x5A;
+    for (uint8_t i = 1; i < CHECKPOINT_RECORD_SIZE - 1; ++i)
+        check ^= record[i];
+    return check;
+}
 
-    // we need to loop, skipping
-    // backwards a page at a time, and looking for either: the last consumed
-    // chunk, or an empty page, or we encounter the page the write pointer is on
-    uint8_t done = 0;
-    uint8_t pages_examined = 0;
-    while (!done)
+//mark the most recent checkpoint stale. Must be called before modifying the file.
+
+static void checkpoint_invalidate(file_handle_t *handle)
+{
+    if (!handle->checkpoint_live)
+        return;
+    uint8_t flag = 0xFC;
+    cache_write(handle, checkpoint_addr(handle, handle->checkpoint_slot - 1), &flag, 1);
+    handle->checkpoint_live = 0;
+}
+
+static void checkpoint_write(file_handle_t *handle)
+{
+    if (handle->checkpoint_live) //nothing has changed since the last one
+        return;
+
+    if (handle->checkpoint_slot >= CHECKPOINT_SLOTS)
     {
-        //examine the page.
+        wear_erase(handle, checkpoint_addr(handle, 0), FLASH_PAGE_SIZE);
+        handle->checkpoint_slot = 0;
+    }
 
-        //first, see if write pointer is on this page. since we have already examined this page earlier, we know
-        // that at this point, it must be that the write pointer is sitting and waiting on the destructive read pointer to free the page
-        // up. So park the destructive read pointer where it is, and break
-        if (handle->write_offset + 1 == handle->destructive_read_offset)
-            break;
+    uint8_t record[CHECKPOINT_RECORD_SIZE];
+    put_le32(&record[1], handle->write_offset);
+    put_le32(&record[5], handle->destructive_read_offset);
+    put_le32(&record[9], handle->free_space);
+    put_le32(&record[13], handle->sequence);
+    cache_read(handle, handle->start + (newest_page(handle) * FLASH_PAGE_SIZE) + 1, &record[17], 4);
+    cache_read(handle, handle->start + (page_of(handle->destructive_read_offset) * FLASH_PAGE_SIZE) + 1, &record[21], 4);
+    record[25] = checkpoint_check(record);
+
+    uint32_t addr = checkpoint_addr(handle, handle->checkpoint_slot);
+    ++handle->checkpoint_slot;
+    if (cache_write(handle, addr + 1, &record[1], CHECKPOINT_RECORD_SIZE - 1) != CHECKPOINT_RECORD_SIZE - 1)
+        return;
+    record[0] = 0xFE;
+    if (cache_write(handle, addr, record, 1) == 1)
+        handle->checkpoint_live = 1;
+}
 
-        if ((pages_examined > 0) && (handle->write_offset - handle->destructive_read_offset < FLASH_PAGE_SIZE))
+//attempt to restore the handle from its most recent checkpoint. If nothing has
+//happened since it was taken, we are done without scanning anything at all.
+//If the file has been modified since, we pick up where the checkpoint left off,
+//examining only the pages that could have been touched in the meantime.
+//Returns 0 if there is no usable checkpoint, and the file must be scanned.
+
+static uint8_t checkpoint_restore(file_handle_t *handle, page_summary_t *summary)
+{
+    uint8_t record[CHECKPOINT_RECORD_SIZE];
+    uint8_t latest[CHECKPOINT_RECORD_SIZE];
+    uint8_t latest_slot = CHECKPOINT_SLOTS;
+
+    //find the next free slot, and the most recent checkpoint that was committed
+    handle->checkpoint_slot = 0;
+    handle->checkpoint_live = 0;
+    for (uint8_t slot = 0; slot < CHECKPOINT_SLOTS; ++slot)
+    {
+        cache_read(handle, checkpoint_addr(handle, slot), record, CHECKPOINT_RECORD_SIZE);
+        for (uint8_t i = 0; i < CHECKPOINT_RECORD_SIZE; ++i)
         {
-            //here is an oddball case. If we've come full circle—basically, we backed into the write pointer, from whence we started,
-            //then it must be the case that the /next/ page (the one we just came from) is where we should be, because it will have been
-            //written, but not consumed. This page is going to have been freshly erased, and so is not where we should land.
-            //move to the next page
-            handle->destructive_read_offset += FLASH_PAGE_SIZE;
-            if (handle->destructive_read_offset >= FILE_SIZE)
-                handle->destructive_read_offset = 0 + PAGE_COUNTER_SIZE;
-            break;
+            if (record[i] != 0xFF)
+                handle->checkpoint_slot = slot + 1;
+        }
+        if (((record[0] == 0xFE) || (record[0] == 0xFC)) && (record[CHECKPOINT_RECORD_SIZE - 1] == checkpoint_check(record)))
+        {
+            memcpy(latest, record, CHECKPOINT_RECORD_SIZE);
+            latest_slot = slot;
         }
+    }
+    if (latest_slot == CHECKPOINT_SLOTS)
+        return 0;
+
+    handle->write_offset = get_le32(&latest[1]);
+    handle->destructive_read_offset = get_le32(&latest[5]);
+    handle->free_space = get_le32(&latest[9]);
+    handle->sequence = get_le32(&latest[13]); //kept even if the checkpoint is no use, see site_write_pointer
+    if ((handle->write_offset >= handle->size) || (handle->destructive_read_offset >= handle->size))
+        return 0;
+
+    //the pages the pointers were on must not have been erased or reused since.
+    //A free page reads the same however many times it has been erased, so one
+    //taken while either page was free proves nothing, and the file is scanned
+    uint32_t newest = newest_page(handle);
+    uint32_t read_page = page_of(handle->destructive_read_offset);
+    page_summary_t *s = summarize_page(handle, summary, newest);
+    page_summary_t *t = summarize_page(handle, summary, read_page);
+    if ((s->flag != 0xFE) || (s->sequence != get_le32(&latest[17])) || (t->flag != 0xFE) || (t->sequence != get_le32(&latest[21])))
+        return 0;
+
+    //a checkpoint followed by a torn one is treated as stale, to be safe
+    if ((latest[0] == 0xFE) && (latest_slot == handle->checkpoint_slot - 1))
+    {
+        handle->raw_read_chunk_start = handle->destructive_read_offset;
+        handle->raw_read_chunk_offset = 0;
+        handle->checkpoint_live = 1;
+        return 1;
+    }
+
+    if (!settle_write_pointer(handle, summary, newest))
+        return 0;
+    return settle_read_pointer(handle, summary, read_page);
+}
+
+#endif
+
+
+//the cursor whose destructive read pointer is furthest behind. Every cursor
+//lies between the read pointers of the handle and the write pointer, so this
+//is the one nearest the former.
 
-        uint8_t check = 0;
-        flash_read(handle->start + handle->destructive_read_offset - PAGE_COUNTER_SIZE, &check, PAGE_COUNTER_SIZE);
-        if (check == 0xFF) //this is an empty page. move destructive read pointer to beginning of next page and quit
+static uint8_t slowest_cursor(file_handle_t *handle)
+{
+    uint8_t slowest = 0;
+    uint32_t least = handle->size;
+    for (uint8_t c = 0; c < handle->cursors; ++c)
+    {
+        uint32_t ahead = (handle->cursor_at[c].destructive_read_offset + handle->size - handle->destructive_read_offset) % handle->size;
+        if (ahead < least)
         {
-            //go forward a page
-            handle->destructive_read_offset += FLASH_PAGE_SIZE;
-            if (handle->destructive_read_offset >= FILE_SIZE)
-                handle->destructive_read_offset = 0 + PAGE_COUNTER_SIZE;
-            break;
+            least = ahead;
+            slowest = c;
         }
+    }
+    return slowest;
+}
+
+//find where each cursor had got to, walking forward from the first chunk not
+//yet consumed by every cursor to the first not yet consumed by this one. A
+//record the cursor had begun to consume when power failed is finished off.
 
-        flash_read(handle->start + handle->destructive_read_offset + 1, &check, 1);
-        if (check == 0xFC) //this this chunk is consumed, fast forward over invalid and consumed chunks until we hit a non-consumed valid chunk of the end of the page
+static void recover_cursors(file_handle_t *handle)
+{
+    if (handle->cursors == 1)
+        return;
+    for (uint8_t c = 0; c < handle->cursors; ++c)
+    {
+        handle->cursor = c;
+        uint32_t offset = handle->destructive_read_offset;
+        uint8_t owed = 0; //set if the cursor has consumed the start of a record that carries on
+        while (offset != handle->write_offset)
         {
-            while (1)
+            uint8_t flags = 0xFF;
+            cache_read(handle, handle->start + offset + 1, &flags, 1);
+            if (flags & CHUNK_VALID) //torn chunks are neither here nor there
+                owed = 0;
+            else
             {
-                uint8_t c_size = 0;
-                uint8_t c_valid = 0;
-                flash_read(handle->start + handle->destructive_read_offset, &c_size, 1);
-                flash_read(handle->start + handle->destructive_read_offset + 1, &c_valid, 1);
-                if (handle->destructive_read_offset == handle->write_offset) //done
-                {
-                    done = 1; //force our way out of the outer loop
-                    break;
-                }
-                else if (c_size == 0xFF) //empty space at the end of the page; FF to next page and quit
-                {
-                    //delete the page
-                    uint32_t page_start = FLASH_PAGE_SIZE * (handle->destructive_read_offset / FLASH_PAGE_SIZE);
-                    flash_erase(handle->start + page_start, FLASH_PAGE_SIZE);
-                    handle->destructive_read_offset = FLASH_PAGE_SIZE * (handle->destructive_read_offset / FLASH_PAGE_SIZE) + FLASH_PAGE_SIZE;
-                    if (handle->destructive_read_offset == FILE_SIZE)
-                        handle->destructive_read_offset = 0;
-                    handle->destructive_read_offset += PAGE_COUNTER_SIZE;
-                    done = 1; //force our way out of the outer loop
-                    break;
-                }
-                else if (c_valid == 0xFE) //a non-consumed chunk, stop here
-                {
-                    done = 1; //force our way out of the outer loop
-                    break;
-                }
-                //move to the next chunk
-                handle->destructive_read_offset += c_size + 2;
-                handle->free_space += c_size + 2;
-                if (!(handle->destructive_read_offset % FLASH_PAGE_SIZE)) //end of page
+                if (chunk_unread(handle, flags))
                 {
-                    //delete the page
-                    uint32_t page_start = FLASH_PAGE_SIZE * ((handle->destructive_read_offset - 1) / FLASH_PAGE_SIZE);
-                    flash_erase(handle->start + page_start, FLASH_PAGE_SIZE);
-
-                    handle->destructive_read_offset += PAGE_COUNTER_SIZE;
+                    if (!owed || (flags & CHUNK_CONT)) //this is where the cursor had got to
+                        break;
+                    mark_consumed(handle, offset);
                 }
+                owed = !(flags & CHUNK_MORE);
             }
+            offset = next_chunk(handle, offset);
         }
-
-        if (!done) //more pages to look at!
-        {
-            //go back a page
-            if (handle->destructive_read_offset == 1)
-                handle->destructive_read_offset = FILE_SIZE - FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE;
-            else
-                handle->destructive_read_offset -= FLASH_PAGE_SIZE;
-        }
-        ++pages_examined;
+        handle->cursor_at[c].raw_read_chunk_start = offset;
+        handle->cursor_at[c].raw_read_chunk_offset = 0;
+        handle->cursor_at[c].destructive_read_offset = offset;
     }
-
-    //Finally, set the read offset to be the destructive read offset
-    handle->raw_read_chunk_start = handle->destructive_read_offset;
+    handle->cursor = FILE_CURSOR_MAX;
+    handle->raw_read_chunk_start = handle->cursor_at[slowest_cursor(handle)].destructive_read_offset;
+    handle->raw_read_chunk_offset = 0;
 }
 
+// Initialize anything in the per-handle structure, recovering the pointers
+// from flash
 
-// Initialize anything in the per-handle structure
-
-file_handle_t *
-file_open(enum FILE_ID id)
+static file_handle_t *recover(enum FILE_ID id, file_handle_t *ret)
 {
-    if (open_handles[id] >= MAX_HANDLES) //max handles already open; could be easily expanded to contain the number of open handles
-        return NULL;
-    ++open_handles[id];
-
-    file_handle_t * ret = malloc(sizeof (file_handle_t));
     ret->file_id = id;
-    ret->start = id * FILE_SIZE + FILE_OFFSET;
+    ret->role = 0; //until it is open
+    ret->peer = NULL;
+    ret->start = file_start(id);
+    ret->size = file_pages[id] * FLASH_PAGE_SIZE;
     ret->raw_read_chunk_start = 1; //so we can recover the location of the start of the current chunk!
     ret->raw_read_chunk_offset = 0; //start of actual data, relative to the end of the metadata in this chunk
     ret->write_offset = 0; //skip counter byte!
     ret->destructive_read_offset = 1;
-    ret->write_count = 1;
-    ret->free_space = FILE_SIZE - (PAGE_COUNTER_SIZE * FILE_SIZE / FLASH_PAGE_SIZE); //subtracting the number of page count bytes;
+    ret->sequence = 0;
+    ret->free_space = ret->size - (PAGE_COUNTER_SIZE * ret->size / FLASH_PAGE_SIZE); //subtracting the number of page count bytes;
+    ret->cache_valid = 0;
+    ret->checkpoint_slot = 0;
+    ret->checkpoint_live = 0;
+    ret->reclaim_start = 0;
+    ret->reclaim_pages = 0;
+#if FILE_WEAR
+    ret->wear_len = 0;
+#endif
+#if FLASH_ASYNC
+    program_init(ret);
+#endif
+    ret->cursors = file_cursors[id] ? file_cursors[id] : 1;
+    ret->cursor = FILE_CURSOR_MAX;
+#if FILE_STATS
+    memset(&ret->stats, 0, sizeof (ret->stats));
+    ret->lingering = 0;
+#endif
+
+    page_summary_t *summary = summaries;
+    memset(summary, 0, page_count(ret) * sizeof (page_summary_t));
+
+#if FILE_CHECKPOINTS
+    //if the file was checkpointed, there may be very little left to do
+    if (checkpoint_restore(ret, summary))
+    {
+        recover_cursors(ret);
+        return ret;
+    }
+#endif
 
-    //first things first: let's identify and fix any failed erased pages.
-    find_and_repair_corrupted_pages(ret);
+    //in a large file, a few page headers are enough to find our place
+    if (search_pointers(ret, summary))
+    {
+        recover_cursors(ret);
+        return ret;
+    }
+
+    //summarize the file in a single pass, then make all of our decisions from that
+    scan_pages(ret, summary);
 
+    //first things first: let's identify and fix any failed erased pages.
+    find_and_repair_corrupted_pages(ret, summary);
 
     //second, locate the write pointer
-    site_write_pointer(ret);
+    site_write_pointer(ret, summary);
+
+    //then the read pointer
+    site_read_pointer(ret, summary);
+
+    //and finally, where each cursor had got to
+    recover_cursors(ret);
+    return ret;
+}
+
+//open the other end of a split file. The pointers are already known, so there
+//is nothing to recover: the new end starts out as a copy of the open one, with
+//a cache of its own. The reader takes charge of any pages waiting to be erased.
 
-    //finally, locate the read pointer
-    site_read_pointer(ret);
+static file_handle_t *join(file_handle_t *peer, uint8_t role, file_handle_t *ret)
+{
+#if FLASH_ASYNC
+    settle(); //so that what we copy is in flash, and published
+#endif
+    memcpy(ret, peer, sizeof (file_handle_t));
+    ret->cache_valid = 0;
+#if FILE_WEAR
+    ret->wear_len = 0; //the peer's erases are its own to stamp
+#endif
+#if FLASH_ASYNC
+    program_init(ret); //the peer's queued writes are its own
+#endif
+#if FILE_STATS
+    memset(&ret->stats, 0, sizeof (ret->stats));
+    ret->lingering = 0;
+#endif
+#if FILE_CHECKPOINTS
+    //neither end knows enough to take a checkpoint from here on
+    checkpoint_invalidate(peer);
+    ret->checkpoint_live = 0;
+#endif
+    if (role & FILE_READER)
+        peer->reclaim_pages = 0;
+    else
+        ret->reclaim_pages = 0;
+    ret->peer = peer;
+    peer->peer = ret;
+    publish_pointer(peer);
+    return ret;
+}
+
+//the table stays locked while the file is recovered, so that two threads
+//opening the same file can't both set about it
+
+static file_handle_t *open_end(enum FILE_ID id, uint8_t role, file_handle_t *storage)
+{
+    trace_start();
+    files_lock();
+    if (open_roles[id] & role) //already open
+    {
+        files_unlock();
+        trace_stop(FILE_TRACE_OPEN, id, 0);
+        return NULL;
+    }
 
+#if FILE_HANDLE_POOL
+    if (!storage)
+        storage = &handle_pool[id][(role == FILE_READER) ? 1 : 0];
+#endif
+    file_handle_t *ret = open_roles[id] ? join(open_ends[id], role, storage) : recover(id, storage);
+    ret->role = role;
+#if FILE_RECORD_INDEX
+    index_reset(ret);
+#endif
+    publish_pointer(ret);
+    open_roles[id] |= role;
+    open_ends[id] = ret;
+    files_unlock();
+    trace_stop(FILE_TRACE_OPEN, id, 1);
     return ret;
 }
 
-// Clean-up handle structure
-// When this function returns, the flash state must reflect all pending writes
-// in order
+#if FILE_HANDLE_POOL
+
+file_handle_t *
+file_open(enum FILE_ID id)
+{
+    return open_end(id, FILE_READER | FILE_WRITER, NULL);
+}
+
+// Open just one end of a file, for a producer or a consumer that is to have a
+// handle of its own. Returns NULL if that end is already open.
+
+file_handle_t *
+file_open_writer(enum FILE_ID id)
+{
+    return open_end(id, FILE_WRITER, NULL);
+}
+
+file_handle_t *
+file_open_reader(enum FILE_ID id)
+{
+    return open_end(id, FILE_READER, NULL);
+}
+#endif
+
+// Open a whole file, or one end of it, into storage provided by the caller,
+// which then holds the handle until it is closed. Returns NULL if that end is
+// already open.
+
+file_handle_t *
+file_open_in(enum FILE_ID id, uint8_t role, file_handle_t *storage)
+{
+    if (!storage || !role || (role & ~(FILE_READER | FILE_WRITER)))
+        return NULL;
+    return open_end(id, role, storage);
+}
+
+// Clean-up handle structure
+// When this function returns, the flash state must reflect all pending writes
+// in order, and the handle's storage is free to be used again
+// Closing one end of a split file hands what it owns back to the other end.
+
+void
+file_close(file_handle_t * handle)
+{
+    trace_start();
+    file_sync(handle);
+    files_lock();
+    file_handle_t *peer = handle->peer;
+    if (peer)
+    {
+        if (handle->role & FILE_WRITER)
+        {
+            peer->write_offset = handle->write_offset;
+            peer->sequence = handle->sequence;
+        }
+        else
+        {
+            peer->raw_read_chunk_start = handle->raw_read_chunk_start;
+            peer->raw_read_chunk_offset = handle->raw_read_chunk_offset;
+            peer->destructive_read_offset = handle->destructive_read_offset;
+            peer->reclaim_start = handle->reclaim_start;
+            peer->reclaim_pages = handle->reclaim_pages;
+            memcpy(peer->cursor_at, handle->cursor_at, sizeof (handle->cursor_at));
+        }
+        peer->free_space = free_between(peer);
+        peer->cache_valid = 0;
+        peer->peer = NULL;
+#if FILE_RECORD_INDEX
+        index_reset(peer);
+#endif
+    }
+    open_roles[handle->file_id] &= ~handle->role;
+    open_ends[handle->file_id] = peer;
+    files_unlock();
+    trace_stop(FILE_TRACE_CLOSE, handle->file_id, 0);
+}
+
+//where a read pointer that stopped at the write pointer goes once the writer
+//has moved on. If the writer was lingering at the start of a page, it goes
+//just past the page header. If the writer left the rest of the page unused,
+//for want of room for its next chunk, it goes on to the next page.
+
+static uint32_t follow_offset(file_handle_t *handle, uint32_t offset)
+{
+    if (offset == handle->write_offset)
+        return offset;
+    if (!(offset % FLASH_PAGE_SIZE))
+        return offset + PAGE_COUNTER_SIZE;
+    uint8_t size = 0;
+    cache_read(handle, handle->start + offset, &size, 1);
+    if (size == 0xFF) //leftovers at end of page
+        return landing(handle, offset + FLASH_PAGE_SIZE - (offset % FLASH_PAGE_SIZE));
+    return offset;
+}
+
+//has the read pointer caught up with the write pointer, leaving nothing to read?
 
-void
-file_close(file_handle_t * handle)
+static uint8_t read_caught_up(file_handle_t *handle)
 {
-    file_sync(handle);
-    --open_handles[handle->file_id];
-    free(handle);
+    if (handle->raw_read_chunk_start != handle->write_offset)
+        return 0;
+    if (!(handle->raw_read_chunk_start % FLASH_PAGE_SIZE)) //waiting on a writer lingering at the start of a page
+        return 1;
+    if (handle->peer) //the writer's published pointer is all we go by, whatever it is in the middle of
+        return 1;
+    //it might be that the write pointer is actually BEHIND us. We can test by looking
+    //ahead to see if the current chunk is free or written
+    uint8_t size = 0;
+    cache_read(handle, handle->start + handle->raw_read_chunk_start, &size, 1);
+    return (size == 0xFF);
 }
 
 //helper function for advancing the read pointer
@@ -410,8 +2169,8 @@ static uint8_t check_read_pointer(file_handle_t *handle)
         return 1; //we are done moving it forward
     //otherwise see if the data is invalid or otherwise needs to be skipped
     uint8_t check = 0;
-    flash_read(handle->start + handle->raw_read_chunk_start + 1, &check, 1);
-    if (check == 0xFE) //a block we can read!
+    cache_read(handle, handle->start + handle->raw_read_chunk_start + 1, &check, 1);
+    if (chunk_unread(handle, check)) //a block we can read!
         return 1;
     return 0;
 }
@@ -430,16 +2189,9 @@ static void advance_read_pointer_to_next_chunk(file_handle_t *handle)
 
     //we begin by advancing from the current chunk.
     uint8_t check = 0;
-    flash_read(handle->start + handle->raw_read_chunk_start, &check, 1);
-    handle->raw_read_chunk_start += check + 2;
-    //check for wrap-around
-    if (handle->raw_read_chunk_start >= FILE_SIZE)
-        handle->raw_read_chunk_start = PAGE_COUNTER_SIZE;
-    //skip first byte of each page
-    if (!(handle->raw_read_chunk_start % FLASH_PAGE_SIZE))
-    {
-        handle->raw_read_chunk_start += PAGE_COUNTER_SIZE; //skip counter bytes
-    }
+    cache_read(handle, handle->start + handle->raw_read_chunk_start, &check, 1);
+    //check for wrap-around, and skip the header of each page
+    handle->raw_read_chunk_start = landing(handle, handle->raw_read_chunk_start + check + 2);
 
     while (!done)
     {
@@ -448,38 +2200,18 @@ static void advance_read_pointer_to_next_chunk(file_handle_t *handle)
         {
             //check to see if the obstruction is invalid data
             check = 0;
-            flash_read(handle->start + handle->raw_read_chunk_start, &check, 1);
+            cache_read(handle, handle->start + handle->raw_read_chunk_start, &check, 1);
             if (check != 0xFF) //invalid chunk, move to next chunk
-            {
-                handle->raw_read_chunk_start += check + 2;
-                //check for wrap-around
-                if (handle->raw_read_chunk_start >= FILE_SIZE)
-                    handle->raw_read_chunk_start = PAGE_COUNTER_SIZE;
-            }
-            //skip first byte of each page
-            if (!(handle->raw_read_chunk_start % FLASH_PAGE_SIZE))
-            {
-                handle->raw_read_chunk_start += PAGE_COUNTER_SIZE; //skip counter bytes
-            }
+                handle->raw_read_chunk_start = landing(handle, handle->raw_read_chunk_start + check + 2);
             done = check_read_pointer(handle);
         }
         if (!done)
         {
             //check to see if the obstruction is leftovers at end of page
             uint8_t check = 0;
-            flash_read(handle->start + handle->raw_read_chunk_start, &check, 1);
+            cache_read(handle, handle->start + handle->raw_read_chunk_start, &check, 1);
             if (check == 0xFF) //leftovers at end of page
-            {
-                handle->raw_read_chunk_start += FLASH_PAGE_SIZE - (handle->raw_read_chunk_start % FLASH_PAGE_SIZE);
-                //check for wrap-around
-                if (handle->raw_read_chunk_start >= FILE_SIZE)
-                    handle->raw_read_chunk_start = 0;
-            }
-            //skip first byte of each page
-            if (!(handle->raw_read_chunk_start % FLASH_PAGE_SIZE))
-            {
-                handle->raw_read_chunk_start += PAGE_COUNTER_SIZE; //skip that byte
-            }
+                handle->raw_read_chunk_start = landing(handle, handle->raw_read_chunk_start + FLASH_PAGE_SIZE - (handle->raw_read_chunk_start % FLASH_PAGE_SIZE));
 
             done = check_read_pointer(handle);
         }
@@ -494,8 +2226,8 @@ static uint8_t check_destructive_read_pointer(file_handle_t *handle)
         return 1; //we are done moving it forward
     //otherwise see if the data is invalid or otherwise needs to be skipped
     uint8_t check = 0;
-    flash_read(handle->start + handle->destructive_read_offset + 1, &check, 1);
-    if (check == 0xFE) //a block we can read!
+    cache_read(handle, handle->start + handle->destructive_read_offset + 1, &check, 1);
+    if (chunk_unread(handle, check)) //a block we can read!
         return 1;
     return 0;
 }
@@ -514,17 +2246,11 @@ static void advance_destructive_read_pointer_to_next_chunk(file_handle_t *handle
 
     //we begin by advancing from the current chunk.
     uint8_t size = 0;
-    flash_read(handle->start + handle->destructive_read_offset, &size, 1);
-    handle->destructive_read_offset += size + 2;
-    handle->free_space += size + 2;
-    //check for wrap-around
-    if (handle->destructive_read_offset >= FILE_SIZE)
-        handle->destructive_read_offset = 0;
-    if (!(handle->destructive_read_offset % FLASH_PAGE_SIZE))
-    {
-        handle->destructive_read_offset += PAGE_COUNTER_SIZE; //skip that byte
-        //Notice that we do not update the free space, since this byte is not available for writing!
-    }
+    cache_read(handle, handle->start + handle->destructive_read_offset, &size, 1);
+    //check for wrap-around, and skip the header of each page. Notice that we
+    //do not update the free space for the header, since it is not available for writing!
+    handle->free_space += size + 2 + leftover_byte(handle, handle->destructive_read_offset + size + 2);
+    handle->destructive_read_offset = landing(handle, handle->destructive_read_offset + size + 2);
 
     while (!done)
     {
@@ -533,20 +2259,11 @@ static void advance_destructive_read_pointer_to_next_chunk(file_handle_t *handle
         {
             //check to see if the obstruction is invalid data
             uint8_t check = 0;
-            flash_read(handle->start + handle->destructive_read_offset, &check, 1);
+            cache_read(handle, handle->start + handle->destructive_read_offset, &check, 1);
             if (check != 0xFF) //invalid chunk, move to next chunk
             {
-                handle->destructive_read_offset += check + 2;
-                handle->free_space += check + 2;
-                //check for wrap-around
-                if (handle->destructive_read_offset >= FILE_SIZE)
-                    handle->destructive_read_offset = 0;
-            }
-            //skip first byte of each page
-            if (!(handle->destructive_read_offset % FLASH_PAGE_SIZE))
-            {
-                handle->destructive_read_offset += PAGE_COUNTER_SIZE; //skip that byte
-                //Notice that we do not update the free space, since this byte is not available for writing!
+                handle->free_space += check + 2 + leftover_byte(handle, handle->destructive_read_offset + check + 2);
+                handle->destructive_read_offset = landing(handle, handle->destructive_read_offset + check + 2);
             }
             done = check_destructive_read_pointer(handle);
         }
@@ -554,101 +2271,221 @@ static void advance_destructive_read_pointer_to_next_chunk(file_handle_t *handle
         {
             //check to see if the obstruction is leftovers at end of page
             uint8_t check = 0;
-            flash_read(handle->start + handle->destructive_read_offset, &check, 1);
+            cache_read(handle, handle->start + handle->destructive_read_offset, &check, 1);
             if (check == 0xFF) //leftovers at end of page
             {
                 handle->free_space += FLASH_PAGE_SIZE - (handle->destructive_read_offset % FLASH_PAGE_SIZE);
-                handle->destructive_read_offset += FLASH_PAGE_SIZE - (handle->destructive_read_offset % FLASH_PAGE_SIZE);
-                //check for wrap-around
-                if (handle->destructive_read_offset >= FILE_SIZE)
-                    handle->destructive_read_offset = 0;
+                handle->destructive_read_offset = landing(handle, handle->destructive_read_offset + FLASH_PAGE_SIZE - (handle->destructive_read_offset % FLASH_PAGE_SIZE));
             }
-            //skip first byte of each page
-            if (!(handle->destructive_read_offset % FLASH_PAGE_SIZE))
+            done = check_destructive_read_pointer(handle);
+        }
+    }
+}
+
+//once the destructive read pointer has moved off a page, the page can be
+//erased, so long as nothing else is still using it
+
+static void erase_page_behind(file_handle_t *handle)
+{
+    if (handle->cursor != FILE_CURSOR_MAX) //other cursors may still need it; see advance_frontier
+        return;
+    //check to see if page needs erasure. We check by seeing if we crossed a page boundary
+    //we do this by seeing if the read pointer is at the first byte of a new page
+    //(or at the start of one, where it has caught up with a lingering writer)
+    uint32_t in_page = handle->destructive_read_offset % FLASH_PAGE_SIZE;
+    if ((in_page == PAGE_COUNTER_SIZE) || !in_page)
+    {
+        //get the start address for the previous page, and erase it.
+        uint32_t page_start;
+        if (handle->destructive_read_offset >= FLASH_PAGE_SIZE) //if on second or subsequent pages
+            page_start = FLASH_PAGE_SIZE * (page_of(handle->destructive_read_offset) - 1);
+        else //we just wrapped onto the first page, previous page is at the bottom
+            page_start = handle->size - FLASH_PAGE_SIZE;
+        //need to check if page needs erasing. We check if the first chunk is flagged consumed.
+        //If so, we check that neither the read nor write pointers are on the page
+        uint8_t test;
+        cache_read(handle, handle->start + page_start + 1 + PAGE_COUNTER_SIZE, &test, 1); //if the first value we read is 0xFF, no need to erase.
+        if ((test != 0xFF) && !(test & CHUNK_CONSUMED)) //the first chunk has been consumed. Rather than test all chunks, just see if the read and write pointers made it off the page
+        {
+            //here is where we test the pointer location to avoid erasing
+            //a page currently in use
+            if ((handle->write_offset <= page_start || handle->write_offset >= (page_start + FLASH_PAGE_SIZE)) //yes, <=, because the write pointer might be lingering around the first byte of the page, waiting for us to erase this page.
+                    && (handle->raw_read_chunk_start < page_start || handle->raw_read_chunk_start >= (page_start + FLASH_PAGE_SIZE) || handle->raw_read_chunk_start == handle->write_offset)) //the reader may be waiting there with the writer
             {
-                handle->destructive_read_offset += PAGE_COUNTER_SIZE; //skip that byte
-                //Notice that we do not update the free space, since this byte is not available for writing!
+                reclaim_page(handle, page_start);
             }
-            done = check_destructive_read_pointer(handle);
         }
     }
 }
 
+//bring both read pointers along after the writer, see follow_offset. The
+//destructive read pointer frees up whatever it steps over, and if that takes
+//it off a page, the page is done with.
+
+static void follow_writer(file_handle_t *handle)
+{
+    handle->raw_read_chunk_start = follow_offset(handle, handle->raw_read_chunk_start);
+    uint32_t offset = follow_offset(handle, handle->destructive_read_offset);
+    if ((offset != handle->destructive_read_offset) && (handle->destructive_read_offset % FLASH_PAGE_SIZE))
+    {
+        handle->free_space += FLASH_PAGE_SIZE - (handle->destructive_read_offset % FLASH_PAGE_SIZE);
+        handle->destructive_read_offset = offset;
+        erase_page_behind(handle);
+    }
+    handle->destructive_read_offset = offset;
+}
+
+//In a file with more than one cursor, the cursor being used has its read
+//pointers swapped in for those of the handle, which are kept in its place in
+//the meantime, and then swapped back out.
+
+static void cursor_in(file_handle_t *handle, uint8_t cursor)
+{
+    if (handle->cursors == 1)
+        return;
+    file_cursor_t held = handle->cursor_at[cursor];
+    handle->cursor_at[cursor].raw_read_chunk_start = handle->raw_read_chunk_start;
+    handle->cursor_at[cursor].raw_read_chunk_offset = handle->raw_read_chunk_offset;
+    handle->cursor_at[cursor].destructive_read_offset = handle->destructive_read_offset;
+    handle->raw_read_chunk_start = held.raw_read_chunk_start;
+    handle->raw_read_chunk_offset = held.raw_read_chunk_offset;
+    handle->destructive_read_offset = held.destructive_read_offset;
+    handle->cursor = cursor;
+}
+
+//once a cursor is swapped back out, the read pointers of the handle follow the
+//slowest cursor, stepping over whatever every cursor has consumed, and
+//reclaiming pages as they go
+
+static void advance_frontier(file_handle_t *handle)
+{
+    handle->raw_read_chunk_start = handle->cursor_at[slowest_cursor(handle)].destructive_read_offset;
+    handle->raw_read_chunk_offset = 0;
+    follow_writer(handle);
+    while (handle->destructive_read_offset != handle->raw_read_chunk_start)
+    {
+        uint8_t flags = 0xFF;
+        cache_read(handle, handle->start + handle->destructive_read_offset + 1, &flags, 1);
+        if (chunk_live(flags)) //still wanted, which should never happen
+            break;
+        handle->destructive_read_offset = next_chunk(handle, handle->destructive_read_offset);
+        erase_page_behind(handle); //one page at a time
+    }
+    handle->free_space = free_between(handle);
+}
+
+static void cursor_out(file_handle_t *handle)
+{
+    if (handle->cursors == 1)
+        return;
+    cursor_in(handle, handle->cursor); //swapping is its own inverse
+    handle->cursor = FILE_CURSOR_MAX;
+    advance_frontier(handle);
+}
+
 // Delete the first n bytes of file, move file handles to point to same data
 // In case of unexpected power down, the state of the flash must at all times
 // reflect either the unchanged file, or the file with all N bytes deleted.
+// Records are consumed whole or not at all. For a record written as a chain,
+// the first chunk is flagged consumed first; should power fail before the rest
+// are, file_open finishes the job.
 
-size_t
-file_consume(file_handle_t * handle, size_t size)
+static size_t consume(file_handle_t * handle, size_t size)
 {
     size_t i = 0;
-    uint8_t valid;
+    follow_writer(handle);
     while (size)
     {
         //if we have reached the read pointer, stop, do nothing.
         if (handle->destructive_read_offset == handle->raw_read_chunk_start)
             return i;
 
-        //get the current chunk size.
-        uint8_t chunk_size = 0;
-        flash_read(handle->start + handle->destructive_read_offset, &chunk_size, 1);
+        //get the size of the current record, following it through as many chunks as it takes
+        size_t record_size = 0;
+        uint32_t chunk = handle->destructive_read_offset;
+        for (;;)
+        {
+            uint8_t chunk_size = 0, flags = 0xFF;
+            cache_read(handle, handle->start + chunk, &chunk_size, 1);
+            cache_read(handle, handle->start + chunk + 1, &flags, 1);
+            record_size += chunk_size;
+            if (flags & CHUNK_MORE)
+                break;
+            chunk = next_chunk(handle, chunk);
+            if (chunk == handle->raw_read_chunk_start) //the rest of the record hasn't been read yet, leave it be
+                return i;
+        }
 
-        //is the current chunk smaller than what was requested? If so, we will be moving to the next chunk.
-        if (chunk_size > size) //current chunk is smaller than read size, leave it be and stop here
+        //is the current record smaller than what was requested? If so, we will be moving to the next record.
+        if (record_size > size) //current record is smaller than read size, leave it be and stop here
         {
-            //do not update destructive read pointer, as we are not consuming this chunk
+            //do not update destructive read pointer, as we are not consuming this record
             //but do return the proper size!
             return i;
         }
 
-        else //we will consume this entire chunk, and perhaps keep going as there will be more to consume
+        //we will consume this entire record, and perhaps keep going as there will be more to consume
+#if FILE_CHECKPOINTS
+        checkpoint_invalidate(handle);
+#endif
+        uint8_t flags;
+        do
         {
-            uint8_t flag = 0xFC;
-            flash_write(handle->start + handle->destructive_read_offset + 1, &flag, 1); //write the "consumed" flag!
-            size -= chunk_size;
-            i += chunk_size;
+            flags = 0xFF;
+            cache_read(handle, handle->start + handle->destructive_read_offset + 1, &flags, 1);
+            mark_consumed(handle, handle->destructive_read_offset); //write the "consumed" flag!
 
             //move to next chunk
             advance_destructive_read_pointer_to_next_chunk(handle);
-        }
 
-        //notice that at this point, the read pointer could be at the start of a new page. If so, we should erase the page we just left behind
-        //check to see if page needs erasure. We check by seeing if we crossed a page boundary
-        //we do this by seeing if the read pointer is at the first byte of a new page
-        if (!((handle->destructive_read_offset - PAGE_COUNTER_SIZE) % FLASH_PAGE_SIZE))
-        {
-            //get the start address for the previous page, and erase it.
-            uint32_t page_start;
-            if (handle->destructive_read_offset >= FLASH_PAGE_SIZE) //if on second or subsequent pages
-                page_start = handle->destructive_read_offset - FLASH_PAGE_SIZE - PAGE_COUNTER_SIZE;
-            else //we just wrapped onto the first page, previous page is at the bottom
-                page_start = FILE_SIZE - FLASH_PAGE_SIZE;
-            //need to check if page needs erasing. We check if the first chunk is flagged consumed.
-            //If so, we check that neither the read nor write pointers are on the page
-            uint8_t test;
-            flash_read(handle->start + page_start + 1 + PAGE_COUNTER_SIZE, &test, 1); //if the first value we read is 0xFF, no need to erase.
-            if (test == 0xFC) //the first chunk has been consumed. Rather than test all chunks, just see if the read and write pointers made it off the page
-            {
-                //here is where we test the pointer location to avoid erasing
-                //a page currently in use
-                if ((handle->write_offset <= page_start || handle->write_offset >= (page_start + FLASH_PAGE_SIZE)) //yes, <=, because the write pointer might be lingering around the first byte of the page, waiting for us to erase this page.
-                        && (handle->raw_read_chunk_start < page_start || handle->raw_read_chunk_start >= (page_start + FLASH_PAGE_SIZE)))
-                {
-                    flash_erase(handle->start + page_start, FLASH_PAGE_SIZE); //don't know that the full size is required for this operation, but just to be sure.
-                }
-            }
+            //notice that at this point, the read pointer could be at the start of a new page. If so, we should erase the page we just left behind
+            erase_page_behind(handle);
         }
-
+        while (!(flags & CHUNK_MORE));
+        size -= record_size;
+        i += record_size;
+        tally(handle, records_consumed, 1);
+        tally(handle, bytes_consumed, record_size);
     }
     return i;
 }
 
+size_t
+file_consume(file_handle_t * handle, size_t size)
+{
+    return file_consume_cursor(handle, FILE_CURSOR_DEFAULT, size);
+}
+
+// As file_consume, but for the given cursor. Pages are only erased once every
+// cursor has consumed past them.
+
+size_t
+file_consume_cursor(file_handle_t * handle, enum FILE_CURSOR cursor, size_t size)
+{
+    if (!(handle->role & FILE_READER) || (cursor >= handle->cursors))
+        return 0;
+    trace_start();
+    sync_peer(handle);
+    cursor_in(handle, cursor);
+    size_t i = consume(handle, size);
+    cursor_out(handle);
+#if !FILE_DEFERRED_ERASE
+    //the writer of a split file may be waiting on pages held back for a block erase
+    if (handle->peer && (handle->destructive_read_offset == handle->write_offset))
+        reclaim_run(handle);
+#endif
+    publish_pointer(handle);
+    trace_stop(FILE_TRACE_CONSUME, handle->file_id, i);
+    return i;
+}
+
 // return the number of bytes that would be returned if one were to seek to 0
 // then read until end of file
 
 size_t
 file_size(file_handle_t * handle)
 {
+    sync_peer(handle);
     return used_space(handle);
 }
 
@@ -656,49 +2493,202 @@ file_size(file_handle_t * handle)
 // If unexpected power down, flash state will reflect entire pending writes in order,
 // or no change.
 // When this function returns, flash state must reflect all pending writes
-//Nothing to do here, as we do not perform lazy writes
+//All that is left to do is finish erasing anything consumed, wait for any
+//queued writes, and take a checkpoint
 
 void
 file_sync(file_handle_t * handle)
 {
+    trace_start();
+    reclaim_run(handle);
+    wear_stamp(handle);
+#if FLASH_ERASE_SUSPEND || FLASH_ASYNC
+    settle();
+#endif
+#if FILE_CHECKPOINTS
+    //record where the pointers are, so that the next file_open needn't go looking
+    if (!handle->peer) //neither end of a split file knows enough to
+        checkpoint_write(handle);
+#endif
+    trace_stop(FILE_TRACE_SYNC, handle->file_id, 0);
+}
+
+#if FILE_STATS
+
+// Fills in stats with what the handle has done since it was opened, and how
+// things stand with the file now. Where a writer stalls, writes_lingering and
+// linger_ticks show how much of it is down to waiting on erases, and
+// pages_pending whether file_service is falling behind.
+
+void
+file_stats(file_handle_t * handle, file_stats_t * stats)
+{
+    sync_peer(handle);
+    *stats = handle->stats;
+    stats->linger_ticks += linger_ticks(handle);
+    stats->bytes_free = free_space(handle);
+    stats->pages_pending = handle->reclaim_pages;
+}
+#endif
+
+#if FILE_WEAR
+
+//the count in the header of one of a file's pages, read straight from flash
+
+static uint32_t page_wear(enum FILE_ID id, uint32_t page)
+{
+    uint8_t header[PAGE_COUNTER_SIZE];
+    read_flash(file_start(id) + (page * FLASH_PAGE_SIZE), header, PAGE_COUNTER_SIZE);
+    return wear_of(header);
+}
+
+// Returns the number of times the given page of the file (the first being 0)
+// has been erased, or 0 if it has no count.
+
+uint32_t
+file_page_erases(enum FILE_ID id, uint32_t page)
+{
+    if ((id >= FILE_MAX) || (page >= file_pages[id]))
+        return 0;
+    uint32_t count = page_wear(id, page);
+    return (count == WEAR_UNKNOWN) ? 0 : count;
+}
+
+// Fills in wear with the erase counts of the file's pages, read from flash,
+// whether or not the file is open. The count goes down just after each erase,
+// so one made a moment ago may not show yet. The spread between least and most
+// shows how evenly the file wears, and most, against the erases the part is
+// rated for, how much of its life is used up.
+
+void
+file_wear(enum FILE_ID id, file_wear_t * wear)
+{
+    memset(wear, 0, sizeof (file_wear_t));
+    if (id >= FILE_MAX)
+        return;
+    wear->pages = file_pages[id];
+    for (uint32_t p = 0; p < file_pages[id]; ++p)
+    {
+        uint32_t count = page_wear(id, p);
+        if (count == WEAR_UNKNOWN)
+        {
+            ++wear->uncounted;
+            count = 0;
+        }
+        if (!p || (count < wear->least))
+            wear->least = count;
+        if (count > wear->most)
+            wear->most = count;
+        wear->total += count;
+    }
+#if FILE_CHECKPOINTS
+    uint8_t stamp[WEAR_SIZE];
+    read_flash(CHECKPOINT_OFFSET + (id * FLASH_PAGE_SIZE) + CHECKPOINT_WEAR, stamp, WEAR_SIZE);
+    wear->checkpoint = wear_committed(stamp);
+    if (wear->checkpoint == WEAR_UNKNOWN)
+        wear->checkpoint = 0;
+#endif
+}
+#endif
+
+#if FILE_DEFERRED_ERASE
+
+// Returns the number of pages still waiting to be erased.
+// Performs at most budget of the erases that file_consume has left behind, a
+// block at a time where the part allows. Call it when there is time to spare,
+// e.g. from an idle task. Pages the writer needs are erased as it needs them
+// regardless, so falling behind only costs the writer a wait.
+
+size_t
+file_service(file_handle_t * handle, size_t budget)
+{
+    trace_start();
+    sync_peer(handle);
+    for (; budget && handle->reclaim_pages; --budget)
+    {
+        uint32_t len = reclaim_length(handle);
+        if (!len) //the rest of the block is still being consumed
+            break;
+        reclaim_erase(handle, len);
+    }
+    trace_stop(FILE_TRACE_SERVICE, handle->file_id, handle->reclaim_pages);
+    return handle->reclaim_pages;
+}
+#endif
+
+// Returns FILE_BUSY_ERASING if an erase is under way, and FILE_BUSY_WRITING if
+// writes are queued, or 0 if the flash is idle. Any call made while it is busy
+// may have to wait for it, so an event loop that would rather get on with
+// something else can ask first. Asking also gives a polled port its chance to
+// move along.
 
+uint8_t
+file_busy(void)
+{
+    uint8_t busy = 0;
+    bus_lock();
+#if FLASH_ERASE_SUSPEND
+    if (flash_erase_busy())
+        busy |= FILE_BUSY_ERASING;
+#endif
+#if FLASH_ASYNC
+    if (flash_write_busy())
+        busy |= FILE_BUSY_WRITING;
+#endif
+    bus_unlock();
+    return busy;
 }
 
 // Returns the number of bytes actually read
 
 size_t
 file_read(file_handle_t * handle, uint8_t* data, size_t size)
+{
+    return file_read_cursor(handle, FILE_CURSOR_DEFAULT, data, size);
+}
+
+#if FILE_STATS
+
+//the chunk at the read pointer has been read to the end, and so has its
+//record, if it is the last chunk of it
+
+static void tally_chunk_read(file_handle_t *handle)
+{
+    uint8_t flags = 0xFF;
+    cache_read(handle, handle->start + handle->raw_read_chunk_start + 1, &flags, 1); //from the page just read
+    if (flags & CHUNK_MORE)
+        ++handle->stats.records_read;
+}
+#endif
+
+static size_t read_chunks(file_handle_t * handle, uint8_t* data, size_t size)
 {
     size_t i = 0;
+    follow_writer(handle);
     while (size)
     {
         //make sure we are not bumping into write pointer!
-        if (handle->raw_read_chunk_start == handle->write_offset)
-        {
-            //it might be that the write pointer is actually BEHIND us. We can test by looking
-            //ahead to see if the current chunk is free or written
-            uint8_t size = 0;
-            flash_read(handle->start + handle->raw_read_chunk_start, &size, 1);
-            if (size == 0xFF) //the write pointer is ahead of us, ditch
-                return i;
-            //else the write pointer is actually behind us, and we can proceed
-        }
+        if (read_caught_up(handle))
+            return i;
 
         //read in the current chunk size, so we can calculate where the next chunk begins
         uint8_t remaining_chunk_size;
         uint8_t chunk_size;
-        flash_read(handle->start + handle->raw_read_chunk_start, &chunk_size, 1);
+        cache_read(handle, handle->start + handle->raw_read_chunk_start, &chunk_size, 1);
         remaining_chunk_size = chunk_size - handle->raw_read_chunk_offset;
 
         //is the current chunk smaller than what we need? If so, we will be moving to the next chunk.
         if (remaining_chunk_size > size) //chunk is smaller, we will only read what we need
         {
-            uint8_t read_amount = flash_read(handle->start + handle->raw_read_chunk_start + 2 + handle->raw_read_chunk_offset, (void*) (data + i), size);
+            uint8_t read_amount = cache_read(handle, handle->start + handle->raw_read_chunk_start + 2 + handle->raw_read_chunk_offset, (void*) (data + i), size);
             size -= read_amount;
             i += read_amount;
 
             if (read_amount >= remaining_chunk_size) //we have read the entire chunk, set pointers to beginning of next chunk
             {
+#if FILE_STATS
+                tally_chunk_read(handle);
+#endif
                 advance_read_pointer_to_next_chunk(handle);
                 handle->raw_read_chunk_offset = 0;
             }
@@ -712,12 +2702,15 @@ file_read(file_handle_t * handle, uint8_t* data, size_t size)
         else //we need to shift into the next chunk, and keep going
         {
             //read all of the remaining chunk
-            uint8_t read_amount = flash_read(handle->start + handle->raw_read_chunk_start + 2 + handle->raw_read_chunk_offset, (void*) (data + i), remaining_chunk_size);
+            uint8_t read_amount = cache_read(handle, handle->start + handle->raw_read_chunk_start + 2 + handle->raw_read_chunk_offset, (void*) (data + i), remaining_chunk_size);
             size -= read_amount;
             i += read_amount;
             //move to next chunk
-            if (read_amount == chunk_size)
+            if (read_amount == remaining_chunk_size)
             {
+#if FILE_STATS
+                tally_chunk_read(handle);
+#endif
                 advance_read_pointer_to_next_chunk(handle);
                 handle->raw_read_chunk_offset = 0;
             }
@@ -730,15 +2723,195 @@ file_read(file_handle_t * handle, uint8_t* data, size_t size)
     return i;
 }
 
-// set read and write pointers to offset in file
-// Whence is SET_SEEK, SET_END, or something else from stdio.h
-//NOT IMPLEMENTED because this does not make sense for a FIFO. I could be
-// convinced otherwise.
+// As file_read, but for the given cursor
 
-void
+size_t
+file_read_cursor(file_handle_t * handle, enum FILE_CURSOR cursor, uint8_t* data, size_t size)
+{
+    if (!(handle->role & FILE_READER) || (cursor >= handle->cursors))
+        return 0;
+    trace_start();
+    sync_peer(handle);
+    cursor_in(handle, cursor);
+    size_t i = read_chunks(handle, data, size);
+    cursor_out(handle);
+    tally(handle, bytes_read, i);
+    trace_stop(FILE_TRACE_READ, handle->file_id, i);
+    return i;
+}
+
+#if FLASH_MAPPED
+
+// Returns the number of views filled, which will be fewer than count if we run
+// into the write pointer.
+// Each view points straight into flash at the data of one chunk, beginning at
+// the read pointer, so nothing is copied. A record chained across several
+// chunks takes a view per chunk. Nothing moves until file_release is called;
+// the views remain good until then.
+
+size_t
+file_peek(file_handle_t * handle, file_view_t* views, size_t count)
+{
+    if (!(handle->role & FILE_READER))
+        return 0;
+    trace_start();
+    sync_peer(handle);
+#if FLASH_ERASE_SUSPEND || FLASH_ASYNC
+    settle(); //the caller will be reading flash directly, without suspending anything
+#endif
+    cursor_in(handle, FILE_CURSOR_DEFAULT);
+    //walk the read pointer forward over the chunks, then put it back
+    uint32_t raw_read_chunk_start = handle->raw_read_chunk_start;
+    uint32_t offset = handle->raw_read_chunk_offset;
+    size_t n = 0;
+    follow_writer(handle);
+    while (n < count)
+    {
+        if (read_caught_up(handle))
+            break;
+        uint8_t size = 0;
+        cache_read(handle, handle->start + handle->raw_read_chunk_start, &size, 1);
+
+        views[n].data = flash_map(handle->start + handle->raw_read_chunk_start + 2 + offset);
+        views[n].size = size - offset;
+        ++n;
+        offset = 0;
+        advance_read_pointer_to_next_chunk(handle);
+    }
+    handle->raw_read_chunk_start = raw_read_chunk_start;
+    cursor_out(handle);
+    trace_stop(FILE_TRACE_PEEK, handle->file_id, n);
+    return n;
+}
+
+// Returns the number of bytes consumed.
+// Moves the read pointer past the first count views handed out by file_peek,
+// then consumes everything that has been read. As with file_consume, a chained
+// record is only consumed once all of its chunks have been released.
+
+size_t
+file_release(file_handle_t * handle, size_t count)
+{
+    if (!(handle->role & FILE_READER))
+        return 0;
+    trace_start();
+    sync_peer(handle);
+    cursor_in(handle, FILE_CURSOR_DEFAULT);
+    follow_writer(handle);
+    for (size_t n = 0; n < count; ++n)
+    {
+        if (read_caught_up(handle))
+            break;
+        advance_read_pointer_to_next_chunk(handle);
+        handle->raw_read_chunk_offset = 0;
+    }
+    cursor_out(handle);
+    size_t consumed = file_consume(handle, (size_t) - 1);
+    trace_stop(FILE_TRACE_RELEASE, handle->file_id, consumed);
+    return consumed;
+}
+
+#endif
+
+static uint32_t add_saturating(uint32_t a, uint32_t b)
+{
+    return (b > UINT32_MAX - a) ? UINT32_MAX : a + b;
+}
+
+//move the default cursor's read pointer to a record, or to a byte within one,
+//as by says, and return the position reached. Positions count from the oldest
+//record the cursor has yet to consume.
+
+static size_t seek(file_handle_t *handle, uint32_t amount, int whence, uint8_t by)
+{
+    if (!(handle->role & FILE_READER))
+        return 0;
+    sync_peer(handle);
+    cursor_in(handle, FILE_CURSOR_DEFAULT);
+    follow_writer(handle);
+
+    //where the unconsumed records begin, and how far into them we have read.
+    //Part way through a record counts as at its start, in records.
+    uint32_t floor = index_distance(handle, handle->destructive_read_offset);
+    file_index_entry_t base = index_seek(handle, INDEX_BY_OFFSET, floor);
+    file_index_entry_t at = index_seek(handle, INDEX_BY_OFFSET, index_distance(handle, handle->raw_read_chunk_start));
+    uint32_t here = index_key(handle, &at, by);
+    if (by == INDEX_BY_BYTE)
+    {
+        for (uint32_t chunk = at.offset; (chunk != handle->raw_read_chunk_start) && (chunk != handle->write_offset); chunk = next_chunk(handle, chunk))
+        {
+            uint8_t size = 0;
+            cache_read(handle, handle->start + chunk, &size, 1);
+            here += size;
+        }
+        here += handle->raw_read_chunk_offset;
+    }
+
+    uint32_t target = index_key(handle, &base, by);
+    if (whence == SEEK_CUR)
+        target = add_saturating(here, amount);
+    else if (whence == SEEK_END)
+    {
+        file_index_entry_t end = index_seek(handle, by, UINT32_MAX);
+        uint32_t last = index_key(handle, &end, by);
+        if (amount < last - target)
+            target = last - amount;
+    }
+    else
+        target = add_saturating(target, amount);
+
+    //the record holding the target, and, in bytes, on into it
+    file_index_entry_t to = index_seek(handle, by, target);
+    uint32_t into = ((by == INDEX_BY_BYTE) && (to.offset != handle->write_offset)) ? target - to.bytes : 0;
+    size_t reached = index_key(handle, &to, by) + into - index_key(handle, &base, by);
+    handle->raw_read_chunk_start = to.offset;
+    while (into)
+    {
+        uint8_t size = 0;
+        cache_read(handle, handle->start + handle->raw_read_chunk_start, &size, 1);
+        if (into < size)
+            break;
+        into -= size;
+        handle->raw_read_chunk_start = next_chunk(handle, handle->raw_read_chunk_start);
+    }
+    handle->raw_read_chunk_offset = into;
+    if (index_distance(handle, to.offset) < floor) //can't happen, so long as the cursor was at the start of a record
+    {
+        handle->raw_read_chunk_start = handle->destructive_read_offset;
+        handle->raw_read_chunk_offset = 0;
+        reached = 0;
+    }
+    cursor_out(handle);
+    return reached;
+}
+
+// Returns the position reached, in bytes, counted from the oldest data the
+// default cursor has yet to consume. It falls short if the file runs out.
+// Moves the read pointer, so that file_read carries on from there. With
+// SEEK_SET, offset counts from the oldest data; with SEEK_CUR, forward from
+// the read pointer; with SEEK_END, back from the end of the file. Nothing is
+// consumed, but file_consume will consume whatever the read pointer has been
+// moved past.
+
+size_t
 file_seek(file_handle_t * handle, uint32_t offset, int whence)
 {
+    trace_start();
+    size_t reached = seek(handle, offset, whence, INDEX_BY_BYTE);
+    trace_stop(FILE_TRACE_SEEK, handle->file_id, reached);
+    return reached;
+}
+
+// As file_seek, but in whole records. A read pointer part way through a record
+// counts as at its start.
 
+size_t
+file_seek_record(file_handle_t * handle, uint32_t record, int whence)
+{
+    trace_start();
+    size_t reached = seek(handle, record, whence, INDEX_BY_RECORD);
+    trace_stop(FILE_TRACE_SEEK, handle->file_id, reached);
+    return reached;
 }
 
 static void advance_write_pointer_to_next_page(file_handle_t *handle)
@@ -748,30 +2921,22 @@ static void advance_write_pointer_to_next_page(file_handle_t *handle)
     handle->free_space -= remaining;
     //moved into a new page. see if this page is free, and if so mark it and move forward
     //otherwise hang around and wait for page to erase
-    if (handle->write_offset > FILE_SIZE)
+    if (handle->write_offset >= handle->size)
         handle->write_offset = 0; //wrap around
 
-    uint8_t counter;
-    flash_read(handle->start + handle->write_offset, &counter, 1);
-    if (counter == 0xFF) //we can move in
-    {
-        counter = (0xFF << handle->write_count);
-        ++handle->write_count;
-        if (handle->write_count == 9) handle->write_count = 1;
-        flash_write(handle->start + handle->write_offset, &counter, PAGE_COUNTER_SIZE);
-        handle->write_offset += PAGE_COUNTER_SIZE; //skip the counter bytes
-    }
+    if (page_ready(handle, handle->write_offset)) //we can move in
+        claim_page(handle);
 }
 
 static void advance_write_pointer(file_handle_t *handle)
 {
     //first, read size and move ahead
     uint8_t size = 0;
-    flash_read(handle->start + handle->write_offset, &size, 1);
+    cache_read(handle, handle->start + handle->write_offset, &size, 1);
     handle->write_offset += size + 2;
     handle->free_space -= size + 2;
 
-    if (handle->write_offset >= FILE_SIZE)
+    if (handle->write_offset >= handle->size)
         handle->write_offset = 0;
 
     //now, we need to check if we just moved onto a new page.
@@ -779,40 +2944,28 @@ static void advance_write_pointer(file_handle_t *handle)
     {
         //we did move into a new page. see if this page is free, and if so mark it and move forward
         //otherwise hang around and wait for page to erase
-        uint8_t counter;
-        flash_read(handle->start + handle->write_offset, &counter, 1);
-        if (counter == 0xFF) //we can move in
-        {
-            counter = (0xFF << handle->write_count);
-            ++handle->write_count;
-            if (handle->write_count == 9) handle->write_count = 1;
-            flash_write(handle->start + handle->write_offset, &counter, PAGE_COUNTER_SIZE);
-            handle->write_offset += PAGE_COUNTER_SIZE; //skip the counter bytes
-        }
+        if (page_ready(handle, handle->write_offset)) //we can move in
+            claim_page(handle);
     }
 }
 
-// Returns the number of bytes written
-// File can fill when the number of destructive reads < number of writes
+//get the write pointer ready to take a chunk of the given size, moving on to a
+//fresh page if there isn't room left on this one. Returns 0 if the chunk
+//cannot be written right now.
 
-size_t
-file_write(file_handle_t *handle, uint8_t* data, size_t size)
+static uint8_t reserve_chunk(file_handle_t *handle, size_t size)
 {
-
     if (!(handle->write_offset % FLASH_PAGE_SIZE)) //we are hanging around at the beginning of a page.
         //We do so because we are waiting for the page to erase. Check to see if it is ready for us
     {
-        uint8_t counter = 0;
-        flash_read(handle->start + handle->write_offset, &counter, 1);
-        if (counter != 0xFF) //still waiting!
+        if (!page_ready(handle, handle->write_offset)) //still waiting!
             return 0;
 
         //if we get here it is because the page has since been erased, and we can proceed
-        counter = (0xFF << handle->write_count);
-        ++handle->write_count;
-        if (handle->write_count == 9) handle->write_count = 1;
-        flash_write(handle->start + handle->write_offset, &counter, PAGE_COUNTER_SIZE);
-        handle->write_offset += PAGE_COUNTER_SIZE;
+#if FILE_CHECKPOINTS
+        checkpoint_invalidate(handle);
+#endif
+        claim_page(handle);
     }
 
     if (size >= 0xFF) //reject, because this value is used as a flag for unused memory!
@@ -827,11 +2980,13 @@ file_write(file_handle_t *handle, uint8_t* data, size_t size)
 
     //here we need to find where we can put this chunk. Because writes cannot span page boundaries, we need to see if there is space on the current page or not
     //first, identify where the next page boundary is
-    uint32_t next_page = FLASH_PAGE_SIZE * (handle->write_offset / FLASH_PAGE_SIZE) + FLASH_PAGE_SIZE;
-    //uint32_t page_free_space = next_page - start;
+    uint32_t page_end = FLASH_PAGE_SIZE * (handle->write_offset / FLASH_PAGE_SIZE) + FLASH_PAGE_SIZE;
 
-    if ((handle->write_offset + size + 2) > next_page) //if not enough room in current page for metadata + data
+    if ((handle->write_offset + size + 2) > page_end) //if not enough room in current page for metadata + data
     {
+#if FILE_CHECKPOINTS
+        checkpoint_invalidate(handle);
+#endif
         advance_write_pointer_to_next_page(handle);
         //check if we can still write from where we are
         if (!(handle->write_offset % FLASH_PAGE_SIZE)) //if we are stuck in limbo
@@ -842,17 +2997,239 @@ file_write(file_handle_t *handle, uint8_t* data, size_t size)
     if ((size + 2) > free_space(handle)) //reject if not enough available space
         return 0;
 
+#if FILE_CHECKPOINTS
+    checkpoint_invalidate(handle);
+#endif
+    return 1;
+}
+
+//write a chunk at the write pointer, which reserve_chunk has readied, and move
+//the write pointer past it
+
+static void write_chunk(file_handle_t *handle, uint8_t* data, size_t size, uint8_t flags)
+{
     //First, write first bit of metadata containing the actual addresses we are attempting to write to
-    flash_write(handle->start + handle->write_offset, &size, 1);
+    cache_write(handle, handle->start + handle->write_offset, &size, 1);
 
     //Now, attempt to commit the data itself
-    flash_write(handle->start + handle->write_offset + 2, data, size);
+    cache_write(handle, handle->start + handle->write_offset + 2, data, size);
 
     //If we reach here successfully, the data is written and valid. Mark it so in the metadata
-    uint8_t flags = 0xFE;
-    flash_write(handle->start + handle->write_offset + 1, &flags, 1);
+    cache_write(handle, handle->start + handle->write_offset + 1, &flags, 1);
 
     advance_write_pointer(handle);
+}
+
+//how much of what is left of a chained record goes into the chunk at offset.
+//Chains fill out the current page if they can, then take whole pages.
+
+static size_t chain_chunk_size(uint32_t offset, size_t remaining)
+{
+    uint32_t in_page = offset % FLASH_PAGE_SIZE;
+    size_t room = MAX_CHUNK_SIZE;
+    if (in_page && (in_page + 3 <= FLASH_PAGE_SIZE)) //room for at least one byte here
+        room = FLASH_PAGE_SIZE - in_page - 2;
+    if (room > MAX_CHUNK_SIZE)
+        room = MAX_CHUNK_SIZE;
+    return (remaining < room) ? remaining : room;
+}
+
+//before writing the first chunk of a chain, make sure that all of it will fit,
+//so that we never have to give up part way through for lack of space. Every
+//page the chain moves into must already be erased.
+
+static uint8_t chain_fits(file_handle_t *handle, size_t size)
+{
+    uint32_t offset = handle->write_offset;
+    uint32_t needed = 0;
+    while (size)
+    {
+        uint32_t in_page = offset % FLASH_PAGE_SIZE;
+        if (!in_page || (in_page + 3 > FLASH_PAGE_SIZE)) //we will be moving into the next page
+        {
+            if (in_page)
+            {
+                needed += FLASH_PAGE_SIZE - in_page;
+                offset += FLASH_PAGE_SIZE - in_page;
+                if (offset >= handle->size)
+                    offset = 0;
+            }
+            if (!page_ready(handle, offset)) //not free
+                return 0;
+            offset += PAGE_COUNTER_SIZE;
+        }
+        size_t chunk_size = chain_chunk_size(offset, size);
+        needed += chunk_size + 2;
+        offset += chunk_size + 2;
+        if (offset >= handle->size)
+            offset = 0;
+        size -= chunk_size;
+        if (needed > free_space(handle))
+            return 0;
+    }
+    return 1;
+}
+
+//write a record too large for a single chunk as a chain of them
+
+static size_t write_chain(file_handle_t *handle, uint8_t* data, size_t size)
+{
+    if (!(handle->write_offset % FLASH_PAGE_SIZE) && !page_ready(handle, handle->write_offset)) //lingering, and still waiting!
+        return 0;
+    if (!chain_fits(handle, size))
+        return 0;
 
+    size_t written = 0;
+    uint8_t flags = 0xFE & ~CHUNK_MORE; //the first chunk
+    while (written < size)
+    {
+        size_t chunk_size = chain_chunk_size(handle->write_offset, size - written);
+        if (chunk_size == size - written) //the last chunk
+            flags |= CHUNK_MORE;
+        if (!reserve_chunk(handle, chunk_size)) //can't happen, we checked
+            return 0;
+        write_chunk(handle, data + written, chunk_size, flags);
+        written += chunk_size;
+        flags &= ~CHUNK_CONT;
+    }
+#if FILE_RECORD_INDEX
+    index_written(handle, size);
+#endif
+    tally(handle, records_written, 1);
+    tally(handle, bytes_written, size);
     return size;
 }
+
+// Returns the number of bytes written
+// File can fill when the number of destructive reads < number of writes
+// Records too large for one chunk are chained across as many chunks as needed.
+// After a power failure, a record is either entirely there or entirely gone.
+
+size_t
+file_write(file_handle_t *handle, uint8_t* data, size_t size)
+{
+    size_t written = 0;
+    if (!(handle->role & FILE_WRITER))
+        return 0;
+    trace_start();
+    sync_peer(handle);
+
+    if (size > MAX_CHUNK_SIZE)
+        written = write_chain(handle, data, size);
+    else if (reserve_chunk(handle, size))
+    {
+        write_chunk(handle, data, size, 0xFE);
+        written = size;
+#if FILE_RECORD_INDEX
+        index_written(handle, size);
+#endif
+        tally(handle, records_written, 1);
+        tally(handle, bytes_written, size);
+    }
+#if FILE_STATS
+    if (size && !written)
+        tally_refused(handle);
+#endif
+
+    publish_pointer(handle);
+    trace_stop(FILE_TRACE_WRITE, handle->file_id, written);
+    return written;
+}
+
+// Returns the number of records written, which will be fewer than count if
+// the file fills up.
+// Records that share a page are written as a single run: one flash write
+// lays down all of their sizes and data, then each of their valid flags is set
+// with a write of its own. Each flag is still a single byte, so after a power
+// failure each record is either entirely there or entirely invalid, just as
+// with file_write.
+// Records too large for a single chunk are chained, just as with file_write.
+
+static size_t write_batch(file_handle_t *handle, file_record_t* records, size_t count)
+{
+    size_t done = 0;
+    while (done < count)
+    {
+        if (records[done].size > MAX_CHUNK_SIZE) //needs a chain of its own
+        {
+            if (!write_chain(handle, records[done].data, records[done].size))
+                return done;
+            ++done;
+            continue;
+        }
+
+        if (!reserve_chunk(handle, records[done].size))
+            return done;
+
+        //gather up as many records as fit in the rest of this page
+        uint32_t run_start = handle->write_offset;
+        uint32_t page = FLASH_PAGE_SIZE * page_of(run_start);
+        uint32_t run_end = run_start;
+        size_t last = done;
+        while ((last < count) && (records[last].size <= MAX_CHUNK_SIZE)
+                && (run_end + records[last].size + 2 <= page + FLASH_PAGE_SIZE)
+                && (run_end - run_start + records[last].size + 2 <= free_space(handle)))
+        {
+            run_end += records[last].size + 2;
+            ++last;
+        }
+
+        //the run is laid out in the page cache, which already holds the erased
+        //space we are about to write over, then written out of it
+        uint8_t check;
+        cache_read(handle, handle->start + run_start, &check, 1);
+        uint8_t *run = handle->cache + (run_start - page);
+        uint32_t offset = 0;
+        for (size_t i = done; i < last; ++i)
+        {
+            run[offset] = records[i].size;
+            memcpy(&run[offset + 2], records[i].data, records[i].size);
+            offset += records[i].size + 2;
+        }
+        if (cache_write(handle, handle->start + run_start, run, run_end - run_start) != (int) (run_end - run_start))
+            return done;
+#if FLASH_ASYNC
+        settle(); //the flags mustn't go out with the data, which is written out of the same copy
+        if (observe(handle->program_failed))
+            return done;
+#endif
+
+        //now the flags, a byte at a time, so that nothing already written is
+        //programmed again
+        uint8_t flag = 0xFE;
+        offset = 0;
+        for (size_t i = done; i < last; ++i)
+        {
+            cache_write(handle, handle->start + run_start + offset + 1, &flag, 1);
+            offset += records[i].size + 2;
+        }
+
+        for (; done < last; ++done)
+        {
+            advance_write_pointer(handle);
+#if FILE_RECORD_INDEX
+            index_written(handle, records[done].size);
+#endif
+            tally(handle, records_written, 1);
+            tally(handle, bytes_written, records[done].size);
+        }
+    }
+    return done;
+}
+
+size_t
+file_write_batch(file_handle_t *handle, file_record_t* records, size_t count)
+{
+    if (!(handle->role & FILE_WRITER))
+        return 0;
+    trace_start();
+    sync_peer(handle);
+    size_t done = write_batch(handle, records, count);
+#if FILE_STATS
+    if (done < count)
+        tally_refused(handle);
+#endif
+    publish_pointer(handle);
+    trace_stop(FILE_TRACE_WRITE_BATCH, handle->file_id, done);
+    return done;
+}
@@ -37,34 +37,226 @@ extern "C"
 #include <stdint.h>
     // For SEEK_SET, SEEK_END, etc.
 
-#define FILE_SIZE (3*FLASH_PAGE_SIZE) //each file is 3 pages; allows for triple buffering
 #define FILE_OFFSET 0 //must be a multiple of a page size!
 
+    //The partition table. Each file is given its own number of pages, and the
+    //files are laid out one after another, in this order, from FILE_OFFSET.
+    //Every file needs at least two pages, so that one can be erased while the
+    //other is in use. Three allow for triple buffering.
+#define FILE_TABLE(FILE) \
+    FILE(FILE_ROOT_BLOCK, 3) \
+    FILE(FILE_FIRMWARE, 3) \
+    FILE(FILE_DRIVE_LOG, 24) \
+    FILE(FILE_DEBUG_LOG, 4) \
+    FILE(FILE_PREFS, 2) \
+    FILE(FILE_ALIVE, 2) \
+    FILE(FILE_SCRATCH, 3) \
+    FILE(FILE_CRASH_LOG, 4)
+
+#define FILE_ID_ENTRY(id, pages) id,
+#define FILE_PAGES_ENTRY(id, pages) id##_PAGES = (pages),
+#define FILE_PAGES_SUM(id, pages) + (pages)
+#define FILE_COUNT_SUM(id, pages) + 1
+
     enum FILE_ID
     {
-        FILE_ROOT_BLOCK = 0,
-        FILE_FIRMWARE,
-        FILE_DRIVE_LOG,
-        FILE_DEBUG_LOG,
-        FILE_PREFS,
-        FILE_ALIVE,
-        FILE_SCRATCH,
-        FILE_CRASH_LOG,
+        FILE_TABLE(FILE_ID_ENTRY)
         FILE_MAX
     };
 
-    //how many handles to a particular file can be given out to user code?
-#define MAX_HANDLES 1
-#define PAGE_COUNTER_SIZE 1
+    //FILE_FIRMWARE_PAGES and so on: the number of pages in each file
+    enum
+    {
+        FILE_TABLE(FILE_PAGES_ENTRY)
+    };
+
+#define FILE_TOTAL_PAGES (0 FILE_TABLE(FILE_PAGES_SUM))
+#define FILE_COUNT (0 FILE_TABLE(FILE_COUNT_SUM)) //FILE_MAX, for the preprocessor
+
+    //Read cursors. A file read by more than one consumer, say an uplink and a
+    //local analytics task, keeps a cursor for each, so that it needn't be
+    //written twice. Each cursor reads and consumes the file at its own pace,
+    //and a page is only erased once every cursor has consumed past it. Cursor
+    //positions survive power loss. Every file has FILE_CURSOR_DEFAULT, which
+    //file_read and file_consume use; FILE_CURSOR_TABLE lists the files that
+    //have more, and how many: the first that many of those below. Changing
+    //the number of cursors a file has means truncating it.
+    enum FILE_CURSOR
+    {
+        FILE_CURSOR_DEFAULT,
+        FILE_CURSOR_ANALYTICS,
+        FILE_CURSOR_MAX //no more than 4
+    };
+
+#define FILE_CURSOR_TABLE(CURSORS) \
+    CURSORS(FILE_CRASH_LOG, 2)
+
+    //a cursor's read pointers, as kept by a handle
+    typedef struct
+    {
+        uint32_t raw_read_chunk_start;
+        uint32_t raw_read_chunk_offset;
+        uint32_t destructive_read_offset;
+    } file_cursor_t;
+
+    //A file is either opened whole, with file_open, or as a separate writer and
+    //reader, with file_open_writer and file_open_reader. The two ends of a
+    //split file each have their own page cache, and share nothing but the
+    //pointer each publishes for the other, so one task may write while another
+    //reads and consumes, without any locking. Opening or closing one end must
+    //not overlap with calls on the other. Only the reader erases; with
+    //FILE_DEFERRED_ERASE, the writer waits on the reader's file_service.
+#define FILE_READER 0x01
+#define FILE_WRITER 0x02
+
+    //file_open and the like take their handles from a static pool, with room
+    //for both ends of every file, so opening and closing never allocate.
+    //file_open_in opens into storage of the caller's own instead, which must
+    //stay put until the handle is closed.
+#define FILE_HANDLE_POOL 1 //set to 0 to do without the pool, and open every handle with file_open_in
+    //each page starts with a header: a flag byte, 0xFE once the page has been
+    //claimed by the writer, followed by a 32-bit sequence number that counts up
+    //with every page claimed. With FILE_WEAR, a 32-bit count of the times the
+    //page has been erased follows, written just after each erase, and a flag
+    //byte written once the count is down; see file_wear. Changing FILE_WEAR
+    //changes the layout, and means erasing the files.
+#define FILE_WEAR 1 //set to 0 to keep no erase counts
+#if FILE_WEAR
+#define PAGE_COUNTER_SIZE 10
+#else
+#define PAGE_COUNTER_SIZE 5
+#endif
+
+    //checkpoints let file_open skip most of the work of recovering a handle.
+    //Each file gets one page for them, just past the files themselves.
+#define FILE_CHECKPOINTS 1 //set to 0 to always recover handles by scanning the whole file
+#define CHECKPOINT_OFFSET (FILE_OFFSET + FILE_TOTAL_PAGES * FLASH_PAGE_SIZE)
+
+    //consumed pages can be left for file_service to erase, rather than
+    //being erased by file_consume as soon as they are done with.
+#define FILE_DEFERRED_ERASE 1 //set to 0 to erase pages as soon as they are consumed
+
+    //each handle that reads keeps a sparse index of where records start, so
+    //that file_seek and file_seek_record can jump most of the way to a record
+    //or byte rather than stepping over every chunk header. It is kept in RAM,
+    //filled in as records are written and as the file is walked, and moves on
+    //as pages are erased. As it fills, the records it keeps are spaced
+    //further apart. Without it, file_seek steps over every chunk header from
+    //the oldest record not yet consumed.
+#define FILE_RECORD_INDEX 1 //set to 0 to do without the index
+#define FILE_INDEX_ENTRIES 16 //how many records the index keeps
+
+    //each handle can count what it does, for file_stats to report. Every count
+    //is a plain addition to a field of the handle.
+#define FILE_STATS 1 //set to 0 to do without file_stats
+
+    //each call into the API, and each flash transaction, can be timed with
+    //flash_ticks and kept in a trace, see FIFO_trace.h. The ring of events
+    //it keeps takes some RAM.
+#define FILE_TRACE 1 //set to 0 to do without the trace
+
+#if FLASH_ASYNC
+    //where the flash is programmed in the background, a handle's writes are
+    //queued, and file_write returns without waiting for them. A record it has
+    //returned for may still be lost to a power failure, though never torn,
+    //until file_sync (or file_close) has returned. The other end of a split
+    //file only sees a record once it is in flash.
+#define FILE_PROGRAMS 8 //how many writes a handle may have queued at once
+
+    struct file_handle_proto_t;
+
+    //one write queued on behalf of a handle
+    typedef struct
+    {
+        struct file_handle_proto_t *handle;
+        uint32_t length;
+        int written; //as reported once it completes
+        uint32_t mark; //PROGRAM_DONE, PROGRAM_QUEUED, or the offset to publish once done
+    } file_program_t;
+#endif
+
+#if FILE_STATS
+    //what a handle has done since it was opened. The flash transactions are
+    //those made on its behalf, including any made recovering the file. A
+    //write is turned away either because the file is full, or because the
+    //write pointer is lingering at the start of a page that has yet to be
+    //erased.
+    typedef struct
+    {
+        uint32_t records_written;
+        uint32_t bytes_written;
+        uint32_t records_read; //read to the end
+        uint32_t bytes_read;
+        uint32_t records_consumed;
+        uint32_t bytes_consumed;
+        uint32_t flash_reads;
+        uint32_t flash_writes;
+        uint32_t flash_erases;
+        uint32_t pages_erased;
+        uint32_t writes_full; //calls to file_write or file_write_batch turned away
+        uint32_t writes_lingering;
+        uint32_t lingers; //times writes have had to wait on an erase
+        uint32_t linger_ticks; //and for how long in all, in flash_ticks, from the first write turned away until the page was claimed
+        //as things stand
+        uint32_t bytes_free;
+        uint32_t pages_pending; //consumed, and waiting to be erased
+    } file_stats_t;
+#endif
+
+#if FILE_WEAR
+    //how worn a file's pages are, from the erase counts in their headers. A
+    //page that has never been erased by FlashFIFO counts as none, as does one
+    //whose count was lost to a power failure until it is next erased, when its
+    //count is worked out from its neighbours'.
+    typedef struct
+    {
+        uint32_t pages;
+        uint32_t least; //erases of the least worn page
+        uint32_t most; //and of the most worn
+        uint32_t total; //of every page together
+        uint32_t uncounted; //pages with no count
+        uint32_t checkpoint; //erases of the file's checkpoint page
+    } file_wear_t;
+#endif
+
+    //where a record starts, with its number and the number of bytes in the
+    //records before it, both counted from wherever the index began
+    typedef struct
+    {
+        uint32_t record;
+        uint32_t bytes;
+        uint32_t offset;
+    } file_index_entry_t;
+
+#if FILE_RECORD_INDEX
+    typedef struct
+    {
+        file_index_entry_t anchor; //at or before the oldest record not yet consumed
+        file_index_entry_t tail; //the furthest the index has got
+        file_index_entry_t entry[FILE_INDEX_ENTRIES]; //every stride'th record between, in a ring
+        uint8_t first;
+        uint8_t count;
+        uint32_t stride;
+        uint8_t caught_up; //set while the tail is at the write pointer
+    } file_index_t;
+#endif
 
     typedef struct file_handle_proto_t
     {
         enum FILE_ID file_id;
+        uint8_t role; //FILE_READER, FILE_WRITER, or both
+
+        //the other end of a split file, and the pointer this end owns, as
+        //published for it: the write offset for a writer, the destructive
+        //read offset for a reader
+        struct file_handle_proto_t *peer;
+        uint32_t published_offset;
 
         uint32_t metadata_raw_start;
         uint32_t metadata_write_offset;
 
         uint32_t start;
+        uint32_t size; //in bytes, a whole number of pages
         uint32_t write_offset;
 
         uint32_t raw_read_chunk_start;
@@ -73,21 +265,114 @@ extern "C"
 
         uint32_t free_space;
 
-        uint8_t write_count;
+        //a file with more than one cursor keeps their read pointers here. The
+        //read pointers above then follow the slowest of them, and govern what
+        //is erased, except while one cursor is in use, when its pointers are
+        //swapped in for them.
+        uint8_t cursors; //how many the file has
+        uint8_t cursor; //the one swapped in, FILE_CURSOR_MAX if none
+        file_cursor_t cursor_at[FILE_CURSOR_MAX];
+
+        uint32_t sequence; //given to the next page claimed
+
+        //where the next checkpoint goes, and whether the last one still
+        //describes the file exactly
+        uint8_t checkpoint_slot;
+        uint8_t checkpoint_live;
+
+        //a run of fully consumed pages that have yet to be erased, held back
+        //so that they can be erased a whole block at a time
+        uint32_t reclaim_start; //offset of the first of them
+        uint32_t reclaim_pages; //how many
+#if FILE_WEAR
+        //pages this handle has erased, whose headers have yet to be stamped
+        //with their erase count, as the erase may still be under way
+        uint32_t wear_addr;
+        uint32_t wear_len; //0 if none
+        uint32_t wear_count;
+#endif
+
+#if FLASH_ASYNC
+        //writes queued from the page cache, used in turn, and whether one has
+        //since failed
+        file_program_t program[FILE_PROGRAMS];
+        uint8_t program_next;
+        uint32_t program_failed;
+#endif
+
+#if FILE_RECORD_INDEX
+        file_index_t index;
+#endif
+
+#if FILE_STATS
+        file_stats_t stats;
+        uint8_t lingering; //whether the write pointer is waiting on an erase
+        uint32_t linger_since; //and since when
+#endif
+
+        //a copy of the most recently touched page, so that walking chunk
+        //headers doesn't cost a separate flash transaction for every byte
+        uint32_t cache_addr; //absolute address of the cached page
+        uint8_t cache_valid;
+        uint8_t cache[FLASH_PAGE_SIZE];
     } file_handle_t;
 
 #define INVALID_FILE_HANDLE   ((file_handle_t*)NULL)
 
+    //one record in a call to file_write_batch
+    typedef struct
+    {
+        uint8_t* data;
+        size_t size;
+    } file_record_t;
+
+    //what file_busy reports the flash to be busy with
+#define FILE_BUSY_ERASING   0x01
+#define FILE_BUSY_WRITING   0x02
+
+#if FLASH_MAPPED
+    //a view straight onto the data of one chunk in flash, from file_peek
+    typedef struct
+    {
+        const uint8_t* data;
+        size_t size;
+    } file_view_t;
+#endif
+
     //write and consume should be atomic
+#if FILE_HANDLE_POOL
     file_handle_t* file_open(enum FILE_ID id);
+    file_handle_t* file_open_writer(enum FILE_ID id);
+    file_handle_t* file_open_reader(enum FILE_ID id);
+#endif
+    file_handle_t* file_open_in(enum FILE_ID id, uint8_t role, file_handle_t* storage); //role is FILE_READER, FILE_WRITER or both
     void file_close(file_handle_t* handle);
     void file_truncate(enum FILE_ID id);
     size_t file_consume(file_handle_t * handle, size_t n); //read/delete n bytes off the top of the FIFO
     size_t file_size(file_handle_t* handle);
     void file_sync(file_handle_t* handle);
     size_t file_read(file_handle_t* handle, uint8_t* data, size_t size);
-    void file_seek(file_handle_t* handle, uint32_t offset, int whence);
+    size_t file_read_cursor(file_handle_t* handle, enum FILE_CURSOR cursor, uint8_t* data, size_t size);
+    size_t file_consume_cursor(file_handle_t* handle, enum FILE_CURSOR cursor, size_t n);
+    size_t file_seek(file_handle_t* handle, uint32_t offset, int whence); //returns the position reached, in bytes
+    size_t file_seek_record(file_handle_t* handle, uint32_t record, int whence); //returns the position reached, in records
     size_t file_write(file_handle_t* handle, uint8_t* data, size_t size);
+    size_t file_write_batch(file_handle_t* handle, file_record_t* records, size_t count); //returns the number of records written
+#if FILE_DEFERRED_ERASE
+    size_t file_service(file_handle_t* handle, size_t budget); //perform up to budget pending erases; returns the number of pages still pending
+#endif
+#if FILE_STATS
+    void file_stats(file_handle_t* handle, file_stats_t* stats);
+#endif
+#if FILE_WEAR
+    uint32_t file_page_erases(enum FILE_ID id, uint32_t page); //the number of times one of the file's pages has been erased
+    void file_wear(enum FILE_ID id, file_wear_t* wear);
+#endif
+    uint8_t file_busy(void); //is the flash erasing, or making queued writes? Calls made meanwhile may wait on it
+#if FLASH_MAPPED
+    size_t file_peek(file_handle_t* handle, file_view_t* views, size_t count); //returns the number of views filled
+    size_t file_release(file_handle_t* handle, size_t count); //release the first count views from file_peek; returns bytes consumed
+#endif
 
 #ifdef	__cplusplus
 }
@@ -0,0 +1,232 @@
+/************************************
+ FIFO.hpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+
+ This file defines a C++ class for FlashFIFO files, header only.
+
+ A FlashFifo owns the handle it was opened with, and closes it when it goes
+ out of scope. It can be moved, but not copied. Data goes in and out as spans
+ of bytes. Every call is an inline pass straight through to the C API, with
+ nothing copied and nothing allocated, and the object is no bigger than the
+ handle pointer it holds.
+
+ ************************************/
+
+#ifndef FIFO_HPP
+#define	FIFO_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <type_traits>
+#include "FIFO.h"
+
+namespace flashfifo
+{
+
+    class FlashFifo
+    {
+    public:
+
+        //open a file whole, or just one end of it. Test the result before use:
+        //it is empty if the file (or that end) is already open.
+
+#if FILE_HANDLE_POOL
+
+        static FlashFifo open(enum FILE_ID id) noexcept
+        {
+            return FlashFifo(file_open(id));
+        }
+
+        static FlashFifo open_writer(enum FILE_ID id) noexcept
+        {
+            return FlashFifo(file_open_writer(id));
+        }
+
+        static FlashFifo open_reader(enum FILE_ID id) noexcept
+        {
+            return FlashFifo(file_open_reader(id));
+        }
+#endif
+
+        //the same, into storage of the caller's own, which must outlive the
+        //FlashFifo (or the handle it is released to)
+
+        static FlashFifo open_in(enum FILE_ID id, uint8_t role, file_handle_t &storage) noexcept
+        {
+            return FlashFifo(file_open_in(id, role, &storage));
+        }
+
+        FlashFifo() noexcept = default;
+
+        //take charge of a handle opened through the C API
+        explicit FlashFifo(file_handle_t *handle) noexcept : handle_(handle)
+        {
+        }
+
+        FlashFifo(FlashFifo &&other) noexcept : handle_(other.release())
+        {
+        }
+
+        FlashFifo& operator=(FlashFifo &&other) noexcept
+        {
+            if (this != &other)
+            {
+                close();
+                handle_ = other.release();
+            }
+            return *this;
+        }
+
+        FlashFifo(const FlashFifo&) = delete;
+        FlashFifo& operator=(const FlashFifo&) = delete;
+
+        ~FlashFifo()
+        {
+            close();
+        }
+
+        //sync and close the file now, rather than when it goes out of scope
+        void close() noexcept
+        {
+            if (handle_)
+                file_close(release());
+        }
+
+        explicit operator bool() const noexcept
+        {
+            return handle_ != nullptr;
+        }
+
+        file_handle_t *get() const noexcept
+        {
+            return handle_;
+        }
+
+        //give up the handle, which the caller must then close
+        file_handle_t *release() noexcept
+        {
+            file_handle_t *handle = handle_;
+            handle_ = nullptr;
+            return handle;
+        }
+
+        //the calls below are those of FIFO.h, which see for what they return
+
+        size_t write(std::span<const std::byte> data) noexcept
+        {
+            return file_write(handle_, bytes(data.data()), data.size());
+        }
+
+        size_t write_batch(std::span<file_record_t> records) noexcept
+        {
+            return file_write_batch(handle_, records.data(), records.size());
+        }
+
+        size_t read(std::span<std::byte> data, enum FILE_CURSOR cursor = FILE_CURSOR_DEFAULT) noexcept
+        {
+            return file_read_cursor(handle_, cursor, bytes(data.data()), data.size());
+        }
+
+        size_t consume(size_t n, enum FILE_CURSOR cursor = FILE_CURSOR_DEFAULT) noexcept
+        {
+            return file_consume_cursor(handle_, cursor, n);
+        }
+
+        size_t size() const noexcept
+        {
+            return file_size(handle_);
+        }
+
+        void sync() noexcept
+        {
+            file_sync(handle_);
+        }
+
+        size_t seek(uint32_t offset, int whence = SEEK_SET) noexcept
+        {
+            return file_seek(handle_, offset, whence);
+        }
+
+        size_t seek_record(uint32_t record, int whence = SEEK_SET) noexcept
+        {
+            return file_seek_record(handle_, record, whence);
+        }
+
+#if FILE_STATS
+
+        file_stats_t stats() const noexcept
+        {
+            file_stats_t stats;
+            file_stats(handle_, &stats);
+            return stats;
+        }
+#endif
+
+#if FILE_WEAR
+
+        file_wear_t wear() const noexcept
+        {
+            file_wear_t wear;
+            file_wear(handle_->file_id, &wear);
+            return wear;
+        }
+#endif
+
+#if FILE_DEFERRED_ERASE
+
+        size_t service(size_t budget) noexcept
+        {
+            return file_service(handle_, budget);
+        }
+#endif
+
+#if FLASH_MAPPED
+
+        size_t peek(std::span<file_view_t> views) noexcept
+        {
+            return file_peek(handle_, views.data(), views.size());
+        }
+
+        size_t release_views(size_t count) noexcept
+        {
+            return file_release(handle_, count);
+        }
+#endif
+
+    private:
+
+        //the C API takes its data as uint8_t, whichever way it is going. Writes
+        //never change it.
+
+        static uint8_t *bytes(const std::byte *data) noexcept
+        {
+            return reinterpret_cast<uint8_t*> (const_cast<std::byte*> (data));
+        }
+
+        file_handle_t *handle_ = nullptr;
+    };
+
+    static_assert(sizeof (FlashFifo) == sizeof (file_handle_t*), "FlashFifo holds nothing but the handle");
+    static_assert(std::is_nothrow_move_constructible_v<FlashFifo> && !std::is_copy_constructible_v<FlashFifo>, "FlashFifo is move-only");
+
+}
+
+#endif	/* FIFO_HPP */
@@ -0,0 +1,390 @@
+/************************************
+ FIFO_coroutine.hpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+
+ This file defines a C++20 coroutine front end for FlashFIFO, header only.
+
+ A coroutine co_awaits writes, reads and consumes on an async_file. Each
+ operation is tried at once. One that can't go ahead yet (the file is full,
+ or empty, or the flash is busy erasing or making queued writes, which the
+ call would have to wait on) parks the coroutine with a scheduler instead.
+ The event loop calls scheduler::poll whenever it comes round, which tries the
+ parked operations again and resumes each coroutine whose operation has gone
+ through. So nothing ever sits in FlashFIFO waiting on the flash, and FIFO
+ I/O can share one loop with network I/O, with no threads of its own.
+
+ Nothing is allocated beyond the coroutine frames themselves: parked
+ operations live in those frames, and are strung together in place.
+
+ ************************************/
+
+#ifndef FIFO_COROUTINE_HPP
+#define	FIFO_COROUTINE_HPP
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include "FIFO.h"
+#include "FIFO.hpp"
+
+namespace flashfifo
+{
+
+    //operations that couldn't go ahead yet, waiting to be tried again
+
+    class scheduler
+    {
+    public:
+
+        struct waiter
+        {
+            //try the operation; true once it has gone through
+            virtual bool attempt() = 0;
+
+            std::coroutine_handle<> coroutine;
+            waiter *next = nullptr;
+        };
+
+        scheduler() = default;
+        scheduler(const scheduler&) = delete;
+        scheduler& operator=(const scheduler&) = delete;
+
+        void park(waiter *w)
+        {
+            w->next = nullptr;
+            if (tail_)
+                tail_->next = w;
+            else
+                head_ = w;
+            tail_ = w;
+        }
+
+        //try everything parked, in the order it was parked, and resume each
+        //coroutine whose operation has gone through. An operation is only
+        //tried while the flash is idle. Returns the number resumed.
+
+        size_t poll()
+        {
+            size_t resumed = 0;
+            waiter *w = head_;
+            head_ = tail_ = nullptr; //anything parked while we go is kept for next time
+            while (w)
+            {
+                waiter *next = w->next;
+                if (!file_busy() && w->attempt())
+                {
+                    w->coroutine.resume();
+                    ++resumed;
+                }
+                else
+                    park(w);
+                w = next;
+            }
+            return resumed;
+        }
+
+        bool idle() const
+        {
+            return !head_;
+        }
+
+    private:
+        waiter *head_ = nullptr;
+        waiter *tail_ = nullptr;
+    };
+
+    //the awaitable behind each operation. It is tried on the spot if the
+    //flash is idle, and parked if it doesn't go through.
+
+    template<typename Result>
+    class operation : public scheduler::waiter
+    {
+    public:
+
+        explicit operation(scheduler &s) : scheduler_(s)
+        {
+        }
+
+        bool await_ready()
+        {
+            return !file_busy() && attempt();
+        }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            coroutine = h;
+            scheduler_.park(this);
+        }
+
+        Result await_resume() const
+        {
+            return result_;
+        }
+
+    protected:
+        scheduler &scheduler_;
+        Result result_ = Result();
+    };
+
+    //write a record, once there is room for it. A record that could never fit
+    //in the file waits forever, so keep records well within its size.
+
+    class write_operation : public operation<size_t>
+    {
+    public:
+
+        write_operation(scheduler &s, file_handle_t *h, const uint8_t *data, size_t size)
+        : operation(s), handle_(h), data_(data), size_(size)
+        {
+        }
+
+        bool attempt() override
+        {
+            if (!size_ || !(handle_->role & FILE_WRITER)) //nothing that will ever go through
+                return true;
+            result_ = file_write(handle_, const_cast<uint8_t*> (data_), size_);
+            return result_ != 0;
+        }
+
+    private:
+        file_handle_t *handle_;
+        const uint8_t *data_;
+        size_t size_;
+    };
+
+    //read up to size bytes, once there is anything to read
+
+    class read_operation : public operation<size_t>
+    {
+    public:
+
+        read_operation(scheduler &s, file_handle_t *h, enum FILE_CURSOR cursor, uint8_t *data, size_t size)
+        : operation(s), handle_(h), cursor_(cursor), data_(data), size_(size)
+        {
+        }
+
+        bool attempt() override
+        {
+            if (!size_ || !(handle_->role & FILE_READER) || (cursor_ >= handle_->cursors))
+                return true;
+            result_ = file_read_cursor(handle_, cursor_, data_, size_);
+            return result_ != 0;
+        }
+
+    private:
+        file_handle_t *handle_;
+        enum FILE_CURSOR cursor_;
+        uint8_t *data_;
+        size_t size_;
+    };
+
+    //consume, sync and service never have to wait for the file, only for the
+    //flash, so they go through at the first attempt made while it is idle
+
+    class consume_operation : public operation<size_t>
+    {
+    public:
+
+        consume_operation(scheduler &s, file_handle_t *h, enum FILE_CURSOR cursor, size_t n)
+        : operation(s), handle_(h), cursor_(cursor), n_(n)
+        {
+        }
+
+        bool attempt() override
+        {
+            result_ = file_consume_cursor(handle_, cursor_, n_);
+            return true;
+        }
+
+    private:
+        file_handle_t *handle_;
+        enum FILE_CURSOR cursor_;
+        size_t n_;
+    };
+
+    //file_sync may still wait on an erase that it starts itself
+
+    class sync_operation : public operation<bool>
+    {
+    public:
+
+        sync_operation(scheduler &s, file_handle_t *h) : operation(s), handle_(h)
+        {
+        }
+
+        bool attempt() override
+        {
+            file_sync(handle_);
+            result_ = true;
+            return true;
+        }
+
+    private:
+        file_handle_t *handle_;
+    };
+
+#if FILE_DEFERRED_ERASE
+
+    //returns the number of pages still waiting to be erased, as file_service does
+
+    class service_operation : public operation<size_t>
+    {
+    public:
+
+        service_operation(scheduler &s, file_handle_t *h, size_t budget)
+        : operation(s), handle_(h), budget_(budget)
+        {
+        }
+
+        bool attempt() override
+        {
+            result_ = file_service(handle_, budget_);
+            return true;
+        }
+
+    private:
+        file_handle_t *handle_;
+        size_t budget_;
+    };
+#endif
+
+    //a handle, as seen by coroutines. It doesn't own the handle: open and
+    //close it as usual, or with a FlashFifo. One coroutine at a time should
+    //be awaiting each end.
+
+    class async_file
+    {
+    public:
+
+        async_file(scheduler &s, file_handle_t *h) : scheduler_(s), handle_(h)
+        {
+        }
+
+        async_file(scheduler &s, FlashFifo &file) : scheduler_(s), handle_(file.get())
+        {
+        }
+
+        write_operation write(const uint8_t *data, size_t size)
+        {
+            return write_operation(scheduler_, handle_, data, size);
+        }
+
+        read_operation read(uint8_t *data, size_t size, enum FILE_CURSOR cursor = FILE_CURSOR_DEFAULT)
+        {
+            return read_operation(scheduler_, handle_, cursor, data, size);
+        }
+
+        consume_operation consume(size_t n, enum FILE_CURSOR cursor = FILE_CURSOR_DEFAULT)
+        {
+            return consume_operation(scheduler_, handle_, cursor, n);
+        }
+
+        sync_operation sync()
+        {
+            return sync_operation(scheduler_, handle_);
+        }
+
+#if FILE_DEFERRED_ERASE
+
+        service_operation service(size_t budget)
+        {
+            return service_operation(scheduler_, handle_, budget);
+        }
+#endif
+
+        file_handle_t *handle() const
+        {
+            return handle_;
+        }
+
+    private:
+        scheduler &scheduler_;
+        file_handle_t *handle_;
+    };
+
+    //a coroutine that runs as soon as it is called, until its first parked
+    //operation, and is then carried on by the scheduler. Its frame lasts as
+    //long as the task does, so a task must not be destroyed while one of its
+    //operations is parked.
+
+    class task
+    {
+    public:
+
+        struct promise_type
+        {
+
+            task get_return_object()
+            {
+                return task(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_never initial_suspend() noexcept
+            {
+                return {};
+            }
+
+            std::suspend_always final_suspend() noexcept
+            {
+                return {};
+            }
+
+            void return_void()
+            {
+            }
+
+            void unhandled_exception()
+            {
+                std::terminate();
+            }
+        };
+
+        task(task &&other) noexcept : coroutine_(other.coroutine_)
+        {
+            other.coroutine_ = nullptr;
+        }
+
+        task(const task&) = delete;
+        task& operator=(const task&) = delete;
+
+        ~task()
+        {
+            if (coroutine_)
+                coroutine_.destroy();
+        }
+
+        bool done() const
+        {
+            return !coroutine_ || coroutine_.done();
+        }
+
+    private:
+
+        explicit task(std::coroutine_handle<promise_type> h) : coroutine_(h)
+        {
+        }
+
+        std::coroutine_handle<promise_type> coroutine_;
+    };
+
+}
+
+#endif	/* FIFO_COROUTINE_HPP */
@@ -0,0 +1,203 @@
+/************************************
+ FIFO_trace.c
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+
+ This file implements the trace defined in FIFO_trace.h.
+
+ ************************************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "FIFO_trace.h"
+#include "flash_port.h"
+
+#if FILE_TRACE
+
+//events may be recorded from several threads at once, each into a slot of
+//its own, claimed by counting up. Once the ring wraps, a slot may be reused
+//while another thread is still filling it in, so its fields are stored
+//singly, and an event can at worst come out torn.
+#if defined(__GNUC__)
+#define count_up(field, n) __atomic_fetch_add(&(field), (n), __ATOMIC_RELAXED)
+#define store(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define load(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#else
+#define count_up(field, n) ((field) += (n), (field) - (n))
+#define store(field, value) ((field) = (value))
+#define load(field) (field)
+#endif
+
+static file_trace_event_t ring[FILE_TRACE_EVENTS];
+static uint32_t recorded; //events since the trace was cleared, the newest in slot recorded - 1
+static file_trace_histogram_t histograms[FILE_TRACE_OP_MAX];
+
+static const char *const op_names[FILE_TRACE_OP_MAX] = {
+    "file_open",
+    "file_close",
+    "file_write",
+    "file_write_batch",
+    "file_read",
+    "file_consume",
+    "file_sync",
+    "file_service",
+    "file_seek",
+    "file_peek",
+    "file_release",
+    "flash_read",
+    "flash_write",
+    "flash_write_submit",
+    "flash_erase",
+    "flash_erase_start"
+};
+
+#define FILE_NAME_ENTRY(id, pages) #id,
+static const char *const file_names[FILE_MAX] = {
+    FILE_TABLE(FILE_NAME_ENTRY)
+};
+
+//the bucket for an event lasting ticks: the number of bits needed to hold it
+
+static uint8_t bucket_of(uint32_t ticks)
+{
+    uint8_t b = 0;
+    while (ticks)
+    {
+        ++b;
+        ticks >>= 1;
+    }
+    return b;
+}
+
+void file_trace_record(enum FILE_TRACE_OP op, uint8_t file, uint32_t start, uint32_t size)
+{
+    uint32_t ticks = flash_ticks() - start;
+    file_trace_event_t *event = &ring[count_up(recorded, 1) % FILE_TRACE_EVENTS];
+    store(event->start, start);
+    store(event->ticks, ticks);
+    store(event->size, size);
+    store(event->op, (uint8_t) op);
+    store(event->file, file);
+
+    file_trace_histogram_t *histogram = &histograms[op];
+    count_up(histogram->count, 1);
+    count_up(histogram->bucket[bucket_of(ticks)], 1);
+    if (ticks > load(histogram->max_ticks)) //racing another thread, the larger may be lost
+        store(histogram->max_ticks, ticks);
+}
+
+void file_trace_clear(void)
+{
+    recorded = 0;
+    memset(histograms, 0, sizeof (histograms));
+}
+
+size_t file_trace_events(file_trace_event_t *events, size_t count)
+{
+    uint32_t held = (recorded < FILE_TRACE_EVENTS) ? recorded : FILE_TRACE_EVENTS;
+    if (count > held)
+        count = held;
+    for (size_t i = 0; i < count; ++i)
+        events[i] = ring[(recorded - count + i) % FILE_TRACE_EVENTS];
+    return count;
+}
+
+void file_trace_histogram(enum FILE_TRACE_OP op, file_trace_histogram_t *histogram)
+{
+    *histogram = histograms[op];
+}
+
+uint32_t file_trace_percentile(enum FILE_TRACE_OP op, uint16_t permille)
+{
+    file_trace_histogram_t *histogram = &histograms[op];
+    uint64_t wanted = ((uint64_t) histogram->count * permille + 999) / 1000; //rounding up
+    uint64_t seen = 0;
+    if (!wanted)
+        return 0;
+    for (uint8_t b = 0; b < FILE_TRACE_BUCKETS; ++b)
+    {
+        seen += histogram->bucket[b];
+        if (seen >= wanted)
+        {
+            uint32_t top = b ? (uint32_t) ((1ull << b) - 1) : 0;
+            return (top < histogram->max_ticks) ? top : histogram->max_ticks;
+        }
+    }
+    return histogram->max_ticks;
+}
+
+const char *file_trace_name(enum FILE_TRACE_OP op)
+{
+    return (op < FILE_TRACE_OP_MAX) ? op_names[op] : "";
+}
+
+//a time in flash ticks, as microseconds to the nanosecond
+
+static void put_us(file_trace_put_t put, void *context, const char *format, uint32_t ticks, uint32_t tick_ns)
+{
+    char text[40];
+    uint64_t ns = (uint64_t) ticks * tick_ns;
+    snprintf(text, sizeof (text), format, (unsigned long long) (ns / 1000), (unsigned) (ns % 1000));
+    put(context, text);
+}
+
+//Calls on each file go on the track for the file, and flash transactions on
+//the track for the bus, which comes after them. As the calls on a file nest,
+//and so do the transactions, each track reads as a flame chart.
+
+void file_trace_export(file_trace_put_t put, void *context, uint32_t tick_ns, uint8_t whole)
+{
+    char text[160];
+    uint8_t first = 1;
+
+    if (whole)
+    {
+        put(context, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+        for (uint8_t file = 0; file <= FILE_MAX; ++file)
+        {
+            snprintf(text, sizeof (text), "%s  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"%s\"}}",
+                     first ? "" : ",\n", (unsigned) file, (file < FILE_MAX) ? file_names[file] : "flash");
+            put(context, text);
+            first = 0;
+        }
+    }
+
+    uint32_t held = (recorded < FILE_TRACE_EVENTS) ? recorded : FILE_TRACE_EVENTS;
+    for (uint32_t i = 0; i < held; ++i)
+    {
+        file_trace_event_t *event = &ring[(recorded - held + i) % FILE_TRACE_EVENTS];
+        snprintf(text, sizeof (text), "%s  {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, ",
+                 first ? "" : ",\n", file_trace_name((enum FILE_TRACE_OP) event->op),
+                 (event->op < FILE_TRACE_FLASH_READ) ? "flashfifo" : "flash", (unsigned) event->file);
+        put(context, text);
+        put_us(put, context, "\"ts\": %llu.%03u, ", event->start, tick_ns);
+        put_us(put, context, "\"dur\": %llu.%03u, ", event->ticks, tick_ns);
+        snprintf(text, sizeof (text), "\"args\": {\"%s\": %u}}",
+                 (event->op < FILE_TRACE_FLASH_READ) ? "returned" : "bytes", (unsigned) event->size);
+        put(context, text);
+        first = 0;
+    }
+
+    if (whole)
+        put(context, "\n]}\n");
+}
+#endif
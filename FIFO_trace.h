@@ -0,0 +1,125 @@
+/************************************
+ FIFO_trace.h
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+
+ This file defines the trace kept with FILE_TRACE set in FIFO.h.
+
+ Every call into the API, and every flash transaction made on its behalf, is
+ timed with flash_ticks. Each is kept in a ring of the most recent events, and
+ counted in a histogram of how long calls of its kind take, with a bucket for
+ each power of two ticks. The histograms keep everything since the trace was
+ last cleared, so the rare slow call isn't lost when the ring wraps.
+
+ The ring can be exported as JSON in the Trace Event Format that Chrome's
+ about:tracing and Perfetto load. Calls on each file appear on a track of
+ their own, and the flash transactions on a track for the bus, so a slow
+ file_consume or file_open can be seen next to the erases or reads that made
+ it slow. The events can also be exported on their own, to be spliced in
+ among an application's own.
+
+ ************************************/
+
+#ifndef FIFO_TRACE_H
+#define	FIFO_TRACE_H
+
+#include "configure.h"
+#include "FIFO.h"
+
+#ifdef	__cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+
+#if FILE_TRACE
+
+#if !FLASH_TICKS
+#error FILE_TRACE needs flash_ticks, see FLASH_TICKS in configure.h
+#endif
+
+    //what is traced: the calls into the API, then the flash transactions
+    enum FILE_TRACE_OP
+    {
+        FILE_TRACE_OPEN,
+        FILE_TRACE_CLOSE,
+        FILE_TRACE_WRITE,
+        FILE_TRACE_WRITE_BATCH,
+        FILE_TRACE_READ,
+        FILE_TRACE_CONSUME,
+        FILE_TRACE_SYNC,
+        FILE_TRACE_SERVICE,
+        FILE_TRACE_SEEK,
+        FILE_TRACE_PEEK,
+        FILE_TRACE_RELEASE,
+        FILE_TRACE_FLASH_READ,
+        FILE_TRACE_FLASH_WRITE,
+        FILE_TRACE_FLASH_WRITE_SUBMIT,
+        FILE_TRACE_FLASH_ERASE,
+        FILE_TRACE_FLASH_ERASE_START,
+        FILE_TRACE_OP_MAX
+    };
+
+#define FILE_TRACE_EVENTS 256 //how many events the ring keeps, a power of two
+    //bucket b of a histogram counts events taking 2^(b-1) ticks or more, and
+    //under 2^b; bucket 0, those taking no time at all
+#define FILE_TRACE_BUCKETS 33
+
+    typedef struct
+    {
+        uint32_t start; //in flash_ticks
+        uint32_t ticks; //how long it took
+        uint32_t size; //what the call returned, or the bytes the transaction moved
+        uint8_t op; //a FILE_TRACE_OP
+        uint8_t file; //a FILE_ID, or FILE_MAX for the flash
+    } file_trace_event_t;
+
+    typedef struct
+    {
+        uint32_t count;
+        uint32_t max_ticks;
+        uint32_t bucket[FILE_TRACE_BUCKETS];
+    } file_trace_histogram_t;
+
+    //how the export hands over its text, a piece at a time
+    typedef void (*file_trace_put_t)(void* context, const char* text);
+
+    //record an event that started at start and has just finished. FlashFIFO
+    //calls this itself.
+    void file_trace_record(enum FILE_TRACE_OP op, uint8_t file, uint32_t start, uint32_t size);
+
+    void file_trace_clear(void); //empty the ring and the histograms
+    size_t file_trace_events(file_trace_event_t* events, size_t count); //copy out up to count of the most recent events, oldest first; returns the number copied
+    void file_trace_histogram(enum FILE_TRACE_OP op, file_trace_histogram_t* histogram);
+    uint32_t file_trace_percentile(enum FILE_TRACE_OP op, uint16_t permille); //the ticks within which that share of calls finished, to the bucket; 0 if there were none
+    const char* file_trace_name(enum FILE_TRACE_OP op);
+
+    //write out the ring as trace-event JSON, tick_ns being the length of a
+    //flash tick in nanoseconds. With whole set, a complete trace is written,
+    //track names and all; without, just the events, separated by commas.
+    //Export while nothing is being traced.
+    void file_trace_export(file_trace_put_t put, void* context, uint32_t tick_ns, uint8_t whole);
+#endif
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* FIFO_TRACE_H */
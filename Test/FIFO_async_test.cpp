@@ -0,0 +1,156 @@
+/************************************
+ FIFO_async_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for writes queued with an
+ * asynchronous flash port. Things being checked, at a general level include:
+ * file_write returning before its record is in flash, file_sync waiting for
+ * it, the caller's buffer being free at once, a split file's reader only
+ * seeing records that are in flash, and power failing with writes queued.
+ * The simulated flash asserts if it is read, programmed directly or erased
+ * while writes are queued.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "flash_port.h"
+#include "handle_pool_mock.h"
+
+#if FLASH_ASYNC
+
+extern "C"
+{
+    void flash_force_write_time(uint32_t polls);
+    void flash_force_power_off(void);
+    void flash_force_succeed(void);
+}
+
+#define METADATA_SIZE   2
+#define DATA_VALID      0xFE
+
+static file_handle_t * f;
+extern uint8_t store[];
+
+TEST_GROUP(AsyncWriteTest)
+{
+
+    void setup()
+    {
+        flash_init();
+        flash_force_write_time(5);
+        f = file_open(FILE_DRIVE_LOG);
+    }
+
+    void teardown()
+    {
+        if (f)
+            file_close(f);
+    }
+};
+
+//file_write returns with its record still queued, and file_sync waits for it
+
+TEST(AsyncWriteTest, SyncWaitsForWrites)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    CHECK_EQUAL(4, file_write(f, data, 4));
+    CHECK_EQUAL(0xFF, store[f->start + PAGE_COUNTER_SIZE + 1]); //not yet
+
+    file_sync(f);
+    CHECK_EQUAL(4, store[f->start + PAGE_COUNTER_SIZE]);
+    CHECK_EQUAL(DATA_VALID, store[f->start + PAGE_COUNTER_SIZE + 1]);
+    CHECK_EQUAL(1, store[f->start + PAGE_COUNTER_SIZE + METADATA_SIZE]);
+}
+
+//the caller's buffer can be reused as soon as file_write returns
+
+TEST(AsyncWriteTest, BufferFreeAtOnce)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    file_write(f, data, 4);
+    data[0] = data[1] = data[2] = data[3] = 0;
+    file_sync(f);
+
+    uint8_t read[4] = {0};
+    CHECK_EQUAL(4, file_read(f, read, 4));
+    CHECK_EQUAL(1, read[0]);
+    CHECK_EQUAL(4, read[3]);
+}
+
+//more writes than can be queued at once, across pages, read back in order
+//without waiting on anything first
+
+TEST(AsyncWriteTest, ManyWritesQueued)
+{
+    uint8_t data[20] = {0};
+    for (uint8_t i = 0; i < 3 * FILE_PROGRAMS; ++i)
+    {
+        data[0] = i;
+        CHECK_EQUAL(20, file_write(f, data, 20));
+    }
+    for (uint8_t i = 0; i < 3 * FILE_PROGRAMS; ++i)
+    {
+        CHECK_EQUAL(20, file_read(f, data, 20));
+        CHECK_EQUAL(i, data[0]);
+        CHECK_EQUAL(20, file_consume(f, 20));
+    }
+}
+
+//the reader of a split file only sees a record once it is in flash
+
+TEST(AsyncWriteTest, ReaderSeesWrittenRecords)
+{
+    file_close(f);
+    f = NULL;
+    file_handle_t *w = file_open_writer(FILE_FIRMWARE);
+    file_handle_t *r = file_open_reader(FILE_FIRMWARE);
+
+    uint8_t data[] = {1, 2, 3, 4};
+    file_write(w, data, 4);
+    CHECK_EQUAL(0, file_read(r, data, 4));
+    file_sync(w);
+    CHECK_EQUAL(4, file_read(r, data, 4));
+    CHECK_EQUAL(1, data[0]);
+
+    file_close(w);
+    file_close(r);
+}
+
+//a record still queued when power fails is lost, but nothing before it is
+
+TEST(AsyncWriteTest, PowerLostWithWritesQueued)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    file_write(f, data, 4);
+    file_sync(f);
+    data[0] = 2;
+    file_write(f, data, 4);
+    flash_force_power_off();
+    file_close(f);
+
+    flash_force_succeed();
+    f = file_open(FILE_DRIVE_LOG);
+    CHECK_EQUAL(4, file_read(f, data, 8));
+    CHECK_EQUAL(1, data[0]);
+}
+
+#endif
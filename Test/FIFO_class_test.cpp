@@ -0,0 +1,133 @@
+/************************************
+ FIFO_class_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for the FlashFifo class. Things
+ * being checked, at a general level include: the handle being closed when
+ * the object goes out of scope, ownership passing on a move, and data going
+ * in and out as spans of bytes.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include <array>
+#include <utility>
+#include "configure.h"
+#include "FIFO.h"
+#include "FIFO.hpp"
+#include "flash_port.h"
+#include "handle_pool_mock.h"
+
+using flashfifo::FlashFifo;
+
+TEST_GROUP(FlashFifoTest)
+{
+
+    void setup()
+    {
+        flash_init();
+    }
+
+    void teardown()
+    {
+    }
+};
+
+#if FILE_HANDLE_POOL
+
+//the file is closed when the object goes out of scope, and can be opened again
+
+TEST(FlashFifoTest, ClosedOutOfScope)
+{
+    {
+        FlashFifo f = FlashFifo::open(FILE_DRIVE_LOG);
+        CHECK(f);
+        CHECK(!FlashFifo::open(FILE_DRIVE_LOG)); //already open
+    }
+    FlashFifo f = FlashFifo::open(FILE_DRIVE_LOG);
+    CHECK(f);
+}
+
+//moving hands the handle over, and assigning over an open file closes it
+
+TEST(FlashFifoTest, MovedNotCopied)
+{
+    FlashFifo f = FlashFifo::open(FILE_DRIVE_LOG);
+    file_handle_t *handle = f.get();
+    FlashFifo g(std::move(f));
+    CHECK(!f);
+    CHECK(g.get() == handle);
+
+    g = FlashFifo::open(FILE_DEBUG_LOG);
+    CHECK(g.get() != handle);
+    f = FlashFifo::open(FILE_DRIVE_LOG); //closed by the assignment above
+    CHECK(f);
+}
+
+#endif
+
+//a handle can be given up, and closed through the C API instead
+
+TEST(FlashFifoTest, Released)
+{
+    file_handle_t *handle;
+    {
+        FlashFifo f(file_open(FILE_DRIVE_LOG));
+        handle = f.release();
+        CHECK(!f);
+    }
+    CHECK(!file_open(FILE_DRIVE_LOG)); //still open
+    file_close(handle);
+}
+
+#if FILE_HANDLE_POOL
+
+//records go in and come out as spans of bytes
+
+TEST(FlashFifoTest, SpansInAndOut)
+{
+    FlashFifo f = FlashFifo::open(FILE_DRIVE_LOG);
+    std::array<std::byte, 4> data = {std::byte{1}, std::byte{2}, std::byte{3}, std::byte{4}};
+    CHECK_EQUAL(4, f.write(data));
+    uint8_t more[] = {5, 6};
+    CHECK_EQUAL(2, f.write(std::as_bytes(std::span(more))));
+
+    std::array<std::byte, 8> read = {};
+    CHECK_EQUAL(6, f.read(read));
+    CHECK_EQUAL(1, (int) read[0]);
+    CHECK_EQUAL(6, (int) read[5]);
+    CHECK_EQUAL(6, f.consume(6));
+    CHECK_EQUAL(0, f.read(read));
+}
+
+//the two ends of a split file, each owned by an object of its own
+
+TEST(FlashFifoTest, SplitEnds)
+{
+    FlashFifo w = FlashFifo::open_writer(FILE_FIRMWARE);
+    FlashFifo r = FlashFifo::open_reader(FILE_FIRMWARE);
+    std::array<std::byte, 4> data = {std::byte{9}};
+    CHECK_EQUAL(0, r.write(data));
+    CHECK_EQUAL(4, w.write(data));
+    std::array<std::byte, 4> read = {};
+    CHECK_EQUAL(4, r.read(read));
+    CHECK_EQUAL(9, (int) read[0]);
+}
+#endif
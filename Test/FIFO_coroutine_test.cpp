@@ -0,0 +1,185 @@
+/************************************
+ FIFO_coroutine_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for the coroutine front end. Things
+ * being checked, at a general level include: operations going through at
+ * once where they can, coroutines parking while the flash is busy or the file
+ * is full or empty and carrying on once polled, and a producer and consumer
+ * sharing a split file from a single loop. Erases and writes are given time
+ * to take, so that there is something to wait for.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "FIFO_coroutine.hpp"
+#include "flash_port.h"
+#include "handle_pool_mock.h"
+
+extern "C"
+{
+    void flash_force_erase_time(uint32_t polls);
+    void flash_force_write_time(uint32_t polls);
+}
+
+#define RECORDS 500
+
+static file_handle_t * f;
+
+TEST_GROUP(CoroutineTest)
+{
+
+    void setup()
+    {
+        flash_init();
+        f = file_open(FILE_DRIVE_LOG);
+    }
+
+    void teardown()
+    {
+        if (f)
+            file_close(f);
+    }
+};
+
+static flashfifo::task write_then_read(flashfifo::async_file file, uint8_t *read, size_t *got)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    co_await file.write(data, 4);
+    *got = co_await file.read(read, 4);
+    co_await file.consume(*got);
+}
+
+//with nothing to wait for, a coroutine runs straight through
+
+TEST(CoroutineTest, RunsStraightThrough)
+{
+    flashfifo::scheduler s;
+    uint8_t read[4] = {0};
+    size_t got = 0;
+    flashfifo::task t = write_then_read(flashfifo::async_file(s, f), read, &got);
+    CHECK(t.done());
+    CHECK(s.idle());
+    CHECK_EQUAL(4, got);
+    CHECK_EQUAL(1, read[0]);
+}
+
+//a read of an empty file parks until there is something to read
+
+static flashfifo::task read_one(flashfifo::async_file file, uint8_t *read)
+{
+    co_await file.read(read, 4);
+}
+
+TEST(CoroutineTest, ReadParksUntilWritten)
+{
+    flashfifo::scheduler s;
+    uint8_t read[4] = {0};
+    flashfifo::task t = read_one(flashfifo::async_file(s, f), read);
+    CHECK(!t.done());
+    CHECK_EQUAL(0, s.poll());
+
+    uint8_t data[] = {7, 2, 3, 4};
+    file_write(f, data, 4);
+    CHECK_EQUAL(1, s.poll());
+    CHECK(t.done());
+    CHECK_EQUAL(7, read[0]);
+}
+
+//while writes are being made, the next waits its turn rather than holding up
+//the caller
+
+TEST(CoroutineTest, ParksWhileFlashBusy)
+{
+    flash_force_write_time(3);
+    flashfifo::scheduler s;
+    uint8_t read[4] = {0};
+    size_t got = 0;
+    flashfifo::task t = write_then_read(flashfifo::async_file(s, f), read, &got);
+#if FLASH_ASYNC
+    CHECK(!t.done()); //the read waits on the write
+#endif
+    uint16_t polls = 0;
+    while (!t.done() && (polls < 100))
+    {
+        s.poll();
+        ++polls;
+    }
+    CHECK(t.done());
+    CHECK_EQUAL(4, got);
+    CHECK_EQUAL(1, read[0]);
+}
+
+//a producer and a consumer on the two ends of a file, from the one loop,
+//with the producer waiting on the consumer whenever the file is full
+
+static flashfifo::task producer(flashfifo::async_file file, uint32_t *done)
+{
+    uint8_t data[20] = {0};
+    for (*done = 0; *done < RECORDS; ++*done)
+    {
+        data[0] = (uint8_t) * done;
+        co_await file.write(data, 20);
+    }
+}
+
+static flashfifo::task consumer(flashfifo::async_file file, uint32_t *done, uint32_t *errors)
+{
+    uint8_t data[20] = {0};
+    for (*done = 0; *done < RECORDS; ++*done)
+    {
+        if ((co_await file.read(data, 20) != 20) || (data[0] != (uint8_t) * done))
+            ++*errors;
+        co_await file.consume(20);
+#if FILE_DEFERRED_ERASE
+        co_await file.service(1);
+#endif
+    }
+}
+
+TEST(CoroutineTest, ProducerAndConsumer)
+{
+    file_close(f);
+    f = NULL;
+    flash_force_erase_time(4);
+    flash_force_write_time(2);
+    file_handle_t *w = file_open_writer(FILE_FIRMWARE);
+    file_handle_t *r = file_open_reader(FILE_FIRMWARE);
+
+    flashfifo::scheduler s;
+    uint32_t written = 0, read = 0, errors = 0;
+    flashfifo::task p = producer(flashfifo::async_file(s, w), &written);
+    flashfifo::task c = consumer(flashfifo::async_file(s, r), &read, &errors);
+    uint32_t polls = 0;
+    while (!(p.done() && c.done()) && (polls < 100000))
+    {
+        s.poll();
+        ++polls;
+    }
+    CHECK(p.done());
+    CHECK(c.done());
+    CHECK_EQUAL(RECORDS, read);
+    CHECK_EQUAL(0, errors);
+
+    file_close(w);
+    file_close(r);
+}
@@ -0,0 +1,229 @@
+/************************************
+ FIFO_cursor_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for files read through more than
+ * one cursor. Things being checked, at a general level include: each cursor
+ * reading the whole file for itself, pages being kept until every cursor has
+ * consumed them, and cursor positions being recovered after power loss.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "flash_port.h"
+#include "handle_pool_mock.h"
+
+#define METADATA_SIZE   2
+#define DATA_VALID      0xFE
+
+static file_handle_t * f;
+extern uint8_t store[];
+
+//let any erases that were left for later happen now
+
+static void service(void)
+{
+#if FILE_DEFERRED_ERASE
+    file_service(f, (size_t) - 1);
+#endif
+}
+
+TEST_GROUP(CursorTest)
+{
+
+    void setup()
+    {
+        flash_init();
+        f = file_open(FILE_CRASH_LOG);
+
+        //three records to begin with
+        uint8_t data[] = {1, 2, 3, 4};
+        for (uint8_t i = 0; i < 3; ++i)
+        {
+            data[0] = i;
+            file_write(f, data, 4);
+        }
+    }
+
+    void teardown()
+    {
+        file_close(f);
+    }
+};
+
+//every cursor reads the whole file for itself, and a file with just the one
+//cursor has no others
+
+TEST(CursorTest, EachCursorReadsEverything)
+{
+    uint8_t data[4];
+    CHECK_EQUAL(2, f->cursors);
+    for (uint8_t i = 0; i < 3; ++i)
+    {
+        CHECK_EQUAL(4, file_read(f, data, 4));
+        CHECK_EQUAL(i, data[0]);
+        CHECK_EQUAL(4, file_consume(f, 4));
+    }
+    CHECK_EQUAL(0, file_read(f, data, 4));
+
+    for (uint8_t i = 0; i < 3; ++i)
+    {
+        CHECK_EQUAL(4, file_read_cursor(f, FILE_CURSOR_ANALYTICS, data, 4));
+        CHECK_EQUAL(i, data[0]);
+    }
+    CHECK_EQUAL(0, file_read_cursor(f, FILE_CURSOR_ANALYTICS, data, 4));
+
+    file_handle_t *g = file_open(FILE_FIRMWARE);
+    CHECK_EQUAL(0, file_read_cursor(g, FILE_CURSOR_ANALYTICS, data, 4));
+    file_close(g);
+}
+
+//each cursor clears a flag bit of its own, and the last to consume a chunk
+//clears the consumed flag along with it
+
+TEST(CursorTest, ConsumedByEveryCursor)
+{
+    uint8_t data[4];
+    file_read(f, data, 4);
+    file_consume(f, 4);
+    CHECK_EQUAL(DATA_VALID & ~0x04, store[f->start + PAGE_COUNTER_SIZE + 1]);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->destructive_read_offset); //held back by the other cursor
+
+    file_read_cursor(f, FILE_CURSOR_ANALYTICS, data, 4);
+    file_consume_cursor(f, FILE_CURSOR_ANALYTICS, 4);
+    CHECK_EQUAL(DATA_VALID & ~0x04 & ~0x08 & ~0x02, store[f->start + PAGE_COUNTER_SIZE + 1]);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 4 + METADATA_SIZE, f->destructive_read_offset);
+}
+
+//a page is only erased once the slowest cursor has consumed past it
+
+TEST(CursorTest, PagesKeptForSlowestCursor)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+    file_write(f, data, size); //onto the second page
+    file_write(f, data, 4); //and the third
+    size_t consumed = 3 * 4 + size;
+
+    CHECK_EQUAL(consumed, file_read(f, data, 3 * 4) + file_read(f, data, size));
+    file_consume(f, consumed);
+    service();
+    CHECK_EQUAL(DATA_VALID, store[f->start]); //still wanted
+    CHECK_EQUAL(DATA_VALID, store[f->start + FLASH_PAGE_SIZE]);
+
+    file_read_cursor(f, FILE_CURSOR_ANALYTICS, data, 3 * 4);
+    file_read_cursor(f, FILE_CURSOR_ANALYTICS, data, size);
+    CHECK_EQUAL(consumed, file_consume_cursor(f, FILE_CURSOR_ANALYTICS, consumed));
+    service();
+    CHECK_EQUAL(0xFF, store[f->start]);
+    CHECK_EQUAL(0xFF, store[f->start + FLASH_PAGE_SIZE]);
+
+    CHECK_EQUAL(4, file_read(f, data, size));
+    CHECK_EQUAL(4, file_read_cursor(f, FILE_CURSOR_ANALYTICS, data, size));
+}
+
+//the writer is only held up by the slowest cursor
+
+TEST(CursorTest, WriterWaitsOnSlowestCursor)
+{
+    uint8_t data[20] = {0};
+    uint8_t next_write = 3;
+    uint16_t next_read[FILE_CURSOR_MAX] = {0, 0};
+    for (uint16_t lap = 0; lap < 100; ++lap)
+    {
+        data[0] = next_write;
+        while (file_write(f, data, 20))
+            data[0] = ++next_write;
+
+        //the default cursor races ahead, the other dawdles
+        for (uint8_t c = 0; c < FILE_CURSOR_MAX; ++c)
+        {
+            for (uint8_t i = 0; i < (c ? 3 : 8); ++i)
+            {
+                uint8_t size = (next_read[c] < 3) ? 4 : 20;
+                if (!file_read_cursor(f, (enum FILE_CURSOR) c, data, size))
+                    break;
+                CHECK_EQUAL((uint8_t) next_read[c], data[0]);
+                CHECK_EQUAL(size, file_consume_cursor(f, (enum FILE_CURSOR) c, size));
+                ++next_read[c];
+            }
+        }
+        service();
+    }
+    CHECK(next_read[FILE_CURSOR_ANALYTICS] > 3 * FILE_CRASH_LOG_PAGES);
+}
+
+//where each cursor had got to survives closing and reopening the file
+
+TEST(CursorTest, CursorsRecovered)
+{
+    uint8_t data[4];
+    for (uint8_t i = 0; i < 2; ++i)
+    {
+        file_read(f, data, 4);
+        file_consume(f, 4);
+    }
+    file_read_cursor(f, FILE_CURSOR_ANALYTICS, data, 4);
+    file_consume_cursor(f, FILE_CURSOR_ANALYTICS, 4);
+    file_close(f);
+
+    f = file_open(FILE_CRASH_LOG);
+    CHECK_EQUAL(4, file_read(f, data, 4));
+    CHECK_EQUAL(2, data[0]);
+    CHECK_EQUAL(4, file_read_cursor(f, FILE_CURSOR_ANALYTICS, data, 4));
+    CHECK_EQUAL(1, data[0]);
+}
+
+//the same, without the help of a checkpoint, and with a chained record that one
+//cursor had begun to consume when power failed
+
+TEST(CursorTest, InterruptedChainFinished)
+{
+    uint8_t data[200] = {0};
+    data[0] = 0xCC;
+    file_write(f, data, 200); //a chain of two chunks
+    data[0] = 3;
+    file_write(f, data, 4);
+
+    uint8_t copy[200];
+    for (uint8_t i = 0; i < 4; ++i)
+        file_read_cursor(f, FILE_CURSOR_ANALYTICS, copy, 200);
+    CHECK_EQUAL(12 + 200, file_consume_cursor(f, FILE_CURSOR_ANALYTICS, 12 + 200));
+
+    //put things back as they would be had power failed after the first chunk
+    //of the chain, which lies just past the three records from setup
+    uint32_t head = f->start + PAGE_COUNTER_SIZE + 3 * (4 + METADATA_SIZE);
+    uint32_t tail = f->start + FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE;
+    CHECK_EQUAL(0, store[tail + 1] & 0x08);
+    store[tail + 1] |= 0x08;
+    file_close(f);
+    for (uint32_t i = CHECKPOINT_OFFSET; i < CHECKPOINT_OFFSET + FILE_MAX * FLASH_PAGE_SIZE; ++i)
+        store[i] = 0xFF; //no checkpoints to help
+
+    f = file_open(FILE_CRASH_LOG);
+    CHECK_EQUAL(0, store[head + 1] & 0x08);
+    CHECK_EQUAL(0, store[tail + 1] & 0x08); //finished off
+    CHECK_EQUAL(4, file_read_cursor(f, FILE_CURSOR_ANALYTICS, copy, 200));
+    CHECK_EQUAL(3, copy[0]);
+    CHECK_EQUAL(4, file_read(f, copy, 4));
+    CHECK_EQUAL(0, copy[0]);
+}
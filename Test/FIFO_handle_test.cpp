@@ -0,0 +1,155 @@
+/************************************
+ FIFO_handle_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for where handles are kept. Things
+ * being checked, at a general level include: the pool handing back the same
+ * handle every time a file is opened, the two ends of a split file each
+ * having their own, and handles opened into storage of the caller's own.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "FIFO.hpp"
+#include "flash_port.h"
+
+static file_handle_t * f;
+
+TEST_GROUP(HandleStorageTest)
+{
+
+    void setup()
+    {
+        flash_init();
+        f = NULL;
+    }
+
+    void teardown()
+    {
+        if (f)
+            file_close(f);
+    }
+};
+
+#if FILE_HANDLE_POOL
+
+//opening a file again, once it has been closed, gives the same handle
+
+TEST(HandleStorageTest, PoolHandleReused)
+{
+    f = file_open(FILE_DRIVE_LOG);
+    file_handle_t *first = f;
+    file_close(f);
+    f = file_open(FILE_DRIVE_LOG);
+    CHECK(f == first);
+}
+
+//each end of a split file has a handle of its own, and the writer's is the
+//one the whole file would have had
+
+TEST(HandleStorageTest, SplitEndsPooledApart)
+{
+    f = file_open(FILE_FIRMWARE);
+    file_handle_t *whole = f;
+    file_close(f);
+    f = NULL;
+
+    file_handle_t *w = file_open_writer(FILE_FIRMWARE);
+    file_handle_t *r = file_open_reader(FILE_FIRMWARE);
+    CHECK(w == whole);
+    CHECK(r != w);
+
+    uint8_t data[] = {1, 2, 3, 4};
+    file_write(w, data, 4);
+    file_sync(w);
+    data[0] = 0;
+    CHECK_EQUAL(4, file_read(r, data, 4));
+    CHECK_EQUAL(1, data[0]);
+    file_close(w);
+    file_close(r);
+}
+
+//one end of a split file can come from the pool, and the other not
+
+TEST(HandleStorageTest, SplitEndsStoredApart)
+{
+    file_handle_t storage;
+    file_handle_t *w = file_open_in(FILE_FIRMWARE, FILE_WRITER, &storage);
+    file_handle_t *r = file_open_reader(FILE_FIRMWARE);
+    CHECK(w == &storage);
+
+    uint8_t data[] = {1, 2, 3, 4};
+    file_write(w, data, 4);
+    file_close(w);
+    data[0] = 0;
+    CHECK_EQUAL(4, file_read(r, data, 4));
+    CHECK_EQUAL(1, data[0]);
+    file_close(r);
+}
+#endif
+
+//a handle opened into the caller's storage is that storage, and what is
+//written through it is there when the file is opened again
+
+TEST(HandleStorageTest, OpenedInOwnStorage)
+{
+    file_handle_t storage;
+    f = file_open_in(FILE_DRIVE_LOG, FILE_READER | FILE_WRITER, &storage);
+    CHECK(f == &storage);
+    CHECK(!file_open_in(FILE_DRIVE_LOG, FILE_READER | FILE_WRITER, &storage)); //already open
+
+    uint8_t data[] = {1, 2, 3, 4};
+    CHECK_EQUAL(4, file_write(f, data, 4));
+    file_close(f);
+
+    file_handle_t other;
+    f = file_open_in(FILE_DRIVE_LOG, FILE_READER | FILE_WRITER, &other);
+    data[0] = 0;
+    CHECK_EQUAL(4, file_read(f, data, 4));
+    CHECK_EQUAL(1, data[0]);
+    file_close(f); //while its storage is still around
+    f = NULL;
+}
+
+//there must be somewhere to put the handle, and something to open
+
+TEST(HandleStorageTest, OpenInRefused)
+{
+    file_handle_t storage;
+    CHECK(!file_open_in(FILE_DRIVE_LOG, FILE_READER | FILE_WRITER, NULL));
+    CHECK(!file_open_in(FILE_DRIVE_LOG, 0, &storage));
+    CHECK(!file_open_in(FILE_DRIVE_LOG, 0x04, &storage));
+}
+
+//the class takes storage of the caller's own just the same
+
+TEST(HandleStorageTest, ClassInOwnStorage)
+{
+    file_handle_t storage;
+    {
+        flashfifo::FlashFifo file = flashfifo::FlashFifo::open_in(FILE_DRIVE_LOG, FILE_READER | FILE_WRITER, storage);
+        CHECK(file.get() == &storage);
+    }
+    file_handle_t *h = file_open_in(FILE_DRIVE_LOG, FILE_READER | FILE_WRITER, &storage); //closed again
+    CHECK(h == &storage);
+    file_close(h);
+}
@@ -31,15 +31,30 @@
 #include <CppUTest/TestHarness.h>
 #include "FIFO.h"
 #include "flash_port.h"
+#include "handle_pool_mock.h"
 
 extern "C"
 {
 void flash_force_fail(uint8_t count);
 void flash_force_succeed(void);
+void flash_force_block_size(size_t size);
+void flash_force_erase_time(uint32_t polls);
 }
 
 static file_handle_t * f;
 extern uint8_t store[];
+extern uint32_t flash_read_calls;
+extern uint32_t flash_erase_calls;
+extern uint32_t flash_erase_suspends;
+
+//let any erases that were left for later happen now
+
+static void service(void)
+{
+#if FILE_DEFERRED_ERASE
+    file_service(f, (size_t) - 1);
+#endif
+}
 
 TEST_GROUP(BasicFileReadTest)
 {
@@ -95,7 +110,7 @@ TEST(BasicFileReadTest, TestFileReadPtrIncr)
     uint8_t i = 0;
     uint8_t data[4] = {0, 0, 0, 0};
     i = file_read(f, data, 4);
-    CHECK_EQUAL(7, f->raw_read_chunk_start); //address of the start of the next chunk
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 6, f->raw_read_chunk_start); //address of the start of the next chunk
     CHECK_EQUAL(0, f->raw_read_chunk_offset); //offset within chunk
 }
 
@@ -132,7 +147,7 @@ TEST(BasicFileReadTest, TestFileReadAcrossMultipleChunks)
     CHECK_EQUAL(4, data[3]);
     CHECK_EQUAL(5, data[4]);
     CHECK_EQUAL(6, data[5]);
-    CHECK_EQUAL(7, f->raw_read_chunk_start);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 6, f->raw_read_chunk_start);
     CHECK_EQUAL(2, f->raw_read_chunk_offset);
 }
 
@@ -170,9 +185,9 @@ TEST(BasicFileReadTest, TestFileConsumeBasic)
     i = file_read(f, data, 4);
     file_consume(f, 4);
     CHECK_EQUAL(0xFC, store[f->start + PAGE_COUNTER_SIZE + 1]);
-    CHECK_EQUAL(7, f->raw_read_chunk_start);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 6, f->raw_read_chunk_start);
     CHECK_EQUAL(0, f->raw_read_chunk_offset);
-    CHECK_EQUAL(7, f->destructive_read_offset);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 6, f->destructive_read_offset);
 }
 
 //make sure that if we consume only a part of one chunk, we do not actually consume it
@@ -183,9 +198,9 @@ TEST(BasicFileReadTest, TestFileConsumePartialChunks1)
     file_read(f, data, 4); //read the chunk to advance the read pointer
     file_consume(f, 2); //consume part of one chunk; should refuse to consume
     CHECK_EQUAL(0xFE, store[f->start + PAGE_COUNTER_SIZE + 1]);
-    CHECK_EQUAL(7, f->raw_read_chunk_start);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 6, f->raw_read_chunk_start);
     CHECK_EQUAL(0, f->raw_read_chunk_offset);
-    CHECK_EQUAL(1, f->destructive_read_offset); //make sure the destructive read offset doesn't advance!
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->destructive_read_offset); //make sure the destructive read offset doesn't advance!
 }
 
 TEST(BasicFileReadTest, TestFileConsumePartialChunks2)
@@ -196,9 +211,9 @@ TEST(BasicFileReadTest, TestFileConsumePartialChunks2)
     file_read(f, data_more, 8); //read both chunks to advance the read pointer
     file_consume(f, 6); //consume one chunk, and consider the next part. Second chunk should not be consumed
     CHECK_EQUAL(0xFE, store[f->start + PAGE_COUNTER_SIZE + 7]);
-    CHECK_EQUAL(13, f->raw_read_chunk_start);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 12, f->raw_read_chunk_start);
     CHECK_EQUAL(0, f->raw_read_chunk_offset);
-    CHECK_EQUAL(7, f->destructive_read_offset); //make sure the destructive read offset doesn't advance beyond first chunk
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 6, f->destructive_read_offset); //make sure the destructive read offset doesn't advance beyond first chunk
 }
 
 //sometimes writes leave some blank space at the end of a page. Make sure we skip that when reading!
@@ -212,7 +227,7 @@ TEST(BasicFileReadTest, TestFileReadEndOfIncompletePage)
     file_write(f, data, size); //won't fit on page 1, moves ahead to page 2
     file_read(f, data, 4); //read first chunk, read point should advance past dead space to second page.
 
-    CHECK_EQUAL(129, f->raw_read_chunk_start);
+    CHECK_EQUAL(FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE, f->raw_read_chunk_start);
 }
 
 //Now test the wrap-around functionality.
@@ -243,10 +258,10 @@ TEST(BasicFileReadTest, TestReadWrapsAroundEnd)
     //now, the write pointer is at the beginning of the second page, as is the read pointer. advance the read pointer all the way around
     uint8_t read = file_read(f, data, size); //moves pointer to beginning of third page, 256
     CHECK_EQUAL(size, read);
-    CHECK_EQUAL(257, f->raw_read_chunk_start);
+    CHECK_EQUAL(2 * FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE, f->raw_read_chunk_start);
     read = file_read(f, data, size); //moves pointer to wrap around to first page, 0
     CHECK_EQUAL(size, read);
-    CHECK_EQUAL(1, f->raw_read_chunk_start);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->raw_read_chunk_start);
 }
 
 
@@ -256,9 +271,9 @@ TEST(BasicFileReadTest, TestFileConsumeBeyondReadPointer1)
 {
     file_consume(f, 4);
     CHECK_EQUAL(0xFE, store[f->start + PAGE_COUNTER_SIZE + 1]);
-    CHECK_EQUAL(1, f->raw_read_chunk_start);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->raw_read_chunk_start);
     CHECK_EQUAL(0, f->raw_read_chunk_offset);
-    CHECK_EQUAL(1, f->destructive_read_offset); //make sure the destructive read offset doesn't advance!
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->destructive_read_offset); //make sure the destructive read offset doesn't advance!
 }
 
 //Repeat test with a little more data
@@ -273,9 +288,9 @@ TEST(BasicFileReadTest, TestFileConsumeBeyondReadPointer2)
     CHECK_EQUAL(consumed, 4);
     CHECK_EQUAL(0xFC, store[f->start + PAGE_COUNTER_SIZE + 1]); //check first chunk marked as consumed
     CHECK_EQUAL(0xFE, store[f->start + PAGE_COUNTER_SIZE + 7]); //check second chunk NOT marked as consumed
-    CHECK_EQUAL(7, f->raw_read_chunk_start);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 6, f->raw_read_chunk_start);
     CHECK_EQUAL(2, f->raw_read_chunk_offset);
-    CHECK_EQUAL(7, f->destructive_read_offset); //make sure the destructive read offset doesn't advance!
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 6, f->destructive_read_offset); //make sure the destructive read offset doesn't advance!
 }
 
 //check that a read operation does not extend beyond the write pointer
@@ -320,6 +335,7 @@ TEST(BasicFileReadTest, TestPageConsumptionErasesPage)
         file_consume(f, 4);
         --chunks;
     }
+    service();
     //make sure that first page got erased, but second has not
     CHECK_EQUAL(0xFF, store[f->start + PAGE_COUNTER_SIZE + 0]); //0xFF means it was erased
     CHECK_EQUAL(0x04, store[f->start + PAGE_COUNTER_SIZE + 128]); //first byte of second page
@@ -349,11 +365,347 @@ TEST(BasicFileReadTest, TestPageConsumptionErasesTwoPages)
         file_consume(f, 4);
         --chunks;
     }
+    service();
     //make sure that first and second page got erased, but third has not
     CHECK_EQUAL(0xFF, store[f->start + PAGE_COUNTER_SIZE + 0]); //0xFF means it was erased
     CHECK_EQUAL(0xFF, store[f->start + PAGE_COUNTER_SIZE + 128]); //first byte of second page
     CHECK_EQUAL(0x04, store[f->start + PAGE_COUNTER_SIZE + 256]); //third page should be intact
 }
 
+//with a part that erases two pages at a time, consumed pages are held back
+//until their whole block can be erased in one go
+
+TEST(BasicFileReadTest, TestPageConsumptionErasesBlock)
+{
+    uint8_t size = FLASH_PAGE_SIZE - 2 - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - 2 - PAGE_COUNTER_SIZE] = {0};
+    flash_force_block_size(2 * FLASH_PAGE_SIZE);
+    CHECK_EQUAL(0, (f->start + FLASH_PAGE_SIZE) % (2 * FLASH_PAGE_SIZE)); //the second and third pages make up a block
+    file_read(f, data, 4);
+    file_consume(f, 4);
+
+    //fill all three pages
+    file_write(f, data, size - 6);
+    file_write(f, data, size);
+    file_write(f, data, size);
+
+    flash_erase_calls = 0;
+    file_read(f, data, size - 6);
+    file_consume(f, size - 6);
+    service();
+    CHECK_EQUAL(1, flash_erase_calls); //not part of a block, so erased on its own
+    CHECK_EQUAL(0xFF, store[f->start]);
+    file_write(f, data, 4); //move the writer back in
+
+    file_read(f, data, size);
+    file_consume(f, size);
+    service();
+    CHECK_EQUAL(1, flash_erase_calls); //held back, the rest of the block is still in use
+    CHECK(0xFF != store[f->start + FLASH_PAGE_SIZE]);
+
+    file_read(f, data, size);
+    file_consume(f, size);
+    service();
+    CHECK_EQUAL(2, flash_erase_calls); //both pages at once
+    CHECK_EQUAL(0xFF, store[f->start + FLASH_PAGE_SIZE]);
+    CHECK_EQUAL(0xFF, store[f->start + 2 * FLASH_PAGE_SIZE]);
+}
+
+//if the writer needs a page that is being held back, it is erased on the spot
+
+TEST(BasicFileReadTest, TestHeldBackPageErasedForWriter)
+{
+    uint8_t size = FLASH_PAGE_SIZE - 2 - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - 2 - PAGE_COUNTER_SIZE] = {0};
+    flash_force_block_size(2 * FLASH_PAGE_SIZE);
+    file_read(f, data, 4);
+    file_consume(f, 4);
+
+    //fill the file, then consume everything bar the last page
+    file_write(f, data, size - 6);
+    file_write(f, data, size);
+    file_write(f, data, size);
+    for (uint8_t i = 0; i < 2; ++i)
+    {
+        file_read(f, data, size);
+        file_consume(f, size);
+    }
+    CHECK_EQUAL(0, f->write_offset); //lingering
+    CHECK_EQUAL(size, file_write(f, data, size));
+    CHECK_EQUAL(size, file_write(f, data, size));
+}
+
+//a reader that catches up with a writer lingering at the start of a page,
+//waiting for it to be erased, stops there rather than reading on
+
+TEST(BasicFileReadTest, TestReadCatchesUpWithLingeringWriter)
+{
+    uint8_t size = FLASH_PAGE_SIZE - 2 - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - 2 - PAGE_COUNTER_SIZE] = {0};
+    file_write(f, data, size);
+    file_write(f, data, size);
+    CHECK_EQUAL(0, f->write_offset); //lingering
+
+    CHECK_EQUAL(4 + 2 * size, file_read(f, data, size)
+                + file_read(f, data, size) + file_read(f, data, size));
+    CHECK_EQUAL(4 + 2 * size, file_consume(f, 4 + 2 * size));
+    CHECK_EQUAL(0, file_read(f, data, size));
+    CHECK_EQUAL(0, file_consume(f, size));
+
+    data[0] = 0x5A;
+    CHECK_EQUAL(4, file_write(f, data, 4));
+    data[0] = 0;
+    CHECK_EQUAL(4, file_read(f, data, size));
+    CHECK_EQUAL(0x5A, data[0]);
+}
+
+//a reader that caught up with the writer part way through a page carries on to
+//the next page, when the writer leaves the rest of this one unused
+
+TEST(BasicFileReadTest, TestReadFollowsWriterOntoNextPage)
+{
+    uint8_t data[100] = {0};
+    file_write(f, data, 100);
+    CHECK_EQUAL(104, file_read(f, data, 100) + file_read(f, data, 100));
+    CHECK_EQUAL(104, file_consume(f, 104));
+    CHECK_EQUAL(0, file_read(f, data, 20));
+
+    data[0] = 0x5A;
+    CHECK_EQUAL(20, file_write(f, data, 20));
+    CHECK_EQUAL(FLASH_PAGE_SIZE, f->write_offset - 20 - 2 - PAGE_COUNTER_SIZE); //on the next page
+    data[0] = 0;
+    CHECK_EQUAL(20, file_read(f, data, 20));
+    CHECK_EQUAL(0x5A, data[0]);
+    CHECK_EQUAL(20, file_consume(f, 20));
+    CHECK_EQUAL(0, file_read(f, data, 20));
+    CHECK_EQUAL(FILE_FIRMWARE_PAGES * (FLASH_PAGE_SIZE - PAGE_COUNTER_SIZE), f->free_space); //all of it back
+}
+
+//a chunk ending one byte short of the end of its page leaves a byte too small
+//to hold another. Readers step over it, and not onto the next page's header.
+
+TEST(BasicFileReadTest, TestReadSkipsLastByteOfPage)
+{
+    uint8_t size = FLASH_PAGE_SIZE - PAGE_COUNTER_SIZE - (4 + 2) - 2 - 1;
+    uint8_t data[FLASH_PAGE_SIZE] = {0};
+    for (uint8_t i = 0; i < size; ++i)
+        data[i] = i;
+    CHECK_EQUAL(size, file_write(f, data, size));
+    CHECK_EQUAL(FLASH_PAGE_SIZE - 1, f->write_offset);
+    uint8_t more[] = {5, 6, 7, 8};
+    CHECK_EQUAL(4, file_write(f, more, 4));
+
+    CHECK_EQUAL(4 + size + 4, file_read(f, data, FLASH_PAGE_SIZE));
+    CHECK_EQUAL(size - 1, data[4 + size - 1]);
+    CHECK_EQUAL(5, data[4 + size]);
+    CHECK_EQUAL(0, file_read(f, data, FLASH_PAGE_SIZE));
+
+    CHECK_EQUAL(4 + size + 4, file_consume(f, FLASH_PAGE_SIZE * FILE_FIRMWARE_PAGES));
+    CHECK_EQUAL(FILE_FIRMWARE_PAGES * (FLASH_PAGE_SIZE - PAGE_COUNTER_SIZE), f->free_space); //all of it back
+}
+
+#if FILE_DEFERRED_ERASE
+
+//consuming a page leaves erasing it to file_service, which does no more than
+//it is asked to
+
+TEST(BasicFileReadTest, TestConsumeDefersErase)
+{
+    uint8_t size = FLASH_PAGE_SIZE - 2 - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - 2 - PAGE_COUNTER_SIZE] = {0};
+    file_write(f, data, size - 6);
+    file_write(f, data, size);
+    file_write(f, data, 4);
+
+    flash_erase_calls = 0;
+    file_read(f, data, 4);
+    file_read(f, data, size - 6);
+    file_read(f, data, size);
+    file_consume(f, 4 + size - 6 + size);
+    CHECK_EQUAL(0, flash_erase_calls);
+    CHECK(0xFF != store[f->start]);
+
+    CHECK_EQUAL(1, file_service(f, 1));
+    CHECK_EQUAL(1, flash_erase_calls);
+    CHECK_EQUAL(0xFF, store[f->start]);
+    CHECK(0xFF != store[f->start + FLASH_PAGE_SIZE]);
+    CHECK_EQUAL(0, file_service(f, 1));
+    CHECK_EQUAL(0xFF, store[f->start + FLASH_PAGE_SIZE]);
+    CHECK_EQUAL(0, file_service(f, 1));
+    CHECK_EQUAL(2, flash_erase_calls);
+}
+#endif
+
+#if FLASH_ERASE_SUSPEND
+
+//reads made while a page is being erased suspend the erase, rather than wait
+//for it to finish
+
+TEST(BasicFileReadTest, TestReadDuringErase)
+{
+    uint8_t size = FLASH_PAGE_SIZE - 2 - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - 2 - PAGE_COUNTER_SIZE] = {0};
+    file_write(f, data, size - 6);
+    data[0] = 1;
+    file_write(f, data, size);
+    data[0] = 2;
+    file_write(f, data, size);
+    flash_force_erase_time(1000);
+
+    file_read(f, data, 4);
+    file_read(f, data, size - 6);
+    file_consume(f, 4 + size - 6);
+    service();
+    CHECK_EQUAL(1, flash_erase_calls);
+
+    CHECK_EQUAL(size, file_read(f, data, size));
+    CHECK_EQUAL(1, data[0]);
+    CHECK(flash_erase_suspends > 0);
+    CHECK(0xFF != store[f->start]); //still under way
+
+    file_sync(f); //waits for it
+    CHECK_EQUAL(0xFF, store[f->start]);
+}
+
+//the writer waits for the erase of a page it needs to finish
+
+TEST(BasicFileReadTest, TestWriteWaitsForErase)
+{
+    uint8_t size = FLASH_PAGE_SIZE - 2 - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - 2 - PAGE_COUNTER_SIZE] = {0};
+    file_write(f, data, size - 6);
+    file_write(f, data, size);
+    file_write(f, data, size);
+    flash_force_erase_time(1000);
+
+    file_read(f, data, 4);
+    file_read(f, data, size - 6);
+    file_consume(f, 4 + size - 6);
+    service();
+    CHECK_EQUAL(size, file_write(f, data, size));
+    CHECK_EQUAL(size, store[f->start + PAGE_COUNTER_SIZE]);
+}
+#endif
+
+//walking the headers of a page full of small chunks should be served from the
+//page cache, rather than costing a flash transaction per header byte
+
+TEST(BasicFileReadTest, TestReadHeaderWalkIsCached)
+{
+    uint8_t data[44] = {0};
+    for (uint8_t i = 0; i < 10; ++i)
+        file_write(f, data, 4);
+
+    flash_read_calls = 0;
+    uint8_t read = file_read(f, data, 44);
+    CHECK_EQUAL(44, read);
+    CHECK(flash_read_calls <= 1);
+}
+
+//a record chained across pages reads back as one, and can only be consumed
+//once all of it has been read, and then all at once
+
+TEST(BasicFileReadTest, TestChainedRecord)
+{
+    uint8_t data[300];
+    uint8_t small[] = {1, 2, 3, 4};
+    for (uint16_t i = 0; i < 300; ++i)
+        data[i] = i % 251;
+    file_read(f, small, 4); //out of the way with the one written by setup
+    file_consume(f, 4);
+    CHECK_EQUAL(300, file_write(f, data, 300));
+    CHECK_EQUAL(4, file_write(f, small, 4));
+
+    uint8_t read[304] = {0};
+    CHECK_EQUAL(200, file_read(f, read, 200));
+    CHECK_EQUAL(0, file_consume(f, 300)); //not all read yet
+    CHECK_EQUAL(104, file_read(f, read + 200, 104));
+    MEMCMP_EQUAL(data, read, 300);
+    MEMCMP_EQUAL(small, read + 300, 4);
+
+    CHECK_EQUAL(0, file_consume(f, 299)); //not all of it
+    CHECK_EQUAL(300, file_consume(f, 302)); //the record, but not the next one
+    service();
+    CHECK_EQUAL(0xFF, store[f->start]); //the pages it filled are erased
+    CHECK_EQUAL(0xFF, store[f->start + FLASH_PAGE_SIZE]);
+    CHECK_EQUAL(4, file_consume(f, 4));
+}
+
+#if FLASH_MAPPED
+
+//peeking hands back views straight onto flash, and moves nothing
+
+TEST(BasicFileReadTest, TestPeek)
+{
+    uint8_t data[] = {5, 6, 7};
+    file_write(f, data, 3);
+
+    file_view_t views[4];
+    flash_read_calls = 0;
+    CHECK_EQUAL(2, file_peek(f, views, 4));
+    CHECK_EQUAL(4, views[0].size);
+    CHECK(views[0].data == &store[f->start + PAGE_COUNTER_SIZE + 2]);
+    CHECK_EQUAL(3, views[1].size);
+    CHECK_EQUAL(5, views[1].data[0]);
+    CHECK(flash_read_calls <= 1); //only the headers, and those out of the cache
+
+    CHECK_EQUAL(1, file_peek(f, views, 1));
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->raw_read_chunk_start);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->destructive_read_offset);
+}
+
+//releasing views advances both the read and destructive read pointers
+
+TEST(BasicFileReadTest, TestPeekRelease)
+{
+    uint8_t data[] = {5, 6, 7};
+    file_write(f, data, 3);
+
+    file_view_t views[2];
+    CHECK_EQUAL(2, file_peek(f, views, 2));
+    CHECK_EQUAL(4, file_release(f, 1));
+    CHECK_EQUAL(1, file_peek(f, views, 2));
+    CHECK_EQUAL(7, views[0].data[2]);
+    CHECK_EQUAL(3, file_release(f, 1));
+    CHECK_EQUAL(0, file_peek(f, views, 2));
+    CHECK_EQUAL(f->write_offset, f->destructive_read_offset);
+}
+
+//a chained record takes a view per chunk, and is only consumed once all of
+//them have been released
+
+TEST(BasicFileReadTest, TestPeekChainedRecord)
+{
+    uint8_t small[4];
+    uint8_t data[200];
+    for (uint8_t i = 0; i < 200; ++i)
+        data[i] = i;
+    file_read(f, small, 4);
+    file_consume(f, 4);
+    file_write(f, data, 200);
+
+    file_view_t views[4];
+    CHECK_EQUAL(2, file_peek(f, views, 4));
+    CHECK_EQUAL(200, views[0].size + views[1].size);
+    CHECK_EQUAL(views[0].size, views[1].data[0]);
+    CHECK_EQUAL(0, file_release(f, 1));
+    CHECK_EQUAL(200, file_release(f, 1));
+}
+
+//a view can pick up part way through a chunk that has been partly read
+
+TEST(BasicFileReadTest, TestPeekPartlyReadChunk)
+{
+    uint8_t data[2];
+    file_read(f, data, 2);
+
+    file_view_t views[1];
+    CHECK_EQUAL(1, file_peek(f, views, 1));
+    CHECK_EQUAL(2, views[0].size);
+    CHECK_EQUAL(3, views[0].data[0]);
+    CHECK_EQUAL(4, file_release(f, 1));
+}
+#endif
+
 //Need check for power failure during page erasure, to make sure we can recover properly from that.
 //will need to write this test after we have code for recovering file handles post power-loss.
\ No newline at end of file
@@ -0,0 +1,589 @@
+/************************************
+ FIFO_recover_handle_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for checking that file_open can
+ * recover the state of a file handle from what it finds in flash, as it must
+ * after a power cycle. Things being checked, at a general level include:
+ * recovering the write pointer, recovering the destructive read pointer,
+ * skipping chunks torn by a power failure, finishing erases of pages that were
+ * consumed but never erased, and repairing pages corrupted by a failed erase.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "flash_port.h"
+#include "handle_pool_mock.h"
+
+extern "C"
+{
+void flash_force_fail(uint8_t count);
+void flash_force_succeed(void);
+void flash_force_power_off(void);
+}
+
+#define METADATA_SIZE   2
+#define DATA_VALID      0xFE
+#define DATA_CONSUMED   0xFC
+#define DATA_INVALID    0xFF
+
+static file_handle_t * f;
+extern uint8_t store[];
+extern uint32_t flash_read_calls;
+
+//let any erases that were left for later happen now
+
+static void service(void)
+{
+#if FILE_DEFERRED_ERASE
+    file_service(f, (size_t) - 1);
+#endif
+}
+
+//simulate a power cycle by throwing away the handle, without letting it touch
+//flash on the way out, and opening a new one
+
+static void reopen(void)
+{
+    flash_force_power_off();
+    file_close(f);
+    flash_force_succeed();
+    f = file_open(FILE_FIRMWARE);
+}
+
+TEST_GROUP(RecoverHandleTest)
+{
+
+    void setup()
+    {
+        flash_init();
+        f = file_open(FILE_FIRMWARE);
+    }
+
+    void teardown()
+    {
+        file_close(f);
+    }
+};
+
+//a blank file should come back blank
+
+TEST(RecoverHandleTest, RecoverEmpty)
+{
+    uint32_t free_space = f->free_space;
+    reopen();
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->write_offset);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->destructive_read_offset);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->raw_read_chunk_start);
+    CHECK_EQUAL(free_space, f->free_space);
+}
+
+//the write pointer should land just after the last chunk written, and the read
+//pointer on the first
+
+TEST(RecoverHandleTest, RecoverAfterWrites)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    file_write(f, data, 4);
+    file_write(f, data, 4);
+    file_write(f, data, 4);
+    uint32_t write_offset = f->write_offset;
+    uint32_t free_space = f->free_space;
+
+    reopen();
+    CHECK_EQUAL(write_offset, f->write_offset);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->destructive_read_offset);
+    CHECK_EQUAL(free_space, f->free_space);
+
+    uint8_t read[4] = {0};
+    CHECK_EQUAL(4, file_read(f, read, 4));
+    CHECK_EQUAL(1, read[0]);
+    CHECK_EQUAL(4, read[3]);
+}
+
+//consumed chunks must not come back
+
+TEST(RecoverHandleTest, RecoverAfterConsume)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    uint8_t more[] = {5, 6, 7, 8};
+    file_write(f, data, 4);
+    file_write(f, more, 4);
+    file_read(f, data, 4);
+    file_consume(f, 4);
+
+    reopen();
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + METADATA_SIZE + 4, f->destructive_read_offset);
+    CHECK_EQUAL(f->destructive_read_offset, f->raw_read_chunk_start);
+
+    uint8_t read[4] = {0};
+    CHECK_EQUAL(4, file_read(f, read, 4));
+    CHECK_EQUAL(5, read[0]);
+}
+
+//a chunk torn by a power failure is skipped over by the write pointer, and
+//never handed back to a reader
+
+TEST(RecoverHandleTest, RecoverAfterTornWrite)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    uint8_t torn[] = {5, 6, 7, 8};
+    uint8_t more[] = {9, 10, 11, 12};
+    file_write(f, data, 4);
+    flash_force_fail(1);
+    file_write(f, torn, 4);
+
+    reopen();
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 2 * (METADATA_SIZE + 4), f->write_offset);
+    CHECK_EQUAL(DATA_INVALID, store[f->start + PAGE_COUNTER_SIZE + METADATA_SIZE + 4 + 1]);
+
+    file_write(f, more, 4);
+    uint8_t read[8] = {0};
+    CHECK_EQUAL(8, file_read(f, read, 8));
+    CHECK_EQUAL(1, read[0]);
+    CHECK_EQUAL(9, read[4]);
+}
+
+//if power is lost after the last chunk on a page is consumed, but before the
+//page could be erased, recovery should finish the erase
+
+TEST(RecoverHandleTest, RecoverConsumedPageNotErased)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+    file_write(f, data, size);
+    file_write(f, data, size);
+
+    //consume the first page by hand, without erasing it
+    uint8_t flag = DATA_CONSUMED;
+    flash_write(f->start + PAGE_COUNTER_SIZE + 1, &flag, 1);
+
+    reopen();
+    service();
+    CHECK_EQUAL(0xFF, store[f->start]); //page counter erased
+    CHECK_EQUAL(0xFF, store[f->start + PAGE_COUNTER_SIZE]);
+    CHECK_EQUAL(FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE, f->destructive_read_offset);
+    CHECK_EQUAL(size, file_read(f, data, size));
+}
+
+//a completely full file leaves the write pointer lingering at the start of the
+//oldest page, waiting for it to be consumed
+
+TEST(RecoverHandleTest, RecoverFullFile)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+    file_write(f, data, size);
+    file_write(f, data, size);
+    file_write(f, data, size);
+
+    reopen();
+    CHECK_EQUAL(0, f->write_offset);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->destructive_read_offset);
+    CHECK_EQUAL(0, f->free_space);
+    CHECK_EQUAL(0, file_write(f, data, 4));
+
+    //consuming the oldest page should let writes move back in
+    file_read(f, data, size);
+    file_consume(f, size);
+    CHECK_EQUAL(size, file_write(f, data, size));
+}
+
+//a page left with garbage in it by an interrupted erase gets erased again
+
+TEST(RecoverHandleTest, RecoverCorruptedPage)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    file_write(f, data, 4);
+    uint8_t garbage[] = {0x5A, 0x13, 0x77};
+    flash_write(f->start + 2 * FLASH_PAGE_SIZE, garbage, 3);
+
+    reopen();
+    CHECK_EQUAL(0xFF, store[f->start + 2 * FLASH_PAGE_SIZE]);
+    CHECK_EQUAL(0xFF, store[f->start + 2 * FLASH_PAGE_SIZE + 1]);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + METADATA_SIZE + 4, f->write_offset);
+}
+
+//recovery should read each page out of flash exactly once
+
+TEST(RecoverHandleTest, RecoverReadsEachPageOnce)
+{
+    uint8_t data[20] = {0};
+    while (f->write_offset < 2 * FLASH_PAGE_SIZE)
+        file_write(f, data, 20);
+    file_read(f, data, 20);
+    file_consume(f, 20);
+
+    file_close(f);
+    flash_read_calls = 0;
+    f = file_open(FILE_FIRMWARE);
+    CHECK(flash_read_calls <= FILE_FIRMWARE_PAGES);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + METADATA_SIZE + 20, f->destructive_read_offset);
+}
+
+#if FILE_CHECKPOINTS
+
+//a clean close leaves a checkpoint behind, so that the next open needn't scan
+//the file at all
+
+TEST(RecoverHandleTest, CheckpointRestoresWithoutScan)
+{
+    uint8_t data[20] = {0};
+    while (f->write_offset < 2 * FLASH_PAGE_SIZE)
+        file_write(f, data, 20);
+    file_read(f, data, 20);
+    file_consume(f, 20);
+    uint32_t write_offset = f->write_offset;
+    uint32_t destructive_read_offset = f->destructive_read_offset;
+    uint32_t free_space = f->free_space;
+
+    file_close(f);
+    flash_read_calls = 0;
+    f = file_open(FILE_FIRMWARE);
+    CHECK(flash_read_calls <= 3); //the checkpoint page, and the pages the two pointers are on
+    CHECK_EQUAL(write_offset, f->write_offset);
+    CHECK_EQUAL(destructive_read_offset, f->destructive_read_offset);
+    CHECK_EQUAL(destructive_read_offset, f->raw_read_chunk_start);
+    CHECK_EQUAL(free_space, f->free_space);
+}
+
+//modifying the file marks the checkpoint stale. After a power cycle, recovery
+//picks up from the stale checkpoint, rather than from scratch
+
+TEST(RecoverHandleTest, CheckpointStaleAfterModification)
+{
+    uint8_t data[20] = {0};
+    file_write(f, data, 20);
+    file_close(f);
+    f = file_open(FILE_FIRMWARE);
+
+    while (f->write_offset < 2 * FLASH_PAGE_SIZE)
+        file_write(f, data, 20);
+    file_read(f, data, 20);
+    file_read(f, data, 20);
+    file_consume(f, 40);
+    CHECK_EQUAL(DATA_CONSUMED, store[CHECKPOINT_OFFSET + FILE_FIRMWARE * FLASH_PAGE_SIZE]);
+    uint32_t write_offset = f->write_offset;
+    uint32_t destructive_read_offset = f->destructive_read_offset;
+    uint32_t free_space = f->free_space;
+
+    reopen();
+    CHECK_EQUAL(write_offset, f->write_offset);
+    CHECK_EQUAL(destructive_read_offset, f->destructive_read_offset);
+    CHECK_EQUAL(free_space, f->free_space);
+    CHECK_EQUAL(20, file_read(f, data, 20));
+}
+
+//a checkpoint that no longer matches what is in flash is ignored
+
+TEST(RecoverHandleTest, CheckpointMismatchFallsBackToScan)
+{
+    uint8_t data[20] = {0};
+    uint32_t start = f->start;
+    file_write(f, data, 20);
+    file_close(f);
+
+    flash_erase(start, FLASH_PAGE_SIZE); //behind the checkpoint's back
+
+    f = file_open(FILE_FIRMWARE);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->write_offset);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE, f->destructive_read_offset);
+    CHECK_EQUAL(0, file_read(f, data, 20));
+}
+
+//a file erased behind the checkpoint's back starts again from the top, but
+//numbers its pages on from the checkpoint's, which then can't mistake them for
+//the pages it describes
+
+TEST(RecoverHandleTest, CheckpointOutlivesErasedFile)
+{
+    uint8_t data[20] = {0};
+    uint32_t start = f->start;
+    file_write(f, data, 20);
+    file_close(f);
+
+    flash_erase(start, FLASH_PAGE_SIZE);
+
+    f = file_open(FILE_FIRMWARE);
+    file_write(f, data, 4);
+    reopen();
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 4 + METADATA_SIZE, f->write_offset);
+    CHECK_EQUAL(4, file_read(f, data, 20));
+}
+
+//a checkpoint taken on a drained file, with its pointers on free pages, says
+//nothing once the file has gone all the way round and freed them again
+
+TEST(RecoverHandleTest, CheckpointOnFreePagesLapped)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+    for (uint8_t i = 0; i < FILE_FIRMWARE_PAGES; ++i)
+        file_write(f, data, size);
+    for (uint8_t i = 0; i < FILE_FIRMWARE_PAGES; ++i)
+    {
+        file_read(f, data, size);
+        file_consume(f, size);
+    }
+    file_sync(f);
+
+    file_write(f, data, size);
+    file_write(f, data, 10);
+    file_read(f, data, size);
+    file_read(f, data, 10);
+    file_consume(f, size + 10);
+    data[0] = 0xA5;
+    file_write(f, data, 20);
+    service();
+
+    reopen();
+    uint8_t more[] = {1, 2, 3};
+    CHECK_EQUAL(3, file_write(f, more, 3));
+    reopen();
+    CHECK_EQUAL(20, file_read(f, data, 20));
+    CHECK_EQUAL(0xA5, data[0]);
+    file_consume(f, 20);
+    CHECK_EQUAL(3, file_read(f, data, 3));
+    CHECK_EQUAL(1, data[0]);
+}
+
+#endif
+
+//a record chained across pages, but cut short by a power failure, is thrown
+//away in its entirety
+
+TEST(RecoverHandleTest, RecoverTornChain)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    uint8_t chain[300] = {0};
+    file_write(f, data, 4);
+    flash_force_fail(5); //part way through the second chunk
+    file_write(f, chain, 300);
+
+    reopen();
+    uint8_t read[8] = {0};
+    CHECK_EQUAL(4, file_read(f, read, 8));
+    CHECK_EQUAL(1, read[0]);
+    CHECK_EQUAL(4, file_consume(f, 8));
+    CHECK_EQUAL(0, file_read(f, read, 8));
+
+    CHECK_EQUAL(4, file_write(f, data, 4));
+    CHECK_EQUAL(4, file_read(f, read, 8));
+}
+
+//if power is lost part way through consuming a chained record, recovery
+//finishes consuming it
+
+TEST(RecoverHandleTest, RecoverPartlyConsumedChain)
+{
+    uint8_t chain[300] = {0};
+    uint32_t free_space = f->free_space;
+    file_write(f, chain, 300);
+    file_read(f, chain, 300);
+    flash_force_fail(1); //after the first chunk is flagged consumed
+    file_consume(f, 300);
+
+    reopen();
+    CHECK_EQUAL(0, file_read(f, chain, 300));
+    CHECK_EQUAL(f->write_offset, f->destructive_read_offset);
+    CHECK_EQUAL(free_space, f->free_space);
+}
+
+//files each have their own size. A larger one wraps around, and recovers,
+//just the same
+
+TEST(RecoverHandleTest, RecoverLargerFile)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+    file_handle_t *g = file_open(FILE_DRIVE_LOG);
+    CHECK_EQUAL(FILE_DRIVE_LOG_PAGES * FLASH_PAGE_SIZE, g->size);
+    CHECK(g->start >= f->start + f->size);
+
+    for (uint8_t i = 0; i < FILE_DRIVE_LOG_PAGES; ++i)
+    {
+        data[0] = i;
+        CHECK_EQUAL(size, file_write(g, data, size));
+    }
+    CHECK_EQUAL(0, file_write(g, data, size)); //full
+    for (uint8_t i = 0; i < 3; ++i)
+    {
+        file_read(g, data, size);
+        file_consume(g, size);
+    }
+    data[0] = FILE_DRIVE_LOG_PAGES;
+    CHECK_EQUAL(size, file_write(g, data, size)); //wrapped around
+    uint32_t write_offset = g->write_offset;
+    uint32_t destructive_read_offset = g->destructive_read_offset;
+    uint32_t free_space = g->free_space;
+
+    flash_force_power_off();
+    file_close(g);
+    flash_force_succeed();
+    g = file_open(FILE_DRIVE_LOG);
+    CHECK_EQUAL(write_offset, g->write_offset);
+    CHECK_EQUAL(destructive_read_offset, g->destructive_read_offset);
+    CHECK_EQUAL(free_space, g->free_space);
+    CHECK_EQUAL(size, file_read(g, data, size));
+    CHECK_EQUAL(3, data[0]);
+    file_close(g);
+}
+
+//page sequence numbers keep counting up lap after lap, so the newest page is
+//still found after many more pages have been claimed than the file holds
+
+TEST(RecoverHandleTest, RecoverAfterManyLaps)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+    file_handle_t *g = file_open(FILE_DRIVE_LOG);
+
+    for (uint32_t i = 0; i < 3 * FILE_DRIVE_LOG_PAGES + 5; ++i)
+    {
+        data[0] = (uint8_t) i;
+        CHECK_EQUAL(size, file_write(g, data, size));
+        CHECK_EQUAL(size, file_read(g, data, size));
+        file_consume(g, size);
+    }
+    data[0] = 0xA5;
+    CHECK_EQUAL(size, file_write(g, data, size));
+    uint32_t write_offset = g->write_offset;
+    uint32_t sequence = g->sequence;
+    CHECK(sequence > 3 * FILE_DRIVE_LOG_PAGES);
+
+    flash_force_power_off();
+    file_close(g);
+    flash_force_succeed();
+    g = file_open(FILE_DRIVE_LOG);
+    CHECK_EQUAL(write_offset, g->write_offset);
+    CHECK_EQUAL(sequence, g->sequence);
+    CHECK_EQUAL(size, file_read(g, data, size));
+    CHECK_EQUAL(0xA5, data[0]);
+    file_close(g);
+}
+
+//in a large file, recovery finds the pointers by searching page headers,
+//rather than reading every page
+
+static file_handle_t *fill_drive_log(void)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+    file_handle_t *g = file_open(FILE_DRIVE_LOG);
+    for (uint8_t i = 0; i < 14; ++i)
+        file_write(g, data, size);
+    for (uint8_t i = 0; i < 9; ++i)
+    {
+        file_read(g, data, size);
+        file_consume(g, size);
+    }
+    data[0] = 0xA5;
+    file_write(g, data, 4);
+#if FILE_DEFERRED_ERASE
+    file_service(g, (size_t) - 1);
+#endif
+    return g;
+}
+
+TEST(RecoverHandleTest, RecoverBySearch)
+{
+    uint8_t data[FLASH_PAGE_SIZE] = {0};
+    file_handle_t *g = fill_drive_log();
+    uint32_t write_offset = g->write_offset;
+    uint32_t destructive_read_offset = g->destructive_read_offset;
+    uint32_t free_space = g->free_space;
+
+    flash_force_power_off();
+    file_close(g);
+    flash_force_succeed();
+    flash_read_calls = 0;
+    g = file_open(FILE_DRIVE_LOG);
+    CHECK(flash_read_calls < FILE_DRIVE_LOG_PAGES);
+    CHECK_EQUAL(write_offset, g->write_offset);
+    CHECK_EQUAL(destructive_read_offset, g->destructive_read_offset);
+    CHECK_EQUAL(free_space, g->free_space);
+    CHECK_EQUAL(FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE, file_read(g, data, FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE));
+    file_close(g);
+}
+
+//a page left half erased just before the oldest sends recovery back to
+//scanning the whole file, which repairs it
+
+TEST(RecoverHandleTest, RecoverBySearchFallsBackToScan)
+{
+    file_handle_t *g = fill_drive_log();
+    uint32_t write_offset = g->write_offset;
+    uint32_t start = g->start;
+    uint8_t garbage[] = {0x5A, 0x13, 0x77};
+    flash_write(start + 8 * FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE, garbage, 3);
+
+    flash_force_power_off();
+    file_close(g);
+    flash_force_succeed();
+    flash_read_calls = 0;
+    g = file_open(FILE_DRIVE_LOG);
+    CHECK(flash_read_calls >= FILE_DRIVE_LOG_PAGES);
+    CHECK_EQUAL(0xFF, store[start + 8 * FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE]);
+    CHECK_EQUAL(write_offset, g->write_offset);
+    file_close(g);
+}
+
+//a page claim cut short before its flag was written leaves a sequence number
+//on a page that was never started. It gets erased again.
+
+TEST(RecoverHandleTest, RecoverTornPageClaim)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    file_write(f, data, 4);
+    uint8_t sequence[] = {0x01, 0x00, 0x00, 0x00};
+    flash_write(f->start + FLASH_PAGE_SIZE + 1, sequence, 4);
+
+    reopen();
+    CHECK_EQUAL(0xFF, store[f->start + FLASH_PAGE_SIZE]);
+    CHECK_EQUAL(0xFF, store[f->start + FLASH_PAGE_SIZE + 1]);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + METADATA_SIZE + 4, f->write_offset);
+    CHECK_EQUAL(1, f->sequence);
+}
+
+#if FILE_DEFERRED_ERASE
+
+//a writer that was lingering on a page that was consumed, but not yet erased,
+//carries on lingering after recovery, until it needs the page
+
+TEST(RecoverHandleTest, RecoverLingeringOnConsumedPage)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+    file_write(f, data, size);
+    file_write(f, data, size);
+    file_write(f, data, size);
+    file_read(f, data, size);
+    file_consume(f, size);
+
+    reopen();
+    CHECK_EQUAL(0, f->write_offset);
+    CHECK_EQUAL(FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE, f->destructive_read_offset);
+    CHECK_EQUAL(size, file_write(f, data, size));
+    CHECK_EQUAL(size, file_read(f, data, size));
+    CHECK_EQUAL(0, data[0]);
+}
+#endif
@@ -0,0 +1,243 @@
+/************************************
+ FIFO_seek_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for seeking, through the record
+ * index where there is one. Things being checked, at a general level include:
+ * seeking by record and by byte, from each whence, past the end, among chained
+ * records, after records have been consumed and their pages erased, once the
+ * index has had to space its records out, and from the reader of a split
+ * file. Each record
+ * carries its own number, so that wherever a seek lands can be checked.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "flash_port.h"
+#include "handle_pool_mock.h"
+
+#define RECORD_SIZE 10
+
+static file_handle_t * f;
+extern "C" uint32_t flash_read_calls;
+
+TEST_GROUP(SeekTest)
+{
+
+    void setup()
+    {
+        flash_init();
+        f = file_open(FILE_DRIVE_LOG);
+    }
+
+    void teardown()
+    {
+        if (f)
+            file_close(f);
+    }
+};
+
+//each record holds its number, then counts up from there
+
+static size_t write_records(file_handle_t *handle, uint16_t first, uint16_t count, size_t size)
+{
+    uint8_t data[600];
+    for (uint16_t n = first; n < first + count; ++n)
+    {
+        data[0] = n & 0xFF;
+        data[1] = n >> 8;
+        for (size_t i = 2; i < size; ++i)
+            data[i] = (uint8_t) (n + i);
+        if (file_write(handle, data, size) != size)
+            return n - first;
+    }
+    return count;
+}
+
+static uint16_t read_number(file_handle_t *handle)
+{
+    uint8_t data[2] = {0xFF, 0xFF};
+    file_read(handle, data, 2);
+    return data[0] | (data[1] << 8);
+}
+
+TEST(SeekTest, ByRecord)
+{
+    write_records(f, 0, 100, RECORD_SIZE);
+    CHECK_EQUAL(50, file_seek_record(f, 50, SEEK_SET));
+    CHECK_EQUAL(50, read_number(f));
+    CHECK_EQUAL(7, file_seek_record(f, 7, SEEK_SET)); //and back again
+    CHECK_EQUAL(7, read_number(f));
+}
+
+TEST(SeekTest, ByByte)
+{
+    write_records(f, 0, 100, RECORD_SIZE);
+    CHECK_EQUAL(20 * RECORD_SIZE + 5, file_seek(f, 20 * RECORD_SIZE + 5, SEEK_SET));
+    uint8_t data[RECORD_SIZE] = {0};
+    CHECK_EQUAL(RECORD_SIZE, file_read(f, data, RECORD_SIZE));
+    CHECK_EQUAL(20 + 5, data[0]); //the rest of record 20
+    CHECK_EQUAL(20 + 9, data[4]);
+    CHECK_EQUAL(21, data[5]); //and on into record 21
+}
+
+TEST(SeekTest, FromEachWhence)
+{
+    write_records(f, 0, 100, RECORD_SIZE);
+    file_seek_record(f, 10, SEEK_SET);
+    CHECK_EQUAL(10, read_number(f)); //part way into record 10
+    CHECK_EQUAL(15, file_seek_record(f, 5, SEEK_CUR));
+    CHECK_EQUAL(15, read_number(f));
+    CHECK_EQUAL(97, file_seek_record(f, 3, SEEK_END));
+    CHECK_EQUAL(97, read_number(f));
+    CHECK_EQUAL(100 * RECORD_SIZE - 4, file_seek(f, 4, SEEK_END));
+    uint8_t data[4] = {0};
+    CHECK_EQUAL(4, file_read(f, data, 8));
+    CHECK_EQUAL(99 + 6, data[0]);
+}
+
+TEST(SeekTest, PastTheEnd)
+{
+    write_records(f, 0, 100, RECORD_SIZE);
+    CHECK_EQUAL(100, file_seek_record(f, 1000, SEEK_SET));
+    uint8_t data[RECORD_SIZE];
+    CHECK_EQUAL(0, file_read(f, data, RECORD_SIZE));
+    CHECK_EQUAL(100 * RECORD_SIZE, file_seek(f, 0xFFFFFFFF, SEEK_SET));
+
+    write_records(f, 100, 1, RECORD_SIZE); //carries on from the end
+    CHECK_EQUAL(100, read_number(f));
+}
+
+//a seek doesn't consume anything, but leaves what it skipped to be consumed
+
+TEST(SeekTest, ConsumesWhatWasSkipped)
+{
+    write_records(f, 0, 20, RECORD_SIZE);
+    file_seek_record(f, 10, SEEK_SET);
+    CHECK_EQUAL(10 * RECORD_SIZE, file_consume(f, 20 * RECORD_SIZE));
+    CHECK_EQUAL(0, file_seek_record(f, 0, SEEK_SET));
+    CHECK_EQUAL(10, read_number(f));
+}
+
+//records chained across pages count as one record each
+
+TEST(SeekTest, ChainedRecords)
+{
+    CHECK_EQUAL(6, write_records(f, 0, 6, 300));
+    CHECK_EQUAL(4, file_seek_record(f, 4, SEEK_SET));
+    CHECK_EQUAL(4, read_number(f));
+    CHECK_EQUAL(3 * 300 + 200, file_seek(f, 3 * 300 + 200, SEEK_SET));
+    uint8_t data[1] = {0};
+    file_read(f, data, 1);
+    CHECK_EQUAL((uint8_t) (3 + 200), data[0]);
+}
+
+//records written and consumed round and round the file, with every page
+//erased several times over, and seeks in between each round
+
+TEST(SeekTest, AfterPagesErased)
+{
+    uint16_t oldest = 0, next = 0;
+    for (uint8_t round = 0; round < 40; ++round)
+    {
+        next += write_records(f, next, 60, RECORD_SIZE);
+        uint16_t count = next - oldest;
+        for (uint16_t k = 0; k < count; k += 7)
+        {
+            CHECK_EQUAL(k, file_seek_record(f, k, SEEK_SET));
+            CHECK_EQUAL(oldest + k, read_number(f));
+        }
+        CHECK_EQUAL(count, file_seek_record(f, 0, SEEK_END));
+        //consume part of what is there, then leave the read pointer somewhere
+        file_seek_record(f, count / 2, SEEK_SET);
+        file_consume(f, (count / 2) * RECORD_SIZE);
+        oldest += count / 2;
+#if FILE_DEFERRED_ERASE
+        file_service(f, 100);
+#endif
+        file_seek_record(f, 1, SEEK_SET);
+    }
+}
+
+#if FILE_RECORD_INDEX
+
+//more records than the index has room for
+
+TEST(SeekTest, IndexSpacedOut)
+{
+    uint16_t written = write_records(f, 0, 1000, 4);
+    CHECK(written > 4 * FILE_INDEX_ENTRIES);
+    CHECK_EQUAL(written, file_seek_record(f, 0, SEEK_END));
+    for (uint16_t k = written; k > 0; k -= 13)
+    {
+        CHECK_EQUAL(k - 1, file_seek_record(f, k - 1, SEEK_SET));
+        CHECK_EQUAL(k - 1, read_number(f));
+        if (k < 13)
+            break;
+    }
+}
+
+//a seek to the far end of a full file reads a page or two, not all of them
+
+TEST(SeekTest, JumpsRatherThanWalks)
+{
+    uint16_t written = write_records(f, 0, 1000, RECORD_SIZE);
+    flash_read_calls = 0;
+    CHECK_EQUAL(written - 2, file_seek_record(f, written - 2, SEEK_SET));
+    CHECK(flash_read_calls <= 4);
+    CHECK_EQUAL(written - 2, read_number(f));
+}
+#endif
+
+//the index survives closing and reopening the file, by being built afresh
+
+TEST(SeekTest, AfterReopening)
+{
+    write_records(f, 0, 30, RECORD_SIZE);
+    file_seek_record(f, 5, SEEK_SET);
+    file_consume(f, 5 * RECORD_SIZE);
+    file_close(f);
+    f = file_open(FILE_DRIVE_LOG);
+    CHECK_EQUAL(20, file_seek_record(f, 20, SEEK_SET));
+    CHECK_EQUAL(25, read_number(f));
+}
+
+//the reader of a split file seeks among whatever the writer has published
+
+TEST(SeekTest, SplitReader)
+{
+    file_close(f);
+    f = NULL;
+    file_handle_t *w = file_open_writer(FILE_DRIVE_LOG);
+    file_handle_t *r = file_open_reader(FILE_DRIVE_LOG);
+    write_records(w, 0, 40, RECORD_SIZE);
+    file_sync(w);
+    CHECK_EQUAL(30, file_seek_record(r, 30, SEEK_SET));
+    CHECK_EQUAL(30, read_number(r));
+    CHECK_EQUAL(0, file_seek_record(w, 30, SEEK_SET)); //the writer can't
+    write_records(w, 40, 10, RECORD_SIZE);
+    file_sync(w);
+    CHECK_EQUAL(45, file_seek_record(r, 5, SEEK_END));
+    CHECK_EQUAL(45, read_number(r));
+    file_close(w);
+    file_close(r);
+}
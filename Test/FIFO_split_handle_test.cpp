@@ -0,0 +1,237 @@
+/************************************
+ FIFO_split_handle_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for files opened as a separate
+ * writer and reader. Things being checked, at a general level include:
+ * which ends can be opened, each end seeing what the other has published,
+ * space freed by the reader coming back to the writer, and handing the
+ * pointers back when one end is closed.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "flash_port.h"
+#include "handle_pool_mock.h"
+
+#define METADATA_SIZE   2
+
+extern "C"
+{
+void flash_force_erase_time(uint32_t polls);
+}
+
+static file_handle_t * w;
+static file_handle_t * r;
+
+//let any erases that were left for later happen now. Only the reader erases.
+
+static void service(void)
+{
+#if FILE_DEFERRED_ERASE
+    file_service(r, (size_t) - 1);
+#endif
+}
+
+TEST_GROUP(SplitHandleTest)
+{
+
+    void setup()
+    {
+        flash_init();
+        w = file_open_writer(FILE_FIRMWARE);
+        r = file_open_reader(FILE_FIRMWARE);
+    }
+
+    void teardown()
+    {
+        if (r)
+            file_close(r);
+        if (w)
+            file_close(w);
+    }
+};
+
+//each end can be opened once, and a split file can't also be opened whole
+
+TEST(SplitHandleTest, OpenEachEndOnce)
+{
+    CHECK(w);
+    CHECK(r);
+    CHECK(w->peer == r);
+    CHECK(r->peer == w);
+    CHECK_EQUAL(NULL, file_open_writer(FILE_FIRMWARE));
+    CHECK_EQUAL(NULL, file_open_reader(FILE_FIRMWARE));
+    CHECK_EQUAL(NULL, file_open(FILE_FIRMWARE));
+}
+
+//each end only does its own job
+
+TEST(SplitHandleTest, EndsKeepToTheirRoles)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    CHECK_EQUAL(0, file_write(r, data, 4));
+    CHECK_EQUAL(4, file_write(w, data, 4));
+    CHECK_EQUAL(0, file_read(w, data, 4));
+    CHECK_EQUAL(0, file_consume(w, 4));
+    CHECK_EQUAL(4, file_read(r, data, 4));
+    CHECK_EQUAL(4, file_consume(r, 4));
+}
+
+//the reader sees each record once the writer has finished with it, even
+//though it has already pulled that page into its own cache
+
+TEST(SplitHandleTest, ReaderSeesWrites)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    uint8_t read[8] = {0};
+    size_t empty = file_size(r);
+    CHECK_EQUAL(0, file_read(r, read, 8));
+    file_write(w, data, 4);
+    CHECK_EQUAL(4, file_read(r, read, 8));
+    CHECK_EQUAL(1, read[0]);
+    data[0] = 5;
+    file_write(w, data, 4);
+    CHECK_EQUAL(4, file_read(r, read, 8));
+    CHECK_EQUAL(5, read[0]);
+    CHECK_EQUAL(empty + 2 * (4 + METADATA_SIZE), file_size(r));
+}
+
+//space consumed by the reader comes back to the writer, lap after lap
+
+TEST(SplitHandleTest, ProducerAndConsumer)
+{
+    uint8_t data[40] = {0};
+    uint8_t read[40] = {0};
+    uint8_t next_write = 0, next_read = 0;
+    for (uint16_t i = 0; i < 200; ++i)
+    {
+        //the producer writes until the file is full
+        data[0] = next_write;
+        while (file_write(w, data, 40))
+            data[0] = ++next_write;
+
+        //then the consumer drains some of it
+        for (uint8_t j = 0; j < 3; ++j)
+        {
+            CHECK_EQUAL(40, file_read(r, read, 40));
+            CHECK_EQUAL(next_read, read[0]);
+            ++next_read;
+            CHECK_EQUAL(40, file_consume(r, 40));
+        }
+        service();
+    }
+    CHECK(next_write > 3 * FILE_FIRMWARE_PAGES);
+}
+
+//the writer waits on the reader to erase a page before it can move in
+
+TEST(SplitHandleTest, WriterWaitsOnReader)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+    for (uint8_t i = 0; i < FILE_FIRMWARE_PAGES; ++i)
+        CHECK_EQUAL(size, file_write(w, data, size));
+    CHECK_EQUAL(0, file_write(w, data, size)); //full
+
+    file_read(r, data, size);
+    file_consume(r, size);
+    service();
+    CHECK_EQUAL(size, file_write(w, data, size));
+}
+
+#if FLASH_ERASE_SUSPEND
+
+//the writer doesn't look at a page the reader is still erasing, but waits for
+//the erase to finish
+
+TEST(SplitHandleTest, WriterWaitsOnReadersErase)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+    for (uint8_t i = 0; i < FILE_FIRMWARE_PAGES; ++i)
+        CHECK_EQUAL(size, file_write(w, data, size));
+    flash_force_erase_time(1000);
+
+    file_read(r, data, size);
+    file_consume(r, size);
+    service();
+    CHECK_EQUAL(size, file_write(w, data, size));
+    CHECK_EQUAL(size, file_read(r, data, size));
+}
+#endif
+
+//the reader stops at the writer, even one lingering at the start of a page,
+//and carries on once it has moved in
+
+TEST(SplitHandleTest, ReaderCatchesUpWithWriter)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+    size_t empty = file_size(r);
+    for (uint8_t i = 0; i < FILE_FIRMWARE_PAGES; ++i)
+        file_write(w, data, size);
+    for (uint8_t i = 0; i < FILE_FIRMWARE_PAGES; ++i)
+    {
+        CHECK_EQUAL(size, file_read(r, data, size));
+        CHECK_EQUAL(size, file_consume(r, size));
+    }
+    CHECK_EQUAL(0, file_read(r, data, size));
+    CHECK_EQUAL(empty, file_size(r));
+    service();
+
+    data[0] = 0x5A;
+    CHECK_EQUAL(4, file_write(w, data, 4));
+    data[0] = 0;
+    CHECK_EQUAL(4, file_read(r, data, size));
+    CHECK_EQUAL(0x5A, data[0]);
+}
+
+//closing one end hands its pointer back to the other, which can then be closed
+//and the file reopened whole
+
+TEST(SplitHandleTest, CloseHandsBack)
+{
+    uint8_t data[] = {1, 2, 3, 4};
+    uint8_t read[8] = {0};
+    file_write(w, data, 4);
+    data[0] = 5;
+    file_write(w, data, 4);
+    file_close(w);
+    w = NULL;
+
+    CHECK_EQUAL(4, file_read(r, read, 4));
+    CHECK_EQUAL(4, file_consume(r, 4));
+    w = file_open_writer(FILE_FIRMWARE);
+    CHECK(w);
+    data[0] = 9;
+    CHECK_EQUAL(4, file_write(w, data, 4));
+
+    file_close(r);
+    file_close(w);
+    r = w = NULL;
+    file_handle_t *f = file_open(FILE_FIRMWARE);
+    CHECK_EQUAL(8, file_read(f, read, 8));
+    CHECK_EQUAL(5, read[0]);
+    CHECK_EQUAL(9, read[4]);
+    file_close(f);
+}
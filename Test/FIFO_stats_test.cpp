@@ -0,0 +1,242 @@
+/************************************
+ FIFO_stats_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for file_stats. Things being
+ * checked, at a general level include: records and bytes written, read and
+ * consumed, chained records counting once, the flash transactions made
+ * agreeing with those the simulated flash saw, writes turned away for a full
+ * file and for an erase yet to be made, how long the writer waited on it, and
+ * each end of a split file keeping its own counts.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "FIFO.hpp"
+#include "flash_port.h"
+#include "flash_port_mock.h"
+#include "handle_pool_mock.h"
+
+#if FILE_STATS
+
+static file_handle_t * f;
+extern uint32_t flash_read_calls, flash_write_calls, flash_erase_calls;
+
+TEST_GROUP(StatsTest)
+{
+
+    void setup()
+    {
+        flash_init();
+        f = file_open(FILE_DRIVE_LOG);
+    }
+
+    void teardown()
+    {
+        if (f)
+            file_close(f);
+    }
+};
+
+TEST(StatsTest, StartsAtNothing)
+{
+    file_stats_t stats;
+    file_stats(f, &stats);
+    CHECK_EQUAL(0, stats.records_written);
+    CHECK_EQUAL(0, stats.bytes_read);
+    CHECK_EQUAL(0, stats.writes_full);
+    CHECK_EQUAL(0, stats.lingers);
+    CHECK_EQUAL(FILE_DRIVE_LOG_PAGES * (FLASH_PAGE_SIZE - PAGE_COUNTER_SIZE), stats.bytes_free);
+}
+
+TEST(StatsTest, RecordsAndBytes)
+{
+    uint8_t data[10] = {0};
+    for (uint8_t i = 0; i < 10; ++i)
+        file_write(f, data, 10);
+    file_read(f, data, 10);
+    file_read(f, data, 10);
+    file_read(f, data, 5); //half a record
+    file_consume(f, 20);
+
+    file_stats_t stats;
+    file_stats(f, &stats);
+    CHECK_EQUAL(10, stats.records_written);
+    CHECK_EQUAL(100, stats.bytes_written);
+    CHECK_EQUAL(2, stats.records_read);
+    CHECK_EQUAL(25, stats.bytes_read);
+    CHECK_EQUAL(2, stats.records_consumed);
+    CHECK_EQUAL(20, stats.bytes_consumed);
+}
+
+//a chained record is one record, however many chunks it takes
+
+TEST(StatsTest, ChainedRecordsCountOnce)
+{
+    uint8_t data[300] = {0};
+    file_write(f, data, 300);
+    file_record_t records[] = {
+        {data, 10},
+        {data, 300},
+        {data, 10}
+    };
+    CHECK_EQUAL(3, file_write_batch(f, records, 3));
+    CHECK_EQUAL(620, file_read(f, data, 300) + file_read(f, data, 10) + file_read(f, data, 300) + file_read(f, data, 10));
+    CHECK_EQUAL(620, file_consume(f, 1000));
+
+    file_stats_t stats;
+    file_stats(f, &stats);
+    CHECK_EQUAL(4, stats.records_written);
+    CHECK_EQUAL(620, stats.bytes_written);
+    CHECK_EQUAL(4, stats.records_read);
+    CHECK_EQUAL(4, stats.records_consumed);
+}
+
+//the handle is the only thing using the flash, so it made every transaction
+//the simulated flash saw, recovering the file included
+
+TEST(StatsTest, FlashTransactions)
+{
+    uint8_t data[30] = {0};
+    for (uint16_t i = 0; i < 200; ++i)
+    {
+        file_write(f, data, 30);
+        file_read(f, data, 30);
+        file_consume(f, 30);
+#if FILE_DEFERRED_ERASE
+        file_service(f, 1);
+#endif
+    }
+    file_stats_t stats;
+    file_stats(f, &stats);
+    CHECK(stats.flash_erases > 0);
+    CHECK_EQUAL(flash_read_calls, stats.flash_reads);
+    CHECK_EQUAL(flash_write_calls, stats.flash_writes);
+    CHECK_EQUAL(flash_erase_calls, stats.flash_erases);
+    CHECK_EQUAL(flash_erase_calls, stats.pages_erased); //one page at a time
+}
+
+TEST(StatsTest, WritesTurnedAwayWhenFull)
+{
+    uint8_t data[20] = {0};
+    while (file_write(f, data, 20))
+        ;
+    file_write(f, data, 20);
+    file_record_t records[] = {
+        {data, 20}
+    };
+    file_write_batch(f, records, 1);
+
+    file_stats_t stats;
+    file_stats(f, &stats);
+    CHECK_EQUAL(3, stats.writes_full);
+    CHECK_EQUAL(0, stats.writes_lingering);
+    CHECK(stats.bytes_free < 22);
+}
+
+#if FILE_DEFERRED_ERASE
+
+//the writer of a split file can't erase for itself. With everything read and
+//consumed, nothing is erased until the reader's file_service gets round to
+//it, and meanwhile, the writer waits on the erase.
+
+TEST(StatsTest, LingeringOnAnErase)
+{
+    file_close(f);
+    f = NULL;
+    flash_force_timing(&flash_timing_serial_nor);
+    file_handle_t *w = file_open_writer(FILE_DRIVE_LOG);
+    file_handle_t *r = file_open_reader(FILE_DRIVE_LOG);
+    uint8_t data[20] = {0};
+    while (file_write(w, data, 20))
+        ;
+    file_sync(w);
+    while (file_read(r, data, 20))
+        ;
+    file_consume(r, (size_t) - 1);
+    while (file_write(w, data, 20)) //to the end of the page the writer is on
+        ;
+    CHECK_EQUAL(0, file_write(w, data, 20));
+
+    file_stats_t stats;
+    file_stats(w, &stats);
+    CHECK_EQUAL(2, stats.writes_lingering);
+    CHECK_EQUAL(1, stats.writes_full); //when it filled up in the first place
+    CHECK_EQUAL(1, stats.lingers);
+    file_stats(r, &stats);
+    CHECK(stats.pages_pending > 0);
+
+    file_service(r, FILE_DRIVE_LOG_PAGES);
+    CHECK_EQUAL(20, file_write(w, data, 20));
+    file_stats(w, &stats);
+    CHECK_EQUAL(1, stats.lingers);
+#if FLASH_TICKS
+    CHECK(stats.linger_ticks >= 45000); //at least one erase, in simulated microseconds
+    uint32_t ticks = stats.linger_ticks;
+    file_write(w, data, 20);
+    file_stats(w, &stats);
+    CHECK_EQUAL(ticks, stats.linger_ticks); //no longer lingering
+#endif
+    file_close(w);
+    file_close(r);
+}
+#endif
+
+//each end of a split file counts for itself, and the writer's pending
+//erases are the reader's to make
+
+TEST(StatsTest, SplitEnds)
+{
+    file_close(f);
+    f = NULL;
+    file_handle_t *w = file_open_writer(FILE_DRIVE_LOG);
+    file_handle_t *r = file_open_reader(FILE_DRIVE_LOG);
+    uint8_t data[10] = {0};
+    for (uint8_t i = 0; i < 5; ++i)
+        file_write(w, data, 10);
+    file_sync(w);
+    file_read(r, data, 10);
+    file_consume(r, 10);
+
+    file_stats_t stats;
+    file_stats(w, &stats);
+    CHECK_EQUAL(5, stats.records_written);
+    CHECK_EQUAL(0, stats.records_read);
+    file_stats(r, &stats);
+    CHECK_EQUAL(0, stats.records_written);
+    CHECK_EQUAL(1, stats.records_read);
+    CHECK_EQUAL(1, stats.records_consumed);
+    file_close(w);
+    file_close(r);
+}
+
+TEST(StatsTest, FromTheClass)
+{
+    file_close(f);
+    f = NULL;
+    flashfifo::FlashFifo file(file_open(FILE_DRIVE_LOG));
+    uint8_t data[4] = {1, 2, 3, 4};
+    file.write(std::as_bytes(std::span(data)));
+    CHECK_EQUAL(1, file.stats().records_written);
+}
+
+#endif
@@ -0,0 +1,207 @@
+/************************************
+ FIFO_thread_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for calling FlashFIFO from several
+ * threads at once. Things being checked, at a general level include:
+ * different files being worked on side by side, a split file with its writer
+ * and reader in different threads, and racing opens of the same file. The
+ * simulated flash asserts if it is programmed or read while an erase is under
+ * way without being suspended, so any slip in the bus locking shows up there.
+ * The threads only keep count of what went wrong; the checks are made once
+ * they have been joined.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include <pthread.h>
+#include <sched.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "flash_port.h"
+#include "handle_pool_mock.h"
+
+#if FLASH_THREADS
+
+extern "C"
+{
+    void flash_force_erase_time(uint32_t polls);
+    void flash_force_write_time(uint32_t polls);
+}
+
+#define RECORDS 2000
+
+typedef struct
+{
+    enum FILE_ID id;
+    file_handle_t *handle;
+    uint32_t done; //records written, or read back
+    uint32_t errors; //records out of order, or short
+} worker_t;
+
+//write and read back records on a file of this thread's own, a few at a time
+
+static void *whole_file(void *arg)
+{
+    worker_t *worker = (worker_t *) arg;
+    file_handle_t *f = file_open(worker->id);
+    uint8_t data[20] = {0};
+    uint32_t next_read = 0;
+    while (next_read < RECORDS)
+    {
+        for (uint8_t i = 0; i < 4; ++i)
+        {
+            data[0] = (uint8_t) worker->done;
+            data[19] = (uint8_t) worker->id;
+            if (file_write(f, data, 20))
+                ++worker->done;
+        }
+        for (uint8_t i = 0; i < 3 && (next_read < worker->done); ++i)
+        {
+            if ((file_read(f, data, 20) != 20) || (data[0] != (uint8_t) next_read) || (data[19] != worker->id))
+                ++worker->errors;
+            file_consume(f, 20);
+            ++next_read;
+        }
+#if FILE_DEFERRED_ERASE
+        file_service(f, 1);
+#endif
+    }
+    file_close(f);
+    return NULL;
+}
+
+//the two ends of a split file, each in a thread of its own
+
+static void *producer(void *arg)
+{
+    worker_t *worker = (worker_t *) arg;
+    uint8_t data[20] = {0};
+    while (worker->done < RECORDS)
+    {
+        data[0] = (uint8_t) worker->done;
+        if (file_write(worker->handle, data, 20))
+            ++worker->done;
+        else
+            sched_yield(); //full, let the consumer catch up
+    }
+    //the simulated part only gets through its queue while it is polled, so
+    //see the last of the writes made, and the pointer covering them published
+    file_sync(worker->handle);
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    worker_t *worker = (worker_t *) arg;
+    uint8_t data[20] = {0};
+    while (worker->done < RECORDS)
+    {
+        if (file_read(worker->handle, data, 20))
+        {
+            if (data[0] != (uint8_t) worker->done)
+                ++worker->errors;
+            file_consume(worker->handle, 20);
+            ++worker->done;
+        }
+        else
+            sched_yield(); //empty, let the producer catch up
+#if FILE_DEFERRED_ERASE
+        file_service(worker->handle, 1);
+#endif
+    }
+    return NULL;
+}
+
+static void *opener(void *arg)
+{
+    worker_t *worker = (worker_t *) arg;
+    worker->handle = file_open_writer(worker->id);
+    return NULL;
+}
+
+TEST_GROUP(ThreadTest)
+{
+
+    void setup()
+    {
+        flash_init();
+        flash_force_erase_time(3);
+        flash_force_write_time(2);
+    }
+
+    void teardown()
+    {
+    }
+};
+
+//files on the same chip, each worked on by a thread of its own
+
+TEST(ThreadTest, FilesSideBySide)
+{
+    worker_t workers[3] = {
+        {FILE_DRIVE_LOG, NULL, 0, 0},
+        {FILE_DEBUG_LOG, NULL, 0, 0},
+        {FILE_SCRATCH, NULL, 0, 0}
+    };
+    pthread_t threads[3];
+    for (uint8_t i = 0; i < 3; ++i)
+        pthread_create(&threads[i], NULL, whole_file, &workers[i]);
+    for (uint8_t i = 0; i < 3; ++i)
+        pthread_join(threads[i], NULL);
+    for (uint8_t i = 0; i < 3; ++i)
+        CHECK_EQUAL(0, workers[i].errors);
+}
+
+//a producer and a consumer sharing a file through its two ends
+
+TEST(ThreadTest, SplitFileAcrossThreads)
+{
+    worker_t writer = {FILE_FIRMWARE, file_open_writer(FILE_FIRMWARE), 0, 0};
+    worker_t reader = {FILE_FIRMWARE, file_open_reader(FILE_FIRMWARE), 0, 0};
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, producer, &writer);
+    pthread_create(&threads[1], NULL, consumer, &reader);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    CHECK_EQUAL(0, reader.errors);
+    CHECK_EQUAL(RECORDS, reader.done);
+    file_close(writer.handle);
+    file_close(reader.handle);
+}
+
+//only one of two threads racing to open the same end gets it
+
+TEST(ThreadTest, RacingOpens)
+{
+    worker_t workers[2] = {
+        {FILE_DRIVE_LOG, NULL, 0, 0},
+        {FILE_DRIVE_LOG, NULL, 0, 0}
+    };
+    pthread_t threads[2];
+    for (uint8_t i = 0; i < 2; ++i)
+        pthread_create(&threads[i], NULL, opener, &workers[i]);
+    for (uint8_t i = 0; i < 2; ++i)
+        pthread_join(threads[i], NULL);
+    CHECK(!workers[0].handle != !workers[1].handle);
+    file_close(workers[0].handle ? workers[0].handle : workers[1].handle);
+}
+
+#endif
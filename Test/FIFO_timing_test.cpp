@@ -0,0 +1,143 @@
+/************************************
+ FIFO_timing_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for the timing model of the
+ * simulated flash. Things being checked, at a general level include: what
+ * each kind of transaction costs in time and energy, page and block erases,
+ * nothing being charged while the power is off, and the clock following a
+ * file as it is written, read and consumed.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "flash_port.h"
+#include "flash_port_mock.h"
+#include "handle_pool_mock.h"
+
+extern "C"
+{
+    void flash_force_power_off(void);
+    void flash_force_block_size(size_t size);
+}
+
+//round numbers, so that costs can be worked out by hand
+static const flash_timing_t part = {
+    10, //command_ns
+    2, //byte_ns
+    100, //program_ns
+    5, //program_byte_ns
+    1000, //erase_ns
+    3000, //block_erase_ns
+    1, //bus_mw
+    2, //program_mw
+    3, //erase_mw
+};
+
+TEST_GROUP(TimingTest)
+{
+
+    void setup()
+    {
+        flash_init();
+        flash_force_timing(&part);
+    }
+
+    void teardown()
+    {
+    }
+};
+
+TEST(TimingTest, InstantByDefault)
+{
+    flash_init();
+    uint8_t data[16] = {0};
+    flash_write(0, data, 16);
+    flash_read(0, data, 16);
+    flash_erase(0, FLASH_PAGE_SIZE);
+    CHECK_EQUAL(0, flash_elapsed_ns);
+    CHECK_EQUAL(0, flash_energy_pj);
+}
+
+TEST(TimingTest, Read)
+{
+    uint8_t data[16];
+    flash_read(0, data, 16);
+    CHECK_EQUAL(10 + 16 * 2, flash_elapsed_ns);
+    CHECK_EQUAL((10 + 16 * 2) * 1, flash_energy_pj);
+}
+
+//a write enable, the command and data, then programming
+
+TEST(TimingTest, Write)
+{
+    uint8_t data[16] = {0};
+    flash_write(0, data, 16);
+    CHECK_EQUAL(2 + (10 + 16 * 2) + (100 + 15 * 5), flash_elapsed_ns);
+    CHECK_EQUAL((2 + 10 + 16 * 2) * 1 + (100 + 15 * 5) * 2, flash_energy_pj);
+}
+
+TEST(TimingTest, PageAndBlockErase)
+{
+    flash_erase(0, FLASH_PAGE_SIZE);
+    CHECK_EQUAL(2 + 10 + 1000, flash_elapsed_ns);
+    CHECK_EQUAL(12 * 1 + 1000 * 3, flash_energy_pj);
+
+    flash_elapsed_ns = flash_energy_pj = 0;
+    flash_force_block_size(4 * FLASH_PAGE_SIZE);
+    flash_erase(0, 4 * FLASH_PAGE_SIZE);
+    CHECK_EQUAL(2 + 10 + 3000, flash_elapsed_ns);
+}
+
+TEST(TimingTest, NothingWhilePoweredOff)
+{
+    uint8_t data[16] = {0};
+    flash_force_power_off();
+    flash_write(0, data, 16);
+    flash_erase(0, FLASH_PAGE_SIZE);
+    CHECK_EQUAL(0, flash_elapsed_ns);
+}
+
+//a file's records cost what the transactions behind them do, so ten more
+//take about as long as the first ten, and reading them back a good deal less
+
+TEST(TimingTest, FollowsTheFile)
+{
+    flash_force_timing(&flash_timing_serial_nor);
+    file_handle_t *f = file_open(FILE_DRIVE_LOG);
+    uint8_t data[20] = {0};
+    flash_elapsed_ns = 0;
+    for (uint8_t i = 0; i < 10; ++i)
+        file_write(f, data, 20);
+    uint64_t ten = flash_elapsed_ns;
+    CHECK(ten >= 10 * (30000 + 19 * 2500)); //the programming alone
+    for (uint8_t i = 0; i < 10; ++i)
+        file_write(f, data, 20);
+    uint64_t more = flash_elapsed_ns - ten;
+    CHECK(more > ten / 2 && more < ten * 3 / 2);
+
+    flash_elapsed_ns = 0;
+    for (uint8_t i = 0; i < 20; ++i)
+        file_read(f, data, 20);
+    CHECK(flash_elapsed_ns < ten);
+    file_close(f);
+}
@@ -0,0 +1,192 @@
+/************************************
+ FIFO_trace_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for the trace. Things being
+ * checked, at a general level include: calls and the flash transactions made
+ * within them being recorded in order, each transaction falling within the
+ * call it was made for, the ring keeping the newest events, the histograms
+ * and percentiles picking out slow erases, and the trace-event JSON export.
+ * The simulated flash is given a timing, so that everything takes time.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include <string>
+#include "configure.h"
+#include "FIFO.h"
+#include "FIFO_trace.h"
+#include "flash_port.h"
+#include "flash_port_mock.h"
+#include "handle_pool_mock.h"
+
+#if FILE_TRACE
+
+static file_handle_t * f;
+static file_trace_event_t events[FILE_TRACE_EVENTS];
+
+TEST_GROUP(TraceTest)
+{
+
+    void setup()
+    {
+        flash_init();
+        flash_force_timing(&flash_timing_serial_nor);
+        f = file_open(FILE_DRIVE_LOG);
+        file_trace_clear();
+    }
+
+    void teardown()
+    {
+        if (f)
+            file_close(f);
+    }
+};
+
+//the flash transactions come first, as each call is recorded once it returns
+
+TEST(TraceTest, CallsAndTransactions)
+{
+    uint8_t data[10] = {0};
+    file_write(f, data, 10);
+    size_t n = file_trace_events(events, FILE_TRACE_EVENTS);
+    CHECK(n > 1);
+    file_trace_event_t *call = &events[n - 1];
+    CHECK_EQUAL(FILE_TRACE_WRITE, call->op);
+    CHECK_EQUAL(FILE_DRIVE_LOG, call->file);
+    CHECK_EQUAL(10, call->size);
+    for (size_t i = 0; i < n - 1; ++i)
+    {
+        CHECK(events[i].op >= FILE_TRACE_FLASH_READ);
+        CHECK_EQUAL(FILE_MAX, events[i].file);
+        CHECK(events[i].ticks > 0);
+        CHECK(events[i].start >= call->start);
+        CHECK(events[i].start + events[i].ticks <= call->start + call->ticks);
+    }
+}
+
+TEST(TraceTest, RingKeepsTheNewest)
+{
+    uint8_t data[10] = {0};
+    for (uint16_t i = 0; i < FILE_TRACE_EVENTS; ++i)
+        file_write(f, data, 10);
+    file_read(f, data, 3);
+    CHECK_EQUAL(FILE_TRACE_EVENTS, file_trace_events(events, FILE_TRACE_EVENTS));
+    CHECK_EQUAL(FILE_TRACE_READ, events[FILE_TRACE_EVENTS - 1].op);
+    CHECK_EQUAL(3, events[FILE_TRACE_EVENTS - 1].size);
+    for (uint16_t i = 1; i < FILE_TRACE_EVENTS; ++i) //oldest first
+        CHECK(events[i].start + events[i].ticks >= events[i - 1].start + events[i - 1].ticks);
+
+    CHECK_EQUAL(2, file_trace_events(events, 2)); //just the newest two
+    CHECK_EQUAL(FILE_TRACE_READ, events[1].op);
+
+    file_trace_clear();
+    CHECK_EQUAL(0, file_trace_events(events, FILE_TRACE_EVENTS));
+}
+
+//most calls are quick, but the ones that erase a page are anything but.
+//Which call that is depends on the build: file_service with deferred erases,
+//and otherwise file_consume, or with queued writes whatever call next finds
+//the flash free.
+
+TEST(TraceTest, SlowErasesStandOut)
+{
+    uint8_t data[20] = {0};
+    for (uint16_t i = 0; i < 500; ++i)
+    {
+        file_write(f, data, 20);
+        file_read(f, data, 20);
+        file_consume(f, 20);
+#if FILE_DEFERRED_ERASE
+        file_service(f, 1);
+#endif
+    }
+    static const enum FILE_TRACE_OP calls[] = {FILE_TRACE_WRITE, FILE_TRACE_READ, FILE_TRACE_CONSUME, FILE_TRACE_SERVICE};
+    enum FILE_TRACE_OP erasing = FILE_TRACE_WRITE;
+    file_trace_histogram_t histogram;
+    uint32_t slowest = 0;
+    for (uint8_t i = 0; i < sizeof (calls) / sizeof (calls[0]); ++i)
+    {
+        file_trace_histogram(calls[i], &histogram);
+        if (histogram.max_ticks > slowest)
+        {
+            slowest = histogram.max_ticks;
+            erasing = calls[i];
+        }
+    }
+    file_trace_histogram(erasing, &histogram);
+    CHECK_EQUAL(500, histogram.count);
+    uint32_t total = 0;
+    for (uint8_t b = 0; b < FILE_TRACE_BUCKETS; ++b)
+        total += histogram.bucket[b];
+    CHECK_EQUAL(500, total);
+    CHECK(histogram.max_ticks >= 45000); //an erase, in simulated microseconds
+
+    CHECK(file_trace_percentile(erasing, 500) < 1000); //most do no erase at all
+    CHECK(file_trace_percentile(erasing, 999) >= 45000);
+    CHECK_EQUAL(histogram.max_ticks, file_trace_percentile(erasing, 1000));
+
+    file_trace_histogram(FILE_TRACE_SEEK, &histogram);
+    CHECK_EQUAL(0, histogram.count);
+    CHECK_EQUAL(0, file_trace_percentile(FILE_TRACE_SEEK, 999));
+}
+
+static void append(void *context, const char *text)
+{
+    *(std::string *) context += text;
+}
+
+static size_t occurrences(const std::string &in, const char *what)
+{
+    size_t n = 0;
+    for (size_t at = in.find(what); at != std::string::npos; at = in.find(what, at + 1))
+        ++n;
+    return n;
+}
+
+TEST(TraceTest, ExportsTraceEvents)
+{
+    uint8_t data[10] = {0};
+    file_write(f, data, 10);
+    file_read(f, data, 10);
+    size_t n = file_trace_events(events, FILE_TRACE_EVENTS);
+
+    std::string json;
+    file_trace_export(append, &json, 1000, 1); //a tick is a microsecond
+    CHECK_EQUAL(0, json.find("{\"displayTimeUnit\": \"ns\", \"traceEvents\": ["));
+    CHECK_EQUAL(json.size() - 4, json.rfind("\n]}\n"));
+    CHECK_EQUAL(n, occurrences(json, "\"ph\": \"X\""));
+    CHECK_EQUAL(FILE_MAX + 1, occurrences(json, "\"thread_name\""));
+    CHECK(json.find("\"name\": \"FILE_DRIVE_LOG\"") != std::string::npos);
+    CHECK(json.find("\"name\": \"file_write\", \"cat\": \"flashfifo\"") != std::string::npos);
+    CHECK(occurrences(json, "\"cat\": \"flash\"") > 0);
+
+    char ts[40];
+    snprintf(ts, sizeof (ts), "\"ts\": %u.000, ", (unsigned) events[n - 1].start);
+    CHECK(json.find(ts) != std::string::npos);
+
+    std::string spliced; //just the events, to go among others
+    file_trace_export(append, &spliced, 1000, 0);
+    CHECK_EQUAL(n, occurrences(spliced, "\"ph\": \"X\""));
+    CHECK_EQUAL(n - 1, occurrences(spliced, "},\n"));
+    CHECK_EQUAL(0, occurrences(spliced, "traceEvents"));
+}
+
+#endif
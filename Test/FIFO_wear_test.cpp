@@ -0,0 +1,259 @@
+/************************************
+ FIFO_wear_test.cpp
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+ *
+ * This file implements a set of unit tests for the erase counts kept in page
+ * headers. Things being checked, at a general level include: a fresh file
+ * having no counts, every erase being counted, the counts surviving the file
+ * being closed and the power cut, pages erased as a block being stamped
+ * alike, a lost or torn count being worked out from its neighbours, and the
+ * checkpoint page keeping a count of its own.
+ *
+ ************************************/
+
+#include <CppUTest/TestHarness.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "flash_port.h"
+#include "handle_pool_mock.h"
+
+#if FILE_WEAR
+
+extern "C"
+{
+void flash_force_block_size(size_t size);
+void flash_force_power_off(void);
+void flash_force_succeed(void);
+}
+
+extern uint8_t store[];
+extern uint32_t flash_erase_calls;
+
+#define WEAR_FILE FILE_DEBUG_LOG
+#define RECORD_SIZE 20
+
+static file_handle_t * f;
+
+TEST_GROUP(WearTest)
+{
+
+    void setup()
+    {
+        flash_init();
+        f = file_open(WEAR_FILE);
+    }
+
+    void teardown()
+    {
+        if (f)
+            file_close(f);
+    }
+};
+
+//write and take off records until this many pages have been erased
+
+static void churn(file_handle_t *handle, uint32_t erases)
+{
+    uint8_t data[RECORD_SIZE] = {0};
+    uint32_t start = flash_erase_calls;
+    while (flash_erase_calls - start < erases)
+    {
+        file_write(handle, data, RECORD_SIZE);
+        file_read(handle, data, RECORD_SIZE);
+        file_consume(handle, RECORD_SIZE);
+#if FILE_DEFERRED_ERASE
+        file_service(handle, 1);
+#endif
+    }
+}
+
+TEST(WearTest, FreshFileUncounted)
+{
+    file_wear_t wear;
+    file_wear(WEAR_FILE, &wear);
+    CHECK_EQUAL(FILE_DEBUG_LOG_PAGES, wear.pages);
+    CHECK_EQUAL(FILE_DEBUG_LOG_PAGES, wear.uncounted);
+    CHECK_EQUAL(0, wear.least);
+    CHECK_EQUAL(0, wear.most);
+    CHECK_EQUAL(0, wear.total);
+    CHECK_EQUAL(0, wear.checkpoint);
+    CHECK_EQUAL(0, file_page_erases(WEAR_FILE, 0));
+}
+
+//pages are erased in turn, so they wear evenly, and every erase is counted
+
+TEST(WearTest, EveryEraseCounted)
+{
+    churn(f, 10 * FILE_DEBUG_LOG_PAGES);
+    file_sync(f);
+
+    file_wear_t wear;
+    file_wear(WEAR_FILE, &wear);
+    CHECK_EQUAL(0, wear.uncounted);
+    CHECK_EQUAL(flash_erase_calls, wear.total + wear.checkpoint);
+    CHECK(wear.most - wear.least <= 1);
+    CHECK(wear.least >= 9);
+    uint32_t total = 0;
+    for (uint32_t p = 0; p < FILE_DEBUG_LOG_PAGES; ++p)
+        total += file_page_erases(WEAR_FILE, p);
+    CHECK_EQUAL(wear.total, total);
+    CHECK_EQUAL(0, file_page_erases(WEAR_FILE, FILE_DEBUG_LOG_PAGES));
+    CHECK_EQUAL(0, file_page_erases(FILE_MAX, 0));
+
+    file_wear_t other;
+    file_wear(FILE_PREFS, &other); //untouched
+    CHECK_EQUAL(FILE_PREFS_PAGES, other.uncounted);
+}
+
+//the counts are in flash, and carry on from where they were
+
+TEST(WearTest, SurvivesPowerFailure)
+{
+    churn(f, 2 * FILE_DEBUG_LOG_PAGES);
+    file_sync(f);
+    file_wear_t before;
+    file_wear(WEAR_FILE, &before);
+
+    churn(f, 1);
+    flash_force_power_off();
+    file_close(f);
+    flash_force_succeed();
+    f = file_open(WEAR_FILE);
+    churn(f, FILE_DEBUG_LOG_PAGES);
+    file_sync(f);
+
+    file_wear_t after;
+    file_wear(WEAR_FILE, &after);
+    CHECK(after.total > before.total + FILE_DEBUG_LOG_PAGES);
+    CHECK(after.least >= before.least + 1);
+}
+
+//a page whose count never made it to flash works it out from its neighbours
+//when it is next erased. The first page is erased a lap after the last, and
+//just before the second.
+
+TEST(WearTest, LostCountWorkedOut)
+{
+    churn(f, 3 * FILE_DEBUG_LOG_PAGES);
+    file_sync(f);
+    uint32_t lost = file_page_erases(WEAR_FILE, 0);
+    memset(&store[f->start + 5], 0xFF, 5); //as if the power failed just after the erase
+    CHECK_EQUAL(0, file_page_erases(WEAR_FILE, 0));
+    memset(&store[f->start + 2 * FLASH_PAGE_SIZE + 5], 0xFF, 5);
+
+    while (!file_page_erases(WEAR_FILE, 0) || !file_page_erases(WEAR_FILE, 2))
+    {
+        churn(f, 1);
+        file_sync(f);
+    }
+    CHECK_EQUAL(lost + 1, file_page_erases(WEAR_FILE, 0));
+    CHECK_EQUAL(file_page_erases(WEAR_FILE, 1), file_page_erases(WEAR_FILE, 2));
+}
+
+//a count torn by a power failure has no flag after it, and is taken for no
+//count at all, rather than for one of billions
+
+TEST(WearTest, TornCountIgnored)
+{
+    churn(f, 3 * FILE_DEBUG_LOG_PAGES);
+    file_sync(f);
+    uint32_t count = file_page_erases(WEAR_FILE, 1);
+    memset(&store[f->start + FLASH_PAGE_SIZE + 5 + 2], 0xFF, 3); //the low bytes made it, the rest and the flag didn't
+    CHECK_EQUAL(0, file_page_erases(WEAR_FILE, 1));
+
+    file_wear_t wear;
+    file_wear(WEAR_FILE, &wear);
+    CHECK_EQUAL(1, wear.uncounted);
+    CHECK(wear.most <= count + 1);
+
+    while (!file_page_erases(WEAR_FILE, 1))
+    {
+        churn(f, 1);
+        file_sync(f);
+    }
+    CHECK_EQUAL(count + 1, file_page_erases(WEAR_FILE, 1));
+}
+
+//the pages of a block are erased together, and stamped alike
+
+TEST(WearTest, BlockStampedAlike)
+{
+    file_close(f);
+    flash_force_block_size(2 * FLASH_PAGE_SIZE);
+    f = file_open(FILE_DRIVE_LOG);
+    churn(f, 6);
+    file_sync(f);
+    file_close(f);
+    f = NULL;
+    for (uint32_t p = 0; p < FILE_DRIVE_LOG_PAGES; p += 2)
+        CHECK_EQUAL(file_page_erases(FILE_DRIVE_LOG, p), file_page_erases(FILE_DRIVE_LOG, p + 1));
+}
+
+#if FILE_CHECKPOINTS
+
+//every so many syncs, the checkpoint page fills and is erased, and its count
+//goes up
+
+TEST(WearTest, CheckpointPageCounted)
+{
+    uint8_t data[4] = {0};
+    uint32_t start = flash_erase_calls;
+    for (uint8_t i = 0; i < 40; ++i)
+    {
+        file_write(f, data, 4);
+        file_sync(f);
+    }
+    file_wear_t wear;
+    file_wear(WEAR_FILE, &wear);
+    CHECK(wear.checkpoint > 0);
+    CHECK_EQUAL(flash_erase_calls - start, wear.checkpoint);
+}
+#endif
+
+//the other end of a split file only ever writes, and the reader, which erases,
+//stamps the counts
+
+TEST(WearTest, SplitFile)
+{
+    file_close(f);
+    f = NULL;
+    file_handle_t *w = file_open_writer(WEAR_FILE);
+    file_handle_t *r = file_open_reader(WEAR_FILE);
+    uint8_t data[RECORD_SIZE] = {0};
+    while (flash_erase_calls < 2 * FILE_DEBUG_LOG_PAGES)
+    {
+        file_write(w, data, RECORD_SIZE);
+        file_sync(w);
+        file_read(r, data, RECORD_SIZE);
+        file_consume(r, RECORD_SIZE);
+#if FILE_DEFERRED_ERASE
+        file_service(r, 1);
+#endif
+    }
+    file_close(w);
+    file_close(r);
+
+    file_wear_t wear;
+    file_wear(WEAR_FILE, &wear);
+    CHECK_EQUAL(0, wear.uncounted);
+    CHECK_EQUAL(flash_erase_calls, wear.total + wear.checkpoint);
+}
+
+#endif
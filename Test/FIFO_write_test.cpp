@@ -30,6 +30,7 @@
 #include "configure.h"
 #include "FIFO.h"
 #include "flash_port.h"
+#include "handle_pool_mock.h"
 
 extern "C"
 {
@@ -41,9 +42,22 @@ void flash_force_succeed(void);
 #define DATA_VALID      0xFE
 #define DATA_CONSUMED   0xFC
 #define DATA_INVALID    0xFF
+#define DATA_VALID_FIRST    0xEE
+#define DATA_VALID_MIDDLE   0xCE
+#define DATA_VALID_LAST     0xDE
 
 static file_handle_t * f;
 extern uint8_t store[];
+extern uint32_t flash_write_calls, flash_write_bytes;
+
+//let any erases that were left for later happen now
+
+static void service(void)
+{
+#if FILE_DEFERRED_ERASE
+    file_service(f, (size_t) - 1);
+#endif
+}
 enum FILE_ID filename = FILE_FIRMWARE;
 
 TEST_GROUP(BasicFileWriteTest)
@@ -87,9 +101,12 @@ TEST(BasicFileWriteTest, FileCreateDuplicate)
 
 TEST(BasicFileWriteTest, BlankStore)
 {
-    //notice that the act of opening a new file writes 0xFE into the very first byte!
+    //notice that the act of opening a new file claims the first page, writing
+    //0xFE into the very first byte, followed by a sequence number of 0
     CHECK_EQUAL(0xFE, store[f->start]);
-    CHECK_EQUAL(0xFF, store[f->start + 1]); //just do a spot check that is fine
+    CHECK_EQUAL(0x00, store[f->start + 1]);
+    CHECK_EQUAL(0x00, store[f->start + 4]); //the last byte of the sequence number
+    CHECK_EQUAL(0xFF, store[f->start + PAGE_COUNTER_SIZE]); //just do a spot check that is fine
     CHECK_EQUAL(0xFF, store[f->start + 10]);
 }
 
@@ -167,34 +184,47 @@ TEST(BasicFileWriteTest, TestWritePowerOff)
     CHECK_EQUAL(DATA_INVALID, store[f->start + PAGE_COUNTER_SIZE + 1]); //check metadata.
 }
 
-//test writes of size 255 should fail. The should fail because 0xFF in the size location of metadata is a flag that there is no chunk from this point forward.
+//writes of 255 bytes or more cannot be stored in a single chunk, because 0xFF in the size location of metadata is a flag that there is no chunk from this point forward.
+//Instead, they are chained across as many chunks, and pages, as it takes.
 
-TEST(BasicFileWriteTest, TestWriteTooBig1)
+TEST(BasicFileWriteTest, TestWriteChain1)
 {
-    uint8_t size = 255;
-    uint8_t data[255] = {0};
-    uint32_t prev_write_loc = f->write_offset;
+    uint16_t size = 255;
+    uint8_t data[255];
+    for (uint16_t i = 0; i < size; ++i)
+        data[i] = i;
+    uint8_t chunk = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+
     size = file_write(f, data, size);
 
-    CHECK_EQUAL(0x00, size); //make sure no data was reported as written
-    CHECK_EQUAL(prev_write_loc, f->write_offset); //make sure no data was recorded as written
-    CHECK_EQUAL(0xFF, store[f->start + METADATA_SIZE + PAGE_COUNTER_SIZE]); //make sure no data was actually written
+    CHECK_EQUAL(255, size);
+    CHECK_EQUAL(chunk, store[f->start + PAGE_COUNTER_SIZE]);
+    CHECK_EQUAL(DATA_VALID_FIRST, store[f->start + PAGE_COUNTER_SIZE + 1]);
+    CHECK_EQUAL(chunk, store[f->start + FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE]);
+    CHECK_EQUAL(DATA_VALID_MIDDLE, store[f->start + FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE + 1]);
+    CHECK_EQUAL(chunk, store[f->start + FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE + METADATA_SIZE]); //data carries on where it left off
+    CHECK_EQUAL(255 - 2 * chunk, store[f->start + 2 * FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE]);
+    CHECK_EQUAL(DATA_VALID_LAST, store[f->start + 2 * FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE + 1]);
+    CHECK_EQUAL(2 * FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE + METADATA_SIZE + 255 - 2 * chunk, f->write_offset);
 }
 
-//test to make sure that we cannot write a chunk /larger/ than 255, because all metadata is one byte in size to ensure all metadata writes are atomic.
-//Just want to be sure that this case is handled correctly, since 256 as a uint8_t is actually 1!
+//a record too large for the free space must fail without writing any of it.
+//Just want to be sure that this case is handled correctly, since 256 as a uint8_t is actually 0!
 
-TEST(BasicFileWriteTest, TestWriteTooBig2)
+TEST(BasicFileWriteTest, TestWriteChain2)
 {
-    uint16_t size = 0x00FF + 1;
-    uint8_t data[0x00FF + 1] = {0};
+    uint16_t size = FILE_FIRMWARE_PAGES * FLASH_PAGE_SIZE;
+    uint8_t data[FILE_FIRMWARE_PAGES * FLASH_PAGE_SIZE] = {0};
 
     uint32_t prev_write_loc = f->write_offset;
     size = file_write(f, data, size);
 
     CHECK_EQUAL(0x00, size); //make sure no data was reported as written
     CHECK_EQUAL(prev_write_loc, f->write_offset); //make sure no data was recorded as written
-    CHECK_EQUAL(0xFF, store[f->start + METADATA_SIZE + PAGE_COUNTER_SIZE]); //make sure no data was actually written
+    CHECK_EQUAL(0xFF, store[f->start + PAGE_COUNTER_SIZE]); //make sure no data was actually written
+    CHECK_EQUAL(0xFF, store[f->start + FLASH_PAGE_SIZE]); //nor any pages claimed
+
+    CHECK_EQUAL(0x00FF + 1, file_write(f, data, 0x00FF + 1));
 }
 
 //All writes should be page-aligned, by which I mean a write must not span a
@@ -219,19 +249,23 @@ TEST(BasicFileWriteTest, TestWriteAcrossPageBoundary1)
     CHECK_EQUAL(FLASH_PAGE_SIZE * 2 + PAGE_COUNTER_SIZE, f->write_offset); //check the file handle to see that the next write offset is in the correct place.
 }
 
-//Any write that is larger than the page size must fail, full stop
+//A write that is larger than the page size fills out the current page, and
+//carries on into the next
 
 TEST(BasicFileWriteTest, TestWriteAcrossPageBoundary2)
 {
+    uint8_t i = 1;
+    file_write(f, &i, 1); //write one byte
+
     uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE + 1;
     uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE + 1] = {0};
+    uint8_t first = FLASH_PAGE_SIZE - PAGE_COUNTER_SIZE - 2 * METADATA_SIZE - 1;
 
-    uint32_t prev_write_loc = f->write_offset;
-    size = file_write(f, data, FLASH_PAGE_SIZE - METADATA_SIZE + 1);
-
-    CHECK_EQUAL(0x00, size); //make sure no data was reported as written
-    CHECK_EQUAL(prev_write_loc, f->write_offset); //make sure no data was recorded as written
-    CHECK_EQUAL(0xFF, store[f->start + METADATA_SIZE]); //make sure no data was actually written
+    CHECK_EQUAL(size, file_write(f, data, size));
+    CHECK_EQUAL(first, store[f->start + PAGE_COUNTER_SIZE + METADATA_SIZE + 1]);
+    CHECK_EQUAL(DATA_VALID_FIRST, store[f->start + PAGE_COUNTER_SIZE + METADATA_SIZE + 2]);
+    CHECK_EQUAL(size - first, store[f->start + FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE]);
+    CHECK_EQUAL(DATA_VALID_LAST, store[f->start + FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE + 1]);
 }
 
 //Writes should fail if the size being written takes us beyond the destructive read pointer,
@@ -269,15 +303,38 @@ TEST(BasicFileWriteTest, TestWritesThatWrapAround)
     //now, free up the first page by consuming it.
     file_read(f, data, size);
     file_consume(f, size);
+    service();
     //make sure first page is free
-    CHECK_EQUAL(0xFF, store[f->start + 1]);
+    CHECK_EQUAL(0xFF, store[f->start + PAGE_COUNTER_SIZE]);
 
     //and write another page. Should go at beginning just fine
     uint8_t written = file_write(f, data, size);
     CHECK_EQUAL(size, written);
-    CHECK_EQUAL(size, store[f->start + 1]);
+    CHECK_EQUAL(size, store[f->start + PAGE_COUNTER_SIZE]);
 }
 
+#if FILE_DEFERRED_ERASE
+
+//a consumed page that is still waiting to be erased is erased as soon as the
+//writer needs it
+
+TEST(BasicFileWriteTest, TestWriteErasesDeferredPage)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+
+    file_write(f, data, size);
+    file_write(f, data, size);
+    file_write(f, data, size);
+    file_read(f, data, size);
+    file_consume(f, size);
+    CHECK(0xFF != store[f->start + PAGE_COUNTER_SIZE]); //not erased yet
+
+    CHECK_EQUAL(size, file_write(f, data, size));
+    CHECK_EQUAL(size, store[f->start + PAGE_COUNTER_SIZE]);
+}
+#endif
+
 //Check that writes that reach the end of the allocated space wrap around to the
 //first page again correctly
 
@@ -287,6 +344,112 @@ TEST(BasicFileWriteTest, TestWritesThatWrapAround)
 
 // Writes that need to wrap around the end of the physical memory address space
 
+//A batch of records should land in flash exactly as if they had been written
+//one at a time, but with the sizes and data for each page in a single flash
+//write, followed by a one byte write for each valid flag
+
+TEST(BasicFileWriteTest, TestWriteBatch)
+{
+    uint8_t a[] = {1, 2, 3, 4};
+    uint8_t b[] = {5, 6};
+    uint8_t c[] = {7, 8, 9};
+    file_record_t records[] = {
+        {a, 4},
+        {b, 2},
+        {c, 3}
+    };
+
+    flash_write_calls = 0;
+    CHECK_EQUAL(3, file_write_batch(f, records, 3));
+    CHECK_EQUAL(1 + 3, flash_write_calls);
+
+    CHECK_EQUAL(4, store[f->start + PAGE_COUNTER_SIZE]);
+    CHECK_EQUAL(DATA_VALID, store[f->start + PAGE_COUNTER_SIZE + 1]);
+    CHECK_EQUAL(1, store[f->start + PAGE_COUNTER_SIZE + METADATA_SIZE]);
+    CHECK_EQUAL(2, store[f->start + PAGE_COUNTER_SIZE + 6]);
+    CHECK_EQUAL(DATA_VALID, store[f->start + PAGE_COUNTER_SIZE + 7]);
+    CHECK_EQUAL(5, store[f->start + PAGE_COUNTER_SIZE + 6 + METADATA_SIZE]);
+    CHECK_EQUAL(3, store[f->start + PAGE_COUNTER_SIZE + 10]);
+    CHECK_EQUAL(DATA_VALID, store[f->start + PAGE_COUNTER_SIZE + 11]);
+    CHECK_EQUAL(9, store[f->start + PAGE_COUNTER_SIZE + 10 + METADATA_SIZE + 2]);
+    CHECK_EQUAL(PAGE_COUNTER_SIZE + 15, f->write_offset);
+
+    uint8_t read[9] = {0};
+    CHECK_EQUAL(9, file_read(f, read, 9));
+    CHECK_EQUAL(1, read[0]);
+    CHECK_EQUAL(5, read[4]);
+    CHECK_EQUAL(9, read[8]);
+}
+
+//A batch programs each byte once: the records with their headers, and then
+//the flags, rather than the whole run over again
+
+TEST(BasicFileWriteTest, TestWriteBatchProgramsEachByteOnce)
+{
+    uint8_t data[8] = {0};
+    file_record_t records[8];
+    for (uint8_t i = 0; i < 8; ++i)
+    {
+        records[i].data = data;
+        records[i].size = 8;
+    }
+
+    flash_write_bytes = 0;
+    CHECK_EQUAL(8, file_write_batch(f, records, 8));
+    CHECK_EQUAL(8 * (8 + METADATA_SIZE) + 8, flash_write_bytes);
+}
+
+//A batch that doesn't fit on one page carries on onto the next
+
+TEST(BasicFileWriteTest, TestWriteBatchAcrossPageBoundary)
+{
+    uint8_t data[50] = {0};
+    file_record_t records[] = {
+        {data, 50},
+        {data, 50},
+        {data, 50}
+    };
+
+    CHECK_EQUAL(3, file_write_batch(f, records, 3));
+    CHECK_EQUAL(50, store[f->start + PAGE_COUNTER_SIZE + 52]);
+    CHECK_EQUAL(50, store[f->start + FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE]); //third record won't fit on the first page
+    CHECK_EQUAL(DATA_VALID, store[f->start + FLASH_PAGE_SIZE + PAGE_COUNTER_SIZE + 1]);
+}
+
+//A batch stops at the first record that won't fit in the file
+
+TEST(BasicFileWriteTest, TestWriteBatchLargerThanFreeSpace)
+{
+    uint8_t size = FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE;
+    uint8_t data[FLASH_PAGE_SIZE - METADATA_SIZE - PAGE_COUNTER_SIZE] = {0};
+    file_record_t records[] = {
+        {data, size},
+        {data, size},
+        {data, size},
+        {data, size}
+    };
+
+    CHECK_EQUAL(3, file_write_batch(f, records, 4));
+}
+
+//A power failure before the flags are written leaves every record in the run invalid
+
+TEST(BasicFileWriteTest, TestWriteBatchPowerOff)
+{
+    uint8_t a[] = {1, 2, 3, 4};
+    file_record_t records[] = {
+        {a, 4},
+        {a, 4}
+    };
+
+    flash_force_fail(1);
+    file_write_batch(f, records, 2);
+    CHECK_EQUAL(4, store[f->start + PAGE_COUNTER_SIZE]);
+    CHECK_EQUAL(DATA_INVALID, store[f->start + PAGE_COUNTER_SIZE + 1]);
+    CHECK_EQUAL(4, store[f->start + PAGE_COUNTER_SIZE + 6]);
+    CHECK_EQUAL(DATA_INVALID, store[f->start + PAGE_COUNTER_SIZE + 7]);
+}
+
 TEST(BasicFileWriteTest, ValidFile)
 {
     CHECK(f);
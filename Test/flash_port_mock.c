@@ -34,20 +34,111 @@
 #include <string.h>
 #include "configure.h"
 #include "flash_port.h"
+#include "flash_port_mock.h"
 
 //some counters for implementing power failure simulation
 uint8_t write_count, fail_after, is_off;
 
+//counters for measuring how many transactions the FIFO puts on the bus, and
+//how many bytes they move
+uint32_t flash_read_calls, flash_write_calls, flash_erase_calls;
+uint32_t flash_read_bytes, flash_write_bytes, flash_erase_bytes;
+
+//the timing of the simulated part, and the clock it keeps
+const flash_timing_t flash_timing_instant = {0};
+const flash_timing_t flash_timing_serial_nor = {
+    .command_ns = 800, //opcode, address and a dummy byte
+    .byte_ns = 160,
+    .program_ns = 30000,
+    .program_byte_ns = 2500, //so 670us for 256 bytes
+    .erase_ns = 45000000,
+    .block_erase_ns = 150000000,
+    .bus_mw = 45, //15mA at 3V
+    .program_mw = 60,
+    .erase_mw = 60,
+};
+static flash_timing_t timing;
+uint64_t flash_elapsed_ns, flash_energy_pj;
+
+//the size of the simulated part's block erase
+static size_t block_size = FLASH_PAGE_SIZE;
+
+//erases started with flash_erase_start take this many polls to finish. While
+//one is under way, flash can only be read, and then only once it is suspended,
+//and outside the pages being erased.
+static uint32_t erase_time, erase_remaining;
+static uint8_t erase_suspended;
+#if FLASH_ERASE_SUSPEND
+static uint32_t erase_addr;
+static size_t erase_len;
+#endif
+uint32_t flash_erase_suspends;
+
+//writes queued with flash_write_submit take this many polls of flash_write_busy
+//each to complete, one after another. With none, they are made at once.
+#define WRITE_QUEUE 4
+static uint32_t write_time, write_remaining;
+#if FLASH_ASYNC
+
+typedef struct
+{
+    uint32_t addr;
+    const void *data;
+    size_t n;
+    flash_done_t done;
+    void *context;
+} queued_write_t;
+
+static queued_write_t write_queue[WRITE_QUEUE];
+#endif
+static uint8_t queue_head, queue_length;
+
 //
 uint8_t store[FLASH_CHIP_SIZE]; //the simulated flash itself
 
 void flash_init(void)
 {
     write_count = fail_after = is_off = 0;
+    flash_read_calls = flash_write_calls = flash_erase_calls = 0;
+    flash_read_bytes = flash_write_bytes = flash_erase_bytes = 0;
+    timing = flash_timing_instant;
+    flash_elapsed_ns = flash_energy_pj = 0;
+    block_size = FLASH_PAGE_SIZE;
+    erase_time = erase_remaining = erase_suspended = flash_erase_suspends = 0;
+    write_time = write_remaining = queue_head = queue_length = 0;
     for (uint32_t i = 0; i < FLASH_CHIP_SIZE; ++i)
         store[i] = 0xFF;
 }
 
+//charge the clock for ns spent at mw
+
+static void spend(uint64_t ns, uint32_t mw)
+{
+    __atomic_fetch_add(&flash_elapsed_ns, ns, __ATOMIC_RELAXED); //flash_ticks reads it without the bus lock
+    flash_energy_pj += ns * mw;
+}
+
+//a transaction moving n bytes over the bus
+
+static void spend_transfer(size_t n)
+{
+    spend(timing.command_ns + (uint64_t) timing.byte_ns * n, timing.bus_mw);
+}
+
+//a program or erase, which is preceded by a write enable command
+
+static void spend_write_enable(void)
+{
+    spend(timing.byte_ns, timing.bus_mw);
+}
+
+static void spend_erase(size_t len)
+{
+    spend_write_enable();
+    spend_transfer(0);
+    spend(len > FLASH_PAGE_SIZE ? timing.block_erase_ns : timing.erase_ns, timing.erase_mw);
+}
+
 static void store_write(uint32_t addr, void*data, size_t n)
 {
     for (uint32_t i = addr; i < (addr + n); ++i)
@@ -63,6 +154,12 @@ static void store_erase_page(uint16_t page_num)
         store[i] = 0xFF;
 }
 
+static void store_erase(uint32_t addr, size_t len)
+{
+    for (uint32_t page = addr / FLASH_PAGE_SIZE; page < (addr + len) / FLASH_PAGE_SIZE; ++page)
+        store_erase_page(page);
+}
+
 static void store_read(uint32_t addr, void* data, size_t n)
 {
     for (uint32_t i = 0; i < n; ++i)
@@ -75,6 +172,31 @@ void flash_force_fail(uint8_t count)
     write_count = 0;
 }
 
+void flash_force_power_off(void)
+{
+    is_off = 1;
+}
+
+void flash_force_block_size(size_t size)
+{
+    block_size = size;
+}
+
+void flash_force_erase_time(uint32_t polls)
+{
+    erase_time = polls;
+}
+
+void flash_force_write_time(uint32_t polls)
+{
+    write_time = polls;
+}
+
+void flash_force_timing(const flash_timing_t *t)
+{
+    timing = *t;
+}
+
 void flash_force_succeed(void)
 {
     fail_after = 0;
@@ -82,10 +204,11 @@ void flash_force_succeed(void)
     is_off = 0;
 }
 
-int flash_write(uint32_t addr, void*data, size_t n)
+static int store_program(uint32_t addr, const void*data, size_t n)
 {
     assert(addr < FLASH_CHIP_SIZE);
     assert(addr + n <= FLASH_CHIP_SIZE);
+    assert(!erase_remaining); //can't program while erasing
 
     if (fail_after)
     {
@@ -97,30 +220,176 @@ int flash_write(uint32_t addr, void*data, size_t n)
     }
 
     write_count++;
+    flash_write_calls++;
 
 
     if (is_off) return 0; //powered off, can't write!
 
-    store_write(addr, data, n);
+    flash_write_bytes += n;
+    spend_write_enable();
+    spend_transfer(n);
+    if (n)
+        spend(timing.program_ns + (uint64_t) timing.program_byte_ns * (n - 1), timing.program_mw);
+    store_write(addr, (void*) data, n);
     return n;
 }
 
+int flash_write(uint32_t addr, void*data, size_t n)
+{
+    assert(!queue_length); //not while writes are queued
+
+    return store_program(addr, data, n);
+}
+
+#if FLASH_ASYNC
+
+uint8_t flash_write_submit(uint32_t addr, const void* data, size_t n, flash_done_t done, void* context)
+{
+    assert(!erase_remaining);
+
+    if (!write_time && !queue_length) //made at once
+    {
+        done(context, store_program(addr, data, n));
+        return 1;
+    }
+    if (queue_length == WRITE_QUEUE)
+        return 0;
+
+    queued_write_t *write = &write_queue[(queue_head + queue_length) % WRITE_QUEUE];
+    write->addr = addr;
+    write->data = data;
+    write->n = n;
+    write->done = done;
+    write->context = context;
+    if (!queue_length++)
+        write_remaining = write_time;
+    return 1;
+}
+
+uint8_t flash_write_busy(void)
+{
+    if (queue_length && !--write_remaining) //the one at the head is done
+    {
+        queued_write_t write = write_queue[queue_head];
+        queue_head = (queue_head + 1) % WRITE_QUEUE;
+        --queue_length;
+        write_remaining = write_time;
+        write.done(write.context, store_program(write.addr, write.data, write.n));
+    }
+    return (queue_length != 0);
+}
+#endif
+
 int flash_read(uint32_t addr, void* data, size_t n)
 {
     assert(addr < FLASH_CHIP_SIZE);
     assert(addr + n <= FLASH_CHIP_SIZE);
+    assert(!erase_remaining || erase_suspended); //can't read while erasing, either
+#if FLASH_ERASE_SUSPEND
+    assert(!erase_remaining || (addr + n <= erase_addr) || (addr >= erase_addr + erase_len)); //nor from the pages being erased, which are neither one thing nor the other
+#endif
+    assert(!queue_length); //or while writes are queued
 
+    flash_read_calls++;
+    flash_read_bytes += n;
+    spend_transfer(n);
     store_read(addr, data, n);
     return n;
 }
 
+#if FLASH_TICKS
+
+//the simulated clock, in microseconds
+
+uint32_t flash_ticks(void)
+{
+    return (uint32_t) (__atomic_load_n(&flash_elapsed_ns, __ATOMIC_RELAXED) / 1000);
+}
+#endif
+
+#if FLASH_MAPPED
+
+const uint8_t* flash_map(uint32_t addr)
+{
+    assert(addr < FLASH_CHIP_SIZE);
+
+    return &store[addr];
+}
+#endif
+
 void flash_erase(uint32_t addr, size_t len)
 {
     assert(addr < FLASH_CHIP_SIZE);
     assert(len + addr <= FLASH_CHIP_SIZE);
     assert(len % FLASH_PAGE_SIZE == 0); //TODO are these assertions going to be correct?
     assert(addr % FLASH_PAGE_SIZE == 0);
+    assert(len == FLASH_PAGE_SIZE || (len == block_size && addr % block_size == 0)); //a page, or an aligned block
+    assert(!erase_remaining);
+    assert(!queue_length);
+
+    if (is_off) return; //powered off, can't erase!
+
+    flash_erase_calls++;
+    flash_erase_bytes += len;
+    spend_erase(len);
+    store_erase(addr, len);
+}
 
-    store_erase_page(addr / FLASH_PAGE_SIZE);
+#if FLASH_ERASE_SUSPEND
+
+void flash_erase_start(uint32_t addr, size_t len)
+{
+    if (!erase_time)
+    {
+        flash_erase(addr, len);
+        return;
+    }
+
+    assert(addr < FLASH_CHIP_SIZE);
+    assert(len + addr <= FLASH_CHIP_SIZE);
+    assert(len == FLASH_PAGE_SIZE || (len == block_size && addr % block_size == 0)); //a page, or an aligned block
+    assert(!erase_remaining);
+    assert(!queue_length);
+
+    if (is_off) return; //powered off, can't erase!
+
+    flash_erase_calls++;
+    flash_erase_bytes += len;
+    spend_erase(len); //all of it, as if waited on
+    erase_remaining = erase_time;
+    erase_addr = addr;
+    erase_len = len;
+}
+
+uint8_t flash_erase_busy(void)
+{
+    if (erase_remaining && !erase_suspended)
+    {
+        --erase_remaining;
+        if (!erase_remaining) //done
+            store_erase(erase_addr, erase_len);
+    }
+    return (erase_remaining != 0);
+}
+
+void flash_erase_suspend(void)
+{
+    assert(erase_remaining);
+
+    erase_suspended = 1;
+    flash_erase_suspends++;
+    spend(timing.byte_ns, timing.bus_mw);
+}
+
+void flash_erase_resume(void)
+{
+    erase_suspended = 0;
+    spend(timing.byte_ns, timing.bus_mw);
+}
+#endif
+
+size_t flash_block_size(void)
+{
+    return block_size;
 }
 
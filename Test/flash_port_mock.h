@@ -0,0 +1,79 @@
+/************************************
+ flash_port_mock.h
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+
+ This file defines the timing model of the simulated flash in
+ flash_port_mock.c. By default the simulated part does everything instantly.
+ Give it the timing of a real part, and it keeps a clock of how long that part
+ would have spent on the bus and busy, and of the energy it would have drawn,
+ so that the cost of a change to FIFO.c on a real device can be estimated
+ without one.
+
+ The clock only runs while the part is working, and every operation is timed
+ as if it were waited on: erases started with flash_erase_start and writes
+ queued with flash_write_submit are charged in full when they are made, so
+ any time they could overlap with other work is not taken off. Reads made
+ through flash_map are not timed at all. flash_ticks counts microseconds on
+ this clock.
+
+ ************************************/
+
+#ifndef FLASH_PORT_MOCK_H
+#define	FLASH_PORT_MOCK_H
+
+#ifdef	__cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+
+    //the timing of a part, in nanoseconds, and the power it draws, in mW
+    typedef struct
+    {
+        uint32_t command_ns; //to send a command and its address, for every transaction
+        uint32_t byte_ns; //to clock one byte of data in or out
+        uint32_t program_ns; //for the part to program the first byte of a write
+        uint32_t program_byte_ns; //and each byte after that
+        uint32_t erase_ns; //to erase one page
+        uint32_t block_erase_ns; //to erase one block (see flash_block_size)
+        uint32_t bus_mw; //while commands and data are clocked in and out
+        uint32_t program_mw; //while programming
+        uint32_t erase_mw; //while erasing
+    } flash_timing_t;
+
+    //a part that takes no time at all, as flash_init leaves it
+    extern const flash_timing_t flash_timing_instant;
+
+    //typical figures for a 3V serial NOR part clocked at 50MHz
+    extern const flash_timing_t flash_timing_serial_nor;
+
+    //give the simulated part this timing, until flash_init is next called
+    void flash_force_timing(const flash_timing_t *timing);
+
+    //the time the part has spent, and the energy it has drawn (in pJ), since
+    //flash_init. Either can be set back to 0 at any time.
+    extern uint64_t flash_elapsed_ns, flash_energy_pj;
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* FLASH_PORT_MOCK_H */
@@ -0,0 +1,56 @@
+/************************************
+ handle_pool_mock.h
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+
+ With FILE_HANDLE_POOL set to 0 in FIFO.h, there is no file_open,
+ file_open_writer or file_open_reader, and every handle is opened with
+ file_open_in. So that the unit tests run either way, this file stands in for
+ the pool, with storage of its own laid out as the pool's is: one handle for
+ each end of every file. Opening an end that is already open still returns
+ NULL, as that is checked before the storage is touched.
+
+ ************************************/
+
+#ifndef HANDLE_POOL_MOCK_H
+#define	HANDLE_POOL_MOCK_H
+
+#include "FIFO.h"
+
+#if !FILE_HANDLE_POOL
+
+static file_handle_t handle_pool_mock[FILE_MAX][2];
+
+static inline file_handle_t *file_open(enum FILE_ID id)
+{
+    return (id < FILE_MAX) ? file_open_in(id, FILE_READER | FILE_WRITER, &handle_pool_mock[id][0]) : NULL;
+}
+
+static inline file_handle_t *file_open_writer(enum FILE_ID id)
+{
+    return (id < FILE_MAX) ? file_open_in(id, FILE_WRITER, &handle_pool_mock[id][0]) : NULL;
+}
+
+static inline file_handle_t *file_open_reader(enum FILE_ID id)
+{
+    return (id < FILE_MAX) ? file_open_in(id, FILE_READER, &handle_pool_mock[id][1]) : NULL;
+}
+#endif
+
+#endif	/* HANDLE_POOL_MOCK_H */
@@ -0,0 +1,126 @@
+/************************************
+ FIFO_wear.c
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+
+ This file implements a tool that dumps the erase counts kept in the page
+ headers of a flash image. Built by `make wear`, and run as
+
+   flashfifo_wear image [endurance]
+
+ where image is a raw copy of the whole chip, as read off a device, and
+ endurance is the number of erases its pages are rated for (100,000 if not
+ given). It must be built with the same configure.h and FIFO.h as the
+ firmware that wrote the image, so that the chip and the partition table
+ match.
+
+ The image is loaded into the simulated flash in Test/flash_port_mock.c and
+ read back through file_wear and file_page_erases, so the counts are read
+ exactly as the device reads them. For each file, the count of every page is
+ reported, with the least, most and mean, the checkpoint page's count, and
+ how much of the rated endurance the most worn page has used up, as JSON on
+ stdout. Comparing two images taken some time apart gives the rate at which
+ each file is wearing, and from that, how long it will last.
+
+ ************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "configure.h"
+#include "FIFO.h"
+#include "flash_port.h"
+
+#if !FILE_WEAR
+#error "FILE_WEAR must be set in FIFO.h for there to be any erase counts"
+#endif
+
+#define DEFAULT_ENDURANCE 100000
+
+extern uint8_t store[]; //the simulated flash
+
+static const char *const file_names[FILE_MAX] = {
+#define FILE_NAME_ITEM(id, pages) #id,
+    FILE_TABLE(FILE_NAME_ITEM)
+#undef FILE_NAME_ITEM
+};
+
+//read the image into the simulated flash. Returns 0 if it is not the size of
+//the chip.
+
+static uint8_t load_image(const char *path)
+{
+    FILE *image = fopen(path, "rb");
+    if (!image)
+    {
+        fprintf(stderr, "can't open %s\n", path);
+        return 0;
+    }
+    size_t n = fread(store, 1, FLASH_CHIP_SIZE, image);
+    uint8_t more = (fgetc(image) != EOF);
+    fclose(image);
+    if ((n != FLASH_CHIP_SIZE) || more)
+    {
+        fprintf(stderr, "%s is not the size of the chip, %u bytes\n", path, (unsigned) FLASH_CHIP_SIZE);
+        return 0;
+    }
+    return 1;
+}
+
+static void report_file(enum FILE_ID id, uint32_t endurance)
+{
+    file_wear_t wear;
+    file_wear(id, &wear);
+    uint32_t most = (wear.checkpoint > wear.most) ? wear.checkpoint : wear.most;
+
+    printf("%s\n    {\"file\": \"%s\", \"pages\": %u, \"least\": %u, \"most\": %u, \"mean\": %.1f, \"uncounted\": %u,\n",
+           id ? "," : "", file_names[id], (unsigned) wear.pages, (unsigned) wear.least, (unsigned) wear.most,
+           wear.pages ? (double) wear.total / wear.pages : 0, (unsigned) wear.uncounted);
+    printf("     \"checkpoint\": %u, \"endurance_used_percent\": %.3f,\n     \"erases\": [",
+           (unsigned) wear.checkpoint, 100.0 * most / endurance);
+    for (uint32_t p = 0; p < wear.pages; ++p)
+        printf("%s%u", p ? ", " : "", (unsigned) file_page_erases(id, p));
+    printf("]}");
+}
+
+int main(int argc, char **argv)
+{
+    if ((argc < 2) || (argc > 3))
+    {
+        fprintf(stderr, "usage: %s image [endurance]\n", argv[0]);
+        return 2;
+    }
+    uint32_t endurance = (argc == 3) ? (uint32_t) strtoul(argv[2], NULL, 0) : DEFAULT_ENDURANCE;
+    if (!endurance)
+    {
+        fprintf(stderr, "the endurance must be a number of erases\n");
+        return 2;
+    }
+
+    flash_init();
+    if (!load_image(argv[1]))
+        return 1;
+
+    printf("{\n  \"flash_page_size\": %u,\n  \"endurance\": %u,\n  \"files\": [",
+           (unsigned) FLASH_PAGE_SIZE, (unsigned) endurance);
+    for (uint8_t id = 0; id < FILE_MAX; ++id)
+        report_file((enum FILE_ID) id, endurance);
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -32,6 +32,28 @@
 #define FLASH_PAGE_SIZE ( 128 )
 #define FLASH_CHIP_SIZE ( 64 * FLASH_PAGE_SIZE )
 
+//set to 1 if the flash is mapped into the address space (e.g. XIP NOR), in
+//which case flash_map must be provided, and file_peek becomes available.
+#define FLASH_MAPPED 1
+
+//set to 1 if erases can be started and left to run, and suspended while the
+//flash is read, in which case the flash_erase_start family must be provided.
+#define FLASH_ERASE_SUSPEND 1
+
+//set to 1 if FlashFIFO is to be called from more than one thread, in which case
+//flash_lock and flash_unlock must be provided. flash_lock_pthread.c provides
+//them where POSIX threads are available.
+#define FLASH_THREADS 1
+
+//set to 1 if the flash can be programmed in the background, e.g. by a DMA
+//driven SPI controller, in which case flash_write_submit and flash_write_busy
+//must be provided.
+#define FLASH_ASYNC 1
+
+//set to 1 if the port has a free-running clock, in which case flash_ticks must
+//be provided, and file_stats reports how long the writer has waited on erases.
+#define FLASH_TICKS 1
+
 
 #endif	/* CONFIGURE_H */
 
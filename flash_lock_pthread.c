@@ -0,0 +1,48 @@
+/************************************
+ flash_lock_pthread.c
+ Copyright 2013 D.E. Goodman-Wilson
+
+ This file is part of FlashFIFO.
+
+ FlashFIFO is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ FlashFIFO is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with FlashFIFO.  If not, see <http://www.gnu.org/licenses/>.
+
+ *************************************
+
+ This file implements the locks defined in flash_port.h with POSIX threads,
+ for Linux and the like. On an RTOS, provide flash_lock and flash_unlock
+ yourself instead.
+
+ ************************************/
+
+#include <pthread.h>
+#include "configure.h"
+#include "flash_port.h"
+
+#if FLASH_THREADS
+
+static pthread_mutex_t locks[FLASH_LOCK_MAX] = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER
+};
+
+void flash_lock(enum FLASH_LOCK lock)
+{
+    pthread_mutex_lock(&locks[lock]);
+}
+
+void flash_unlock(enum FLASH_LOCK lock)
+{
+    pthread_mutex_unlock(&locks[lock]);
+}
+#endif
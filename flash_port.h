@@ -37,6 +37,7 @@ extern "C"
 #endif
 
 #include <stdint.h>
+#include "configure.h"
 
     //initialize the flash parameters to match the physical layout
     void flash_init(void);
@@ -49,9 +50,84 @@ extern "C"
     //affect entire pages at a time. So be careful calling it!
     void flash_erase(uint32_t addr, size_t len);
 
+    //the erase geometry. Besides single pages, many parts can erase a larger
+    //block in one command, much faster per byte. Return the size of that
+    //block, a multiple of FLASH_PAGE_SIZE; flash_erase will only ever be asked
+    //to erase whole blocks that are aligned to it. Return FLASH_PAGE_SIZE if
+    //the part has no such command.
+    size_t flash_block_size(void);
+
+#if FLASH_ERASE_SUSPEND
+    //start an erase, just as flash_erase would do, but return without waiting
+    //for it to finish. Only one erase is ever under way at a time.
+    void flash_erase_start(uint32_t addr, size_t len);
+
+    //is an erase still under way?
+    uint8_t flash_erase_busy(void);
+
+    //pause the erase under way so that flash can be read, then carry on with
+    //it. Nothing but reads happens in between.
+    void flash_erase_suspend(void);
+    void flash_erase_resume(void);
+#endif
+
+#if FLASH_ASYNC
+    //called once a queued write is complete, with what flash_write would have
+    //returned for it. This may be from an interrupt.
+    typedef void (*flash_done_t)(void* context, int written);
+
+    //queue a write, just as flash_write would make it, and return without
+    //waiting for it. Queued writes are made one after another, in the order
+    //they were queued, and done is called for each as it completes. The data
+    //must stay put until then. Returns 0, queueing nothing, if the queue is
+    //full. Never called while an erase is under way.
+    uint8_t flash_write_submit(uint32_t addr, const void* data, size_t n, flash_done_t done, void* context);
+
+    //is a queued write still waiting or under way? Once this returns 0, done
+    //has been called for all of them. FlashFIFO polls it while it waits on the
+    //queue, and makes no other call on the flash but flash_write_submit until
+    //it returns 0.
+    uint8_t flash_write_busy(void);
+#endif
+
     //read a value from flash
     int flash_read(uint32_t addr, void* data, size_t n);
 
+#if FLASH_THREADS
+    //the locks FlashFIFO needs in order to be called from several threads at
+    //once. Different files may be worked on by different threads, as may the
+    //two ends of a split file, but a single handle must only be used by one
+    //thread at a time. FLASH_LOCK_BUS is taken around each flash transaction,
+    //and FLASH_LOCK_FILES while files are opened and closed. Neither is held
+    //for long, and where both are taken, FLASH_LOCK_FILES is taken first.
+    enum FLASH_LOCK
+    {
+        FLASH_LOCK_FILES,
+        FLASH_LOCK_BUS,
+        FLASH_LOCK_MAX
+    };
+
+    //take and give back one of the locks above, blocking until it is free. Any
+    //mutex will do: on an RTOS, create one for each lock up front, and take and
+    //give it here (xSemaphoreTake and xSemaphoreGive under FreeRTOS, say). The
+    //locks are never taken recursively, nor from an interrupt.
+    void flash_lock(enum FLASH_LOCK lock);
+    void flash_unlock(enum FLASH_LOCK lock);
+#endif
+
+#if FLASH_TICKS
+    //a free-running count of ticks, in whatever unit suits: the RTOS tick, say,
+    //or a hardware timer. It is only ever used to measure intervals, so may
+    //wrap around.
+    uint32_t flash_ticks(void);
+#endif
+
+#if FLASH_MAPPED
+    //return a pointer through which flash can be read directly, starting at
+    //addr. The contents change underneath it as flash is written and erased.
+    const uint8_t* flash_map(uint32_t addr);
+#endif
+
 
 #ifdef	__cplusplus
 }
@@ -40,15 +40,29 @@ OBJECTFILES= \
 	${OBJECTDIR}/Test/flash_port_mock.o \
 	${OBJECTDIR}/Test/test_main.o \
 	${OBJECTDIR}/FIFO.o \
-	${OBJECTDIR}/Test/FIFO_recover_handle_test.o
+	${OBJECTDIR}/Test/FIFO_recover_handle_test.o \
+	${OBJECTDIR}/Test/FIFO_split_handle_test.o \
+	${OBJECTDIR}/Test/FIFO_thread_test.o \
+	${OBJECTDIR}/Test/FIFO_cursor_test.o \
+	${OBJECTDIR}/Test/FIFO_async_test.o \
+	${OBJECTDIR}/Test/FIFO_coroutine_test.o \
+	${OBJECTDIR}/Test/FIFO_class_test.o \
+	${OBJECTDIR}/Test/FIFO_handle_test.o \
+	${OBJECTDIR}/Test/FIFO_seek_test.o \
+	${OBJECTDIR}/Test/FIFO_timing_test.o \
+	${OBJECTDIR}/Test/FIFO_stats_test.o \
+	${OBJECTDIR}/Test/FIFO_trace_test.o \
+	${OBJECTDIR}/Test/FIFO_wear_test.o \
+	${OBJECTDIR}/flash_lock_pthread.o \
+	${OBJECTDIR}/FIFO_trace.o
 
 
 # C Compiler Flags
 CFLAGS=-std=c99
 
 # CC Compiler Flags
-CCFLAGS=
-CXXFLAGS=
+CCFLAGS=-std=c++20
+CXXFLAGS=-std=c++20
 
 # Fortran Compiler Flags
 FFLAGS=
@@ -57,7 +71,7 @@ FFLAGS=
 ASFLAGS=
 
 # Link Libraries and Options
-LDLIBSOPTIONS=/usr/local/share/CppUTest/lib/libCppUTest.a
+LDLIBSOPTIONS=/usr/local/share/CppUTest/lib/libCppUTest.a -lpthread
 
 # Build Targets
 .build-conf: ${BUILD_SUBPROJECTS}
@@ -99,6 +113,76 @@ ${OBJECTDIR}/Test/FIFO_recover_handle_test.o: Test/FIFO_recover_handle_test.cpp
 	${RM} $@.d
 	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_recover_handle_test.o Test/FIFO_recover_handle_test.cpp
 
+${OBJECTDIR}/Test/FIFO_split_handle_test.o: Test/FIFO_split_handle_test.cpp 
+	${MKDIR} -p ${OBJECTDIR}/Test
+	${RM} $@.d
+	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_split_handle_test.o Test/FIFO_split_handle_test.cpp
+
+${OBJECTDIR}/Test/FIFO_thread_test.o: Test/FIFO_thread_test.cpp 
+	${MKDIR} -p ${OBJECTDIR}/Test
+	${RM} $@.d
+	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_thread_test.o Test/FIFO_thread_test.cpp
+
+${OBJECTDIR}/Test/FIFO_cursor_test.o: Test/FIFO_cursor_test.cpp 
+	${MKDIR} -p ${OBJECTDIR}/Test
+	${RM} $@.d
+	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_cursor_test.o Test/FIFO_cursor_test.cpp
+
+${OBJECTDIR}/Test/FIFO_async_test.o: Test/FIFO_async_test.cpp 
+	${MKDIR} -p ${OBJECTDIR}/Test
+	${RM} $@.d
+	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_async_test.o Test/FIFO_async_test.cpp
+
+${OBJECTDIR}/Test/FIFO_coroutine_test.o: Test/FIFO_coroutine_test.cpp 
+	${MKDIR} -p ${OBJECTDIR}/Test
+	${RM} $@.d
+	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_coroutine_test.o Test/FIFO_coroutine_test.cpp
+
+${OBJECTDIR}/Test/FIFO_class_test.o: Test/FIFO_class_test.cpp 
+	${MKDIR} -p ${OBJECTDIR}/Test
+	${RM} $@.d
+	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_class_test.o Test/FIFO_class_test.cpp
+
+${OBJECTDIR}/Test/FIFO_handle_test.o: Test/FIFO_handle_test.cpp 
+	${MKDIR} -p ${OBJECTDIR}/Test
+	${RM} $@.d
+	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_handle_test.o Test/FIFO_handle_test.cpp
+
+${OBJECTDIR}/Test/FIFO_seek_test.o: Test/FIFO_seek_test.cpp 
+	${MKDIR} -p ${OBJECTDIR}/Test
+	${RM} $@.d
+	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_seek_test.o Test/FIFO_seek_test.cpp
+
+${OBJECTDIR}/Test/FIFO_timing_test.o: Test/FIFO_timing_test.cpp 
+	${MKDIR} -p ${OBJECTDIR}/Test
+	${RM} $@.d
+	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_timing_test.o Test/FIFO_timing_test.cpp
+
+${OBJECTDIR}/Test/FIFO_stats_test.o: Test/FIFO_stats_test.cpp 
+	${MKDIR} -p ${OBJECTDIR}/Test
+	${RM} $@.d
+	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_stats_test.o Test/FIFO_stats_test.cpp
+
+${OBJECTDIR}/Test/FIFO_trace_test.o: Test/FIFO_trace_test.cpp 
+	${MKDIR} -p ${OBJECTDIR}/Test
+	${RM} $@.d
+	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_trace_test.o Test/FIFO_trace_test.cpp
+
+${OBJECTDIR}/Test/FIFO_wear_test.o: Test/FIFO_wear_test.cpp 
+	${MKDIR} -p ${OBJECTDIR}/Test
+	${RM} $@.d
+	$(COMPILE.cc) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/Test/FIFO_wear_test.o Test/FIFO_wear_test.cpp
+
+${OBJECTDIR}/flash_lock_pthread.o: flash_lock_pthread.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} $@.d
+	$(COMPILE.c) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/flash_lock_pthread.o flash_lock_pthread.c
+
+${OBJECTDIR}/FIFO_trace.o: FIFO_trace.c 
+	${MKDIR} -p ${OBJECTDIR}
+	${RM} $@.d
+	$(COMPILE.c) -g -I. -I/usr/local/share/CppUTest/include -MMD -MP -MF $@.d -o ${OBJECTDIR}/FIFO_trace.o FIFO_trace.c
+
 # Subprojects
 .build-subprojects:
 